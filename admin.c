@@ -0,0 +1,241 @@
+/**
+ * @file admin.c
+ * @brief line based admin port for operators, bound to localhost only
+ *
+ * -> Every line is a command word followed by its arguments, eg. "STATS".
+ *     Modules register their commands with admin_register before
+ *     admin_init, the reply format is up to each command. Unknown commands
+ *     are answered with "ERROR unknown command".
+ * -> One thread per admin connection, like the chat connections. Admin
+ *     traffic is rare so nothing here is tuned.
+ * -> SO_REUSEPORT lets the process taking over in a hot upgrade bind the
+ *     port while the old process still has it.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "admin.h"
+
+#define ADMIN_MAX_CMDS (16)
+#define ADMIN_LINE_LEN (4096)
+#define ADMIN_REPLY_LEN (4096)
+
+typedef struct AdminCmd{
+    const char* name;
+    admin_cmd_fn fn;
+}admin_cmd_t;
+
+static admin_cmd_t admin_cmds[ADMIN_MAX_CMDS];
+static int num_admin_cmds;
+
+/**
+ * @brief adds a command, only before admin_init
+ *
+ * @param name matched case insensitively against the first word of a line
+ * @param fn
+ * @return int 0 on success negative on error
+ */
+int admin_register(const char* name, admin_cmd_fn fn)
+{
+    if(num_admin_cmds == ADMIN_MAX_CMDS){
+        return -ENOSPC;
+    }
+
+    admin_cmds[num_admin_cmds].name = name;
+    admin_cmds[num_admin_cmds].fn = fn;
+    num_admin_cmds++;
+
+    return 0;
+}
+
+/**
+ * @brief printf to the admin connection
+ *
+ * @return int 0 on success negative on error
+ */
+int admin_reply(int fd, const char* fmt, ...)
+{
+    char buff[ADMIN_REPLY_LEN];
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buff, ADMIN_REPLY_LEN, fmt, args);
+    va_end(args);
+
+    if(len < 0){
+        return -EINVAL;
+    }
+    if(len >= ADMIN_REPLY_LEN){
+        len = ADMIN_REPLY_LEN - 1;
+    }
+
+    for(int off = 0; off < len;){
+
+        ssize_t n = send(fd, buff + off, len - off, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -errno;
+        }
+        off += n;
+    }
+
+    return 0;
+}
+
+static int run_command(int fd, char* line)
+{
+    char* args = line + strcspn(line, " \t");
+    if(*args){
+        *args++ = '\0';
+        args += strspn(args, " \t");
+    }
+
+    if(*line == '\0'){
+        return 0;
+    }
+
+    for(int i = 0; i < num_admin_cmds; i++){
+        if(strcasecmp(line, admin_cmds[i].name) == 0){
+            return admin_cmds[i].fn(fd, args);
+        }
+    }
+
+    return admin_reply(fd, "ERROR unknown command\n");
+}
+
+static void* admin_serve(void* arg)
+{
+    int fd = (int)(long)arg;
+    char* buff = (char*)malloc(ADMIN_LINE_LEN);
+    size_t filled = 0;
+
+    while(buff){
+
+        ssize_t n = read(fd, buff + filled, ADMIN_LINE_LEN - 1 - filled);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            break;
+        }
+        filled += n;
+        buff[filled] = '\0';
+
+        char* line = buff;
+        char* pos;
+        while((pos = strchr(line, '\n')) != NULL){
+
+            *pos = '\0';
+            if(pos > line && pos[-1] == '\r'){
+                pos[-1] = '\0';
+            }
+
+            if(run_command(fd, line) < 0){
+                goto out;
+            }
+            line = pos + 1;
+        }
+
+        filled -= line - buff;
+        memmove(buff, line, filled);
+
+        if(filled == ADMIN_LINE_LEN - 1){
+            admin_reply(fd, "ERROR line too long\n");
+            break;
+        }
+    }
+
+out:
+    free(buff);
+    close(fd);
+
+    return NULL;
+}
+
+static void* admin_accept(void* arg)
+{
+    int listenfd = (int)(long)arg;
+
+    while(1){
+
+        int fd = accept(listenfd, NULL, NULL);
+        if(fd < 0){
+            if(errno != EINTR){
+                perror("Error accepting admin connection");
+            }
+            continue;
+        }
+
+        pthread_t thread;
+        int err;
+        if((err = pthread_create(&thread, NULL, admin_serve,
+                                    (void*)(long)fd)) != 0){
+            printf("Error creating admin thread : %s\n", strerror(err));
+            close(fd);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief listens for admin connections on 127.0.0.1:port
+ *
+ * @return int 0 on success negative on error
+ */
+int admin_init(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listenfd < 0){
+        perror("Error creating admin socket");
+        return -errno;
+    }
+
+    int on = 1;
+    if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0){
+        perror("setsockopt failed");
+    }
+
+    if(bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 16) < 0){
+        int err = errno;
+        perror("Error binding admin port");
+        close(listenfd);
+        return -err;
+    }
+
+    pthread_t thread;
+    int err;
+    if((err = pthread_create(&thread, NULL, admin_accept,
+                                (void*)(long)listenfd)) != 0){
+        printf("Error creating admin thread : %s\n", strerror(err));
+        close(listenfd);
+        return -err;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
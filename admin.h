@@ -0,0 +1,18 @@
+#ifndef __ADMIN_H
+#define __ADMIN_H
+
+/**
+ * @brief handles one admin command
+ *
+ * @param fd admin connection, the reply is written to it
+ * @param args rest of the line after the command word, never NULL
+ * @return int negative closes the admin connection
+ */
+typedef int (*admin_cmd_fn)(int fd, char* args);
+
+int admin_register(const char* name, admin_cmd_fn fn);
+int admin_init(int port);
+int admin_reply(int fd, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif
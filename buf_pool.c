@@ -0,0 +1,84 @@
+/**
+ * @file buf_pool.c
+ * @brief shared pool of MAX_BUFF_LEN receive buffers
+ *
+ * -> Connections read into a small buffer inside user_t, only a line that
+ *     outgrows it borrows a full sized buffer from here, and gives it back
+ *     once the line was handled. Idle connections hold no buffer at all.
+ * -> Returned buffers are kept on a free list, up to max_free of them, the
+ *     rest go back to malloc. The list is linked through the buffers.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "buf_pool.h"
+#include "mem_acct.h"
+#include "utils.h"
+
+typedef struct FreeBuff{
+    struct FreeBuff* next;
+}free_buff_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static free_buff_t* free_head;
+static int num_free;
+static int pool_max_free;
+
+/**
+ * @brief sets how many spare buffers are kept around
+ *
+ * @param max_free 0 frees every buffer as soon as it is returned
+ */
+void buf_pool_init(int max_free)
+{
+    pool_max_free = max_free;
+}
+
+/**
+ * @brief a buffer of MAX_BUFF_LEN bytes
+ *
+ * @return char* NULL if out of memory
+ */
+char* buf_pool_get()
+{
+    pthread_mutex_lock(&pool_lock);
+
+    free_buff_t* buff = free_head;
+    if(buff){
+        free_head = buff->next;
+        num_free--;
+        mem_acct_add(MEM_RX_SPARE, -MAX_BUFF_LEN);
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    if(!buff && (buff = (free_buff_t*)malloc(MAX_BUFF_LEN)) == NULL){
+        printf("No memory for receive buffer\n");
+    }
+
+    return (char*)buff;
+}
+
+void buf_pool_put(char* buff)
+{
+    if(!buff){
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+
+    if(num_free < pool_max_free){
+        free_buff_t* node = (free_buff_t*)buff;
+        node->next = free_head;
+        free_head = node;
+        num_free++;
+        mem_acct_add(MEM_RX_SPARE, MAX_BUFF_LEN);
+        buff = NULL;
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    free(buff);
+}
@@ -0,0 +1,10 @@
+#ifndef __BUF_POOL_H
+#define __BUF_POOL_H
+
+#include <stddef.h>
+
+void buf_pool_init(int max_free);
+char* buf_pool_get();
+void buf_pool_put(char* buff);
+
+#endif
@@ -15,6 +15,8 @@
  * -> If room does not exist, new room is created.
  * -> Connection fd is stored in the room struct.
  * -> Everytime a new message is received, all users in that room get the message.
+ * -> /join and /leave add and drop more rooms on the same connection.
+ *     @see serve_command
  * 
  * 
  */
@@ -36,129 +38,629 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <getopt.h>
 
 #include "utils.h"
+#include "config.h"
+#include "presence.h"
+#include "payload.h"
+#include "history.h"
+#include "room_log.h"
+#include "conn.h"
+#include "buf_pool.h"
+#include "mem_acct.h"
+#include "admin.h"
+#include "frame.h"
+#include "user_dir.h"
+#include "intern.h"
+#include "rate_limit.h"
+#include "filter.h"
+#include "utf8.h"
+#include "dedup.h"
+#include "hot.h"
+#include "snapshot.h"
+#include "upgrade.h"
+#include "lock_prof.h"
 
-#define DEFAULT_PORT (1234)
 #define HOSTLEN (256)
+// rounds a resume reads the log without room->lock, @see join_room
+#define CATCH_UP_TRIES (3)
 #define SERVLEN (8)
 
-typedef struct user{
-    int connfd;
-    char* user_name;
-    char* room_name;
-}user_t;
-
 /**lock for access to trie APIs*/
 static pthread_mutex_t trie_lock;
 
+server_config_t server_config = {
+    .port = DEFAULT_PORT,
+    .presence_threshold = DEFAULT_PRESENCE_THRESHOLD,
+    .presence_interval_ms = DEFAULT_PRESENCE_INTERVAL_MS,
+    .history_msgs = DEFAULT_HISTORY_MSGS,
+    .history_bytes = DEFAULT_HISTORY_BYTES,
+    .log_dir = NULL,
+    .log_shards = DEFAULT_LOG_SHARDS,
+    .log_segment_bytes = DEFAULT_LOG_SEGMENT_BYTES,
+    .log_retain_bytes = DEFAULT_LOG_RETAIN_BYTES,
+    .log_retain_sec = 0,
+    .snapshot_path = NULL,
+    .upgrade_path = NULL,
+    .join_timeout_sec = DEFAULT_JOIN_TIMEOUT_SEC,
+    .idle_timeout_sec = 0,
+    .heartbeat_sec = 0,
+    .rx_pool_buffers = DEFAULT_RX_POOL_BUFFERS,
+    .admin_port = 0,
+    .conn_mem_max = 0,
+    .room_mem_max = 0,
+    .mem_max = 0,
+};
+
+/** set by SIGTERM/SIGINT, main saves the snapshot and exits */
+static volatile sig_atomic_t shutting_down;
+
 /** strings for standard entry and exit process */
 static const char error_buff[] = "ERROR\n";
+static const char ping_buff[] = "PING\n";
 static const char join_buff[] = "has joined\n";
 static const char left_buff[] = "has left\n";
 
 void usage()
 {
-    printf(" Usage: ./chat_server <optional-port-number>");
+    printf(" Usage: ./chat_server [options] <optional-port-number>\n"
+           "  --presence-threshold=N    coalesce joins/leaves of rooms with at"
+           " least N members, 0 disables (default %d)\n"
+           "  --presence-interval-ms=N  time between two presence digests"
+           " (default %d)\n"
+           "  --history-msgs=N          messages per room replayed on join,"
+           " 0 disables (default %d)\n"
+           "  --history-bytes=N         byte cap of a room's history, 0 for"
+           " none (default %d)\n"
+           "  --log-dir=DIR             append every message to a durable log"
+           " in DIR\n"
+           "  --log-shards=N            log files rooms are spread over"
+           " (default %d)\n"
+           "  --log-segment-bytes=N     size at which a log segment is rolled"
+           " (default %d)\n"
+           "  --log-retain-bytes=N      log bytes kept per shard, 0 for all"
+           " (default %ld)\n"
+           "  --log-retain-sec=N        age after which segments are removed,"
+           " 0 for never\n"
+           "  --snapshot=PATH           save rooms to PATH on SIGTERM/SIGINT,"
+           " restore them on start\n"
+           "  --upgrade-socket=PATH     take over from the server waiting on"
+           " PATH, then wait there for the next upgrade\n"
+           "  --join-timeout-sec=N      drop connections that do not JOIN"
+           " within N seconds, 0 for never (default %d)\n"
+           "  --idle-timeout-sec=N      drop members nothing was read from"
+           " for N seconds, 0 for never\n"
+           "  --heartbeat-sec=N         send PING to members silent for N"
+           " seconds, 0 for never\n"
+           "  --rx-pool-buffers=N       spare receive buffers for long lines"
+           " kept around (default %d)\n"
+           "  --admin-port=N            serve admin commands like STATS on"
+           " 127.0.0.1:N\n"
+           "  --conn-mem-max=N          bytes a connection may hold, 0 for"
+           " no cap\n"
+           "  --room-mem-max=N          bytes a room may hold for members and"
+           " history, 0 for no cap\n"
+           "  --mem-max=N               turn new connections away above N"
+           " bytes held in total, 0 for no cap\n"
+           "  --rate-msgs=N             messages a connection may send per"
+           " second, 0 for no limit\n"
+           "  --rate-bytes=N            bytes a connection may send per"
+           " second, 0 for no limit\n"
+           "  --rate-policy=POLICY      drop, delay or disconnect for"
+           " messages over the limit (default drop)\n"
+           "  --filter=PATH             drop messages containing a phrase"
+           " listed in PATH, one per line\n"
+           "  --validate-utf8           drop clients sending lines that are"
+           " not UTF-8 or hold control characters\n"
+           "  --dedup-window-ms=N       drop a line a connection repeats"
+           " within N ms, 0 for never\n"
+           "  --dedup-room              also drop a line anyone sent to the"
+           " room within the window\n"
+           "  --hot-interval-ms=N       track the busiest rooms and users over"
+           " N ms for the admin HOT command, 0 for off\n",
+           DEFAULT_PRESENCE_THRESHOLD, DEFAULT_PRESENCE_INTERVAL_MS,
+           DEFAULT_HISTORY_MSGS, DEFAULT_HISTORY_BYTES, DEFAULT_LOG_SHARDS,
+           DEFAULT_LOG_SEGMENT_BYTES, DEFAULT_LOG_RETAIN_BYTES,
+           DEFAULT_JOIN_TIMEOUT_SEC, DEFAULT_RX_POOL_BUFFERS);
 }
 
+enum {
+    OPT_PRESENCE_THRESHOLD = 256,
+    OPT_PRESENCE_INTERVAL_MS,
+    OPT_HISTORY_MSGS,
+    OPT_HISTORY_BYTES,
+    OPT_LOG_DIR,
+    OPT_LOG_SHARDS,
+    OPT_LOG_SEGMENT_BYTES,
+    OPT_LOG_RETAIN_BYTES,
+    OPT_LOG_RETAIN_SEC,
+    OPT_SNAPSHOT,
+    OPT_UPGRADE_SOCKET,
+    OPT_JOIN_TIMEOUT_SEC,
+    OPT_IDLE_TIMEOUT_SEC,
+    OPT_HEARTBEAT_SEC,
+    OPT_RX_POOL_BUFFERS,
+    OPT_ADMIN_PORT,
+    OPT_CONN_MEM_MAX,
+    OPT_ROOM_MEM_MAX,
+    OPT_MEM_MAX,
+    OPT_RATE_MSGS,
+    OPT_RATE_BYTES,
+    OPT_RATE_POLICY,
+    OPT_FILTER,
+    OPT_VALIDATE_UTF8,
+    OPT_DEDUP_WINDOW_MS,
+    OPT_DEDUP_ROOM,
+    OPT_HOT_INTERVAL_MS,
+};
+
+static const struct option long_options[] = {
+    {"presence-threshold",   required_argument, NULL, OPT_PRESENCE_THRESHOLD},
+    {"presence-interval-ms", required_argument, NULL, OPT_PRESENCE_INTERVAL_MS},
+    {"history-msgs",         required_argument, NULL, OPT_HISTORY_MSGS},
+    {"history-bytes",        required_argument, NULL, OPT_HISTORY_BYTES},
+    {"log-dir",              required_argument, NULL, OPT_LOG_DIR},
+    {"log-shards",           required_argument, NULL, OPT_LOG_SHARDS},
+    {"log-segment-bytes",    required_argument, NULL, OPT_LOG_SEGMENT_BYTES},
+    {"log-retain-bytes",     required_argument, NULL, OPT_LOG_RETAIN_BYTES},
+    {"log-retain-sec",       required_argument, NULL, OPT_LOG_RETAIN_SEC},
+    {"snapshot",             required_argument, NULL, OPT_SNAPSHOT},
+    {"upgrade-socket",       required_argument, NULL, OPT_UPGRADE_SOCKET},
+    {"join-timeout-sec",     required_argument, NULL, OPT_JOIN_TIMEOUT_SEC},
+    {"idle-timeout-sec",     required_argument, NULL, OPT_IDLE_TIMEOUT_SEC},
+    {"heartbeat-sec",        required_argument, NULL, OPT_HEARTBEAT_SEC},
+    {"rx-pool-buffers",      required_argument, NULL, OPT_RX_POOL_BUFFERS},
+    {"admin-port",           required_argument, NULL, OPT_ADMIN_PORT},
+    {"conn-mem-max",         required_argument, NULL, OPT_CONN_MEM_MAX},
+    {"room-mem-max",         required_argument, NULL, OPT_ROOM_MEM_MAX},
+    {"mem-max",              required_argument, NULL, OPT_MEM_MAX},
+    {"rate-msgs",            required_argument, NULL, OPT_RATE_MSGS},
+    {"rate-bytes",           required_argument, NULL, OPT_RATE_BYTES},
+    {"rate-policy",          required_argument, NULL, OPT_RATE_POLICY},
+    {"filter",               required_argument, NULL, OPT_FILTER},
+    {"validate-utf8",        no_argument,       NULL, OPT_VALIDATE_UTF8},
+    {"dedup-window-ms",      required_argument, NULL, OPT_DEDUP_WINDOW_MS},
+    {"dedup-room",           no_argument,       NULL, OPT_DEDUP_ROOM},
+    {"hot-interval-ms",      required_argument, NULL, OPT_HOT_INTERVAL_MS},
+    {"help",                 no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
 
 /**
- * @brief fills in the use
- * 
- * @param buff 
- * @param user_info 
- * @return int 
+ * @brief fills server_config from the command line
+ *
+ * @return int 0 on success, negative if the arguments are not understood
+ */
+static int parse_args(int argc, char *argv[])
+{
+    int opt;
+    rate_policy_t policy;
+
+    while((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1){
+
+        switch(opt){
+        case OPT_PRESENCE_THRESHOLD:
+            server_config.presence_threshold = atoi(optarg);
+            break;
+        case OPT_PRESENCE_INTERVAL_MS:
+            server_config.presence_interval_ms = atoi(optarg);
+            break;
+        case OPT_HISTORY_MSGS:
+            server_config.history_msgs = atoi(optarg);
+            break;
+        case OPT_HISTORY_BYTES:
+            server_config.history_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_LOG_DIR:
+            server_config.log_dir = optarg;
+            break;
+        case OPT_LOG_SHARDS:
+            server_config.log_shards = atoi(optarg);
+            break;
+        case OPT_LOG_SEGMENT_BYTES:
+            server_config.log_segment_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_LOG_RETAIN_BYTES:
+            server_config.log_retain_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_LOG_RETAIN_SEC:
+            server_config.log_retain_sec = atoi(optarg);
+            break;
+        case OPT_SNAPSHOT:
+            server_config.snapshot_path = optarg;
+            break;
+        case OPT_UPGRADE_SOCKET:
+            server_config.upgrade_path = optarg;
+            break;
+        case OPT_JOIN_TIMEOUT_SEC:
+            server_config.join_timeout_sec = atoi(optarg);
+            break;
+        case OPT_IDLE_TIMEOUT_SEC:
+            server_config.idle_timeout_sec = atoi(optarg);
+            break;
+        case OPT_HEARTBEAT_SEC:
+            server_config.heartbeat_sec = atoi(optarg);
+            break;
+        case OPT_RX_POOL_BUFFERS:
+            server_config.rx_pool_buffers = atoi(optarg);
+            break;
+        case OPT_ADMIN_PORT:
+            server_config.admin_port = atoi(optarg);
+            break;
+        case OPT_CONN_MEM_MAX:
+            server_config.conn_mem_max = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_ROOM_MEM_MAX:
+            server_config.room_mem_max = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_MEM_MAX:
+            server_config.mem_max = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_RATE_MSGS:
+            server_config.rate_msgs = atoi(optarg);
+            break;
+        case OPT_RATE_BYTES:
+            server_config.rate_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_RATE_POLICY:
+            if(rate_policy_parse(optarg, &policy) < 0){
+                return -EINVAL;
+            }
+            server_config.rate_policy = policy;
+            break;
+        case OPT_FILTER:
+            server_config.filter_path = optarg;
+            break;
+        case OPT_VALIDATE_UTF8:
+            server_config.validate_utf8 = true;
+            break;
+        case OPT_DEDUP_WINDOW_MS:
+            server_config.dedup_window_ms = atoi(optarg);
+            break;
+        case OPT_DEDUP_ROOM:
+            server_config.dedup_room = true;
+            break;
+        case OPT_HOT_INTERVAL_MS:
+            server_config.hot_interval_ms = atoi(optarg);
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    if(argc - optind > 1){
+        return -EINVAL;
+    }
+
+    if(optind < argc){
+        server_config.port = atoi(argv[optind]);
+    }
+
+    if(server_config.presence_threshold < 0 ||
+        server_config.presence_interval_ms <= 0 ||
+        server_config.history_msgs < 0 || server_config.log_shards <= 0 ||
+        server_config.log_segment_bytes == 0 ||
+        server_config.log_retain_sec < 0 || server_config.join_timeout_sec < 0
+        || server_config.idle_timeout_sec < 0 || server_config.heartbeat_sec < 0
+        || server_config.rx_pool_buffers < 0 || server_config.admin_port < 0
+        || server_config.rate_msgs < 0 || server_config.dedup_window_ms < 0
+        || server_config.hot_interval_ms < 0){
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+
+static void build_prefix(user_t* user_info)
+{
+    memcpy(user_info->prefix, user_info->user_name, user_info->user_name_len);
+    user_info->prefix[user_info->user_name_len] = ':';
+    user_info->prefix[user_info->user_name_len + 1] = ' ';
+    user_info->prefix_len = user_info->user_name_len + 2;
+}
+
+/**
+ * @brief interns the names of the JOIN, freed with the connection
+ *
+ * @return int 0 on success, -EINVAL for names that are not valid text,
+ *          -ENOMEM if out of memory
  */
-static int validate_join(const char* buff, user_t *user_info)
+static int set_names(user_t* user_info, const char* room_name,
+                        size_t room_name_len, const char* user_name,
+                        size_t user_name_len)
 {
-    if(!user_info){
-        printf("inval arg\n");
+    if(server_config.validate_utf8 &&
+        (!utf8_valid_line(room_name, room_name_len) ||
+         !utf8_valid_line(user_name, user_name_len))){
+        printf("invalid UTF-8\n");
         return -EINVAL;
     }
 
-    char user_name[MAX_USERNAME_LEN];
-    memset(user_name, 0 , MAX_USERNAME_LEN);
+    user_info->user_name = intern_name(user_name, user_name_len);
+    user_info->user_name_len = user_name_len;
 
-    char room_name[MAX_ROOMNAME_LEN];
-    memset(room_name, 0 , MAX_ROOMNAME_LEN);
+    user_info->room_name = intern_name(room_name, room_name_len);
+    user_info->room_name_len = room_name_len;
+
+    if(!user_info->user_name || !user_info->room_name){
+        return -ENOMEM;
+    }
+
+    build_prefix(user_info);
+
+    return 0;
+}
 
-    char join_str[JOIN_STR_LEN];
-    memset(join_str, 0 , JOIN_STR_LEN);
+static bool is_join_space(char c)
+{
+    // what sscanf's %s used to split on
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/**
+ * @brief next whitespace separated token of the join line or a command
+ *
+ * @param pos where to start, moved past the token
+ * @param end end of the line
+ * @param len length of the token, 0 at the end of the line
+ * @return const char* start of the token
+ */
+static const char* join_token(const char** pos, const char* end, size_t* len)
+{
+    const char* p = *pos;
+
+    while(p < end && is_join_space(*p)){
+        p++;
+    }
+
+    const char* start = p;
+
+    while(p < end && !is_join_space(*p)){
+        p++;
+    }
+
+    *len = p - start;
+    *pos = p;
+
+    return start;
+}
+
+/**
+ * @brief decimal sequence number of a JOIN or /join, 0 if len is 0
+ *
+ * @return int 0 on success, -1 if it is not a number or too large
+ */
+static int parse_seq(const char* seq_str, size_t len, uint64_t* seq)
+{
+    *seq = 0;
+
+    for(size_t i = 0; i < len; i++){
+
+        unsigned digit = seq_str[i] - '0';
+
+        if(digit > 9 || *seq > (UINT64_MAX - digit) / 10){
+            return -1;
+        }
+        *seq = *seq*10 + digit;
+    }
+
+    return 0;
+}
 
-    int ret;
+/**
+ * @brief fills in the user and room name from the join request
+ *
+ * -> JOIN <room> <user> <seq> is the resume form, the client gets sequence
+ *     numbered lines and everything after <seq> it missed. <seq> 0 asks for
+ *     sequence numbers without having seen anything.
+ * -> one pass over the line in the receive buffer, every token is length
+ *     checked before it is copied into the inline names of user_info.
+ *     Tokens after <seq> are ignored.
+ * 
+ * @param line start of the join line
+ * @param line_len bytes up to, not including, the newline
+ * @param user_info 
+ * @return int 0 on success negative if the request is malformed
+ */
+static int validate_join(const char* line, size_t line_len, user_t *user_info)
+{
+    const char* pos = line;
+    const char* end = line + line_len;
+    size_t len;
 
-    if ((ret = sscanf(buff, "%s %s %s", join_str, room_name, user_name))
-                 != 3) {
+    const char* join_str = join_token(&pos, end, &len);
+    if(len != JOIN_STR_LEN-1 || strncasecmp(join_str, "join", len) != 0){
         printf("malformed request\n");
         return -1;
     }
 
-    int join_str_len  = strnlen(join_str, JOIN_STR_LEN);
-    int user_name_len = strnlen(user_name, MAX_USERNAME_LEN);
-    int room_name_len = strnlen(room_name, MAX_ROOMNAME_LEN);
+    const char* room_name = join_token(&pos, end, &len);
+    size_t room_name_len = len;
+
+    const char* user_name = join_token(&pos, end, &len);
+    size_t user_name_len = len;
 
-    if(user_name_len == MAX_USERNAME_LEN || room_name_len == MAX_USERNAME_LEN
-        || join_str_len == JOIN_STR_LEN){
+    if(room_name_len == 0 || room_name_len >= MAX_ROOMNAME_LEN ||
+        user_name_len == 0 || user_name_len >= MAX_USERNAME_LEN){
         printf("malformed request\n");
         return -1;
     }
 
-    if(strncasecmp(join_str, "join", JOIN_STR_LEN) != 0){
+    const char* seq_str = join_token(&pos, end, &len);
+
+    user_info->wants_seq = (len > 0);
+
+    if(parse_seq(seq_str, len, &user_info->resume_seq) < 0){
         printf("malformed request\n");
         return -1;
     }
 
-    user_info->user_name = (char*)malloc(user_name_len+1*sizeof(char));
+    return set_names(user_info, room_name, room_name_len, user_name,
+                        user_name_len);
+}
+
+/**
+ * @brief binary counterpart of validate_join, @see frame.c
+ *
+ * -> names must not hold whitespace or 0 bytes, like text names
+ *
+ * @param frame the whole JOIN frame, length prefix included
+ * @param frame_len
+ * @param user_info
+ * @return int 0 on success negative if the request is malformed
+ */
+static int validate_join_frame(const char* frame, size_t frame_len,
+                                user_t* user_info)
+{
+    uint64_t len;
+    int n = frame_varint_get((const uint8_t*)frame, frame_len, &len);
+
+    const uint8_t* pos = (const uint8_t*)frame + n;
+    const uint8_t* end = (const uint8_t*)frame + frame_len;
 
-    if(!(user_info->user_name)){
-        perror(" Malloc failed ");
-        return -errno;
+    if(n <= 0 || *pos++ != FRAME_JOIN){
+        return -1;
     }
 
-    strncpy(user_info->user_name, user_name, user_name_len);
-    user_info->user_name[user_name_len] = '\0';
+    const char* names[2];
+    size_t name_lens[2];
+    size_t max_lens[2] = {MAX_ROOMNAME_LEN, MAX_USERNAME_LEN};
+
+    for(int i = 0; i < 2; i++){
 
+        if(pos == end || *pos == 0 || *pos >= max_lens[i] ||
+            *pos > end - pos - 1){
+            return -1;
+        }
 
-    user_info->room_name = (char*)malloc(room_name_len+1*sizeof(char));
+        name_lens[i] = *pos++;
+        names[i] = (const char*)pos;
+        pos += name_lens[i];
 
-    if(!(user_info->room_name)){
-        perror(" Malloc failed");
-        return -errno;
+        for(size_t j = 0; j < name_lens[i]; j++){
+            if(names[i][j] == '\0' || is_join_space(names[i][j])){
+                return -1;
+            }
+        }
     }
 
-    strncpy(user_info->room_name, room_name, room_name_len);
-    user_info->room_name[room_name_len] = '\0';
+    user_info->wants_seq = (pos < end);
+    user_info->resume_seq = 0;
 
-    return 0;
+    if(user_info->wants_seq &&
+        frame_varint_get(pos, end - pos, &user_info->resume_seq) <= 0){
+        return -1;
+    }
+
+    return set_names(user_info, names[0], name_lens[0], names[1],
+                        name_lens[1]);
 }
 
 /**
- * @brief robustly reads n bytes from a network fd to buffer
+ * @brief reads from the connection until its receive buffer holds at least
+ *          one complete line
  * 
  * -> avoids the short count situation in case of network sockets
  * 
+ * -> reads go into the small buffer inside user_t, a line longer than that
+ *     borrows a buffer from the pool. @see conn_rx_reserve
+ * 
+ * -> a hot upgrade parks the thread here, with whatever was read so far
+ * 
  * @param fd connection file descriptor
- * @param buf buffer to be read into
  * @param init hunts for the join request, validates join command if true
- * @param user_info if it is a join request then user name and room name is
- *                  added to this struct. If init is false user_info is NULL
+ * @param user_info the connection. If it is a join request then user name
+ *                  and room name is added to this struct
  *
- * @return int start index of actual messages or negative on error
+ * @return char* start of the lines in user_info->rx or NULL on error
  * 
  * -> When packet is JOIN cooking amol<NL>hello<NL>Whats up<NL> 
  * -> Return value will be postion of hello.
  * -> When packet is JOIN cooking amol<NL>, retrn value will point after <NL>
  */
-static char* read_wrapper(int fd, void* buff, bool init, user_t* user_info)
+static char* read_wrapper(int fd, bool init, user_t* user_info)
 {
-    size_t remainder = MAX_BUFF_LEN;
+    size_t remainder;
+    size_t scanned = 0;
     ssize_t n;
-    char* start_ptr = buff;
 
-    while (remainder > 0) {
+    while (true) {
+
+        // the very first byte picks the protocol of the connection
+        if(init && !user_info->binary && user_info->rx_len > 0 &&
+            (uint8_t)user_info->rx[0] == FRAME_MAGIC){
+            user_info->binary = true;
+            conn_rx_consume(user_info, 1);
+        }
+
+        if(user_info->binary){
+
+            ssize_t frame_len = frame_complete(user_info->rx,
+                                                user_info->rx_len,
+                                                MAX_BUFF_LEN - 1);
+            if(frame_len < 0){
+                printf("Malformed frame\n");
+                return NULL;
+            }
+
+            if(frame_len > 0){
+
+                if(init){
+                    if(validate_join_frame(user_info->rx, frame_len,
+                                            user_info) < 0){
+                        printf("Malformed join req\n");
+                        return NULL;
+                    }
+
+                    return user_info->rx + frame_len;
+                }
+
+                return user_info->rx;
+            }
+
+        } else {
+
+            char* pos;
+            if(user_info->rx &&
+                (pos = memchr(user_info->rx + scanned, MSG_DELIMETER,
+                                user_info->rx_len - scanned)) != NULL) {
+
+                if(init){
+                    if(validate_join(user_info->rx, pos - user_info->rx,
+                                        user_info) < 0) {
+                        printf("Malformed join req\n");
+                        return NULL;
+                    }
+
+                    init = false;// should not validate again
+
+                    return (char*)(pos+1); // since pos points to newline
+                }
+
+                return user_info->rx;
+            }
+
+            scanned = user_info->rx_len;
+        }
+
+        // line too long for any buffer
+        if((remainder = conn_rx_reserve(user_info)) == 0){
+            return NULL;
+        }
+
+        if(upgrade_in_progress()){
+            upgrade_park(user_info);
+        }
 
-        if ((n = read(fd, buff, remainder)) < 0) {
+        if ((n = read(fd, user_info->rx + user_info->rx_len, remainder)) < 0) {
+            if(errno == EINTR){
+                continue;
+            }
             perror("Error in read_wrapper:");
             return NULL;
         }
@@ -167,369 +669,1827 @@ static char* read_wrapper(int fd, void* buff, bool init, user_t* user_info)
             return NULL;
         }
 
-        char* pos;
-        if((pos = strchr(start_ptr, MSG_DELIMETER)) != NULL) {
+        // checked lazily by the connection timer, no re-arming per read
+        __atomic_store_n(&user_info->last_active_ms, timer_now_ms(),
+                            __ATOMIC_RELAXED);
+
+        user_info->rx_len += n;
+        user_info->rx[user_info->rx_len] = '\0';
+    }
+}
+
+/**
+ * @brief sends ERROR and closes fd, closed even if the client is gone
+ *
+ * @return int 0 on success, negative if the ERROR could not be sent
+ */
+static int client_error(int fd, bool binary)
+{
+    uint8_t hdr[FRAME_HDR_MAX];
+    struct iovec iov = {(void*)error_buff, strlen(error_buff)};
+
+    if(binary){
+        iov = (struct iovec){hdr, frame_hdr(hdr, FRAME_ERROR, 0)};
+    }
+
+    int err = writev_all(fd, &iov, 1);
+
+    if(close(fd) < 0){
+        perror("error in close");
+        return err ? err : -errno;
+    }
+
+    return err;
+}
+
+/**
+ * @brief sends a chat message to everyone in the room and everyone watching
+ *          it, and keeps it in the room history
+ *
+ * @param room
+ * @param payload preformatted message, the history takes its own reference
+ * @param fp hash of the line to drop it if the room saw it lately, 0 to
+ *          always send. @see dedup.c
+ * @return int 0 on success negative on error
+ */
+static int broadcast_msg(chat_room_t* room, payload_t* payload, uint64_t fp)
+{
+    int err;
+
+    if((err = pthread_mutex_lock(&room->lock)) != 0){
+        printf("Error locking room mutex : %s", strerror(err));
+
+        return -err;
+    }
+
+    if(fp && dedup_room_seen_locked(room, fp, timer_now_ms())){
+        pthread_mutex_unlock(&room->lock);
+        return 0;
+    }
+
+    payload_set_seq(payload, ++room->last_seq);
+
+    hot_add(HOT_ROOM_MSGS, room->room_name, 1);
+    hot_add(HOT_ROOM_BYTES, room->room_name,
+            (uint64_t)payload->len * room->num_people);
+
+    room_send_payload_locked(room, payload);
+
+    room_send_watchers_locked(room, payload);
+
+    history_push(room, payload);
+
+    room_log_append(room->room_name, payload);
+
+    if((err = pthread_mutex_unlock(&room->lock)) != 0){
+        printf("Error unlocking room mutex : %s", strerror(err));
+        return -err;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief sends a member the messages it has not seen, caller holds room->lock
+ *
+ * -> a plain JOIN gets the history ring. A resuming JOIN gets everything
+ *     after its sequence number, from the log for what the ring no longer
+ *     holds and from the ring for the rest.
+ * -> join_room reads the log before it takes room->lock, catch_up only does
+ *     if the ring moved on too often meanwhile
+ *
+ */
+typedef struct CatchUp{
+    int fd;
+    bool binary;
+    const char* tag;    // NULL unless the member is in several rooms
+    int tag_len;
+    uint64_t last_seq;  // of the last message sent
+    int err;
+}catch_up_t;
+
+static void send_logged(const log_record_t* rec, const char* data, void* arg)
+{
+    catch_up_t* catch_up = (catch_up_t*)arg;
+
+    if(catch_up->err){
+        return;
+    }
+
+    struct iovec iov[3];
+    int iovcnt;
+    uint8_t hdr[FRAME_HDR_MAX];
+    char seq_buff[PAYLOAD_SEQ_ROOM + 1];
+    char* text = NULL;
+
+    // a message of a binary member, one line for text members as it was live
+    if(!catch_up->binary && rec->len > 1 &&
+        memchr(data, MSG_DELIMETER, rec->len - 1)){
+
+        if(!(text = (char*)malloc(rec->len))){
+            catch_up->err = -ENOMEM;
+            return;
+        }
+
+        memcpy(text, data, rec->len);
+        for(size_t i = 0; i < rec->len - 1; i++){
+            if(text[i] == MSG_DELIMETER){
+                text[i] = ' ';
+            }
+        }
+        data = text;
+    }
+
+    if(catch_up->binary){
+        iovcnt = frame_msg_iov(iov, hdr, data, rec->len, rec->seq);
+    } else {
+        int seq_len = snprintf(seq_buff, sizeof(seq_buff), "#%llu ",
+                                (unsigned long long)rec->seq);
+
+        iovcnt = 0;
+        if(catch_up->tag){
+            iov[iovcnt].iov_base = (void*)catch_up->tag;
+            iov[iovcnt].iov_len = catch_up->tag_len;
+            iovcnt++;
+        }
+        iov[iovcnt].iov_base = seq_buff;
+        iov[iovcnt].iov_len = seq_len;
+        iov[iovcnt+1].iov_base = (void*)data;
+        iov[iovcnt+1].iov_len = rec->len;
+        iovcnt += 2;
+    }
+
+    int err = writev_all(catch_up->fd, iov, iovcnt);
+    free(text);
+
+    if(err < 0){
+        perror("Error sending logged message");
+        catch_up->err = err;
+        return;
+    }
+
+    catch_up->last_seq = rec->seq;
+}
+
+/**
+ * @brief sends the logged messages of the room between after_seq and
+ *          before_seq, both excluded
+ *
+ * @param tag put in front of every message, NULL for none
+ * @param after_seq the member has seen, set to the last one sent
+ * @return int 0 on success negative on error
+ */
+static int send_log(const user_t* user_info, const char* room_name,
+                    const char* tag, int tag_len, uint64_t* after_seq,
+                    uint64_t before_seq)
+{
+    catch_up_t log_catch_up = {
+        .fd = user_info->connfd,
+        .binary = user_info->binary,
+        .tag = tag,
+        .tag_len = tag_len,
+        .last_seq = *after_seq,
+        .err = 0,
+    };
+
+    room_log_read(room_name, *after_seq, before_seq, send_logged,
+                    &log_catch_up);
+
+    *after_seq = log_catch_up.last_seq;
+
+    return log_catch_up.err;
+}
+
+/**
+ * @param after_seq sequence number the member has seen, only used if it
+ *          asked for sequence numbers
+ */
+static int catch_up(chat_room_t* room, user_t* user_info, uint64_t after_seq)
+{
+    if(!user_info->wants_seq){
+        return history_replay(room, user_info, 0);
+    }
+
+    // numbering started over (room was gone and not logged), send it all
+    if(after_seq > room->last_seq){
+        after_seq = 0;
+    }
+
+    uint64_t oldest = history_oldest_seq(room);
+
+    int err;
+    if(after_seq + 1 < oldest && room_log_enabled() &&
+        (err = send_log(user_info, room->room_name,
+                        user_info->tagged ? room->tag : NULL, room->tag_len,
+                        &after_seq, oldest)) < 0){
+        return err;
+    }
+
+    return history_replay(room, user_info, after_seq);
+}
+
+/**
+ * @brief tells the room that user joined or left, caller holds room->lock
+ *
+ * -> in rooms with at least presence_threshold members the event is folded
+ *     into the next periodic digest instead. @see presence.c
+ * -> members following the roster always get the event on its own
+ *
+ */
+static void announce_presence(chat_room_t* room, const char* user_name,
+                                bool joined)
+{
+    room_roster_diff_locked(room, user_name, joined);
+
+    if(server_config.presence_threshold > 0 &&
+        room->num_people >= server_config.presence_threshold){
+
+        presence_note(room, user_name, joined);
+        return;
+    }
+
+    char out_buff[MAX_USERNAME_LEN + sizeof(join_buff) + 2];
+
+    int len = snprintf(out_buff, sizeof(out_buff), "%s %s\n", user_name,
+                        joined ? join_buff : left_buff);
+
+    room_broadcast_locked(room, out_buff, len);
+}
+
+/**
+ * @brief deletes the room with the given name if nobody is in it anymore
+ *
+ * -> looked up again under trie_lock since another user may have joined, or
+ *     even left and deleted it, after our room->lock was dropped.
+ *
+ * @param room_name
+ */
+static void reap_room(const char* room_name)
+{
+    int err;
+
+    if((err = pthread_mutex_lock(&trie_lock)) != 0){
+        printf("Error locking trie mutex : %s", strerror(err));
+        return;
+    }
+
+    chat_room_t* room = search_room(room_name);
+
+    if(room){
+        pthread_mutex_lock(&room->lock);
+        bool empty = (room->num_people == 0);
+        if(empty){
+            presence_cancel(room);
+        }
+        pthread_mutex_unlock(&room->lock);
+
+        if(empty && delete_room(room) < 0){
+            printf("Error in deleting room\n");
+        }
+    }
+
+    if((err = pthread_mutex_unlock(&trie_lock)) != 0){
+        printf("Error unlocking trie mutex : %s", strerror(err));
+    }
+}
+
+/**
+ * @brief finds or creates the room and locks it
+ *
+ * -> room->lock is taken before trie_lock is dropped, a room which is in the
+ *     trie and locked can not be deleted under us.
+ *
+ * @param created set if the room was made here, numbered on from the log
+ * @return chat_room_t* NULL on error
+ */
+static chat_room_t* lock_room(const char* room_name, bool* created)
+{
+    int err;
+    chat_room_t* room;
+
+    if((err = pthread_mutex_lock(&trie_lock)) != 0){
+        printf("Error locking trie mutex : %s", strerror(err));
+        return NULL;
+    }
+
+    room = search_room(room_name);
+
+    *created = false;
+    if(!room){
+        room = create_room(room_name);
+        *created = true;
+    }
+
+    if(!room){
+        printf("Error creating room\n");
+        pthread_mutex_unlock(&trie_lock);
+        return NULL;
+    }
+
+    if((err = pthread_mutex_lock(&room->lock)) != 0){
+        printf("Error locking room mutex : %s", strerror(err));
+        pthread_mutex_unlock(&trie_lock);
+        return NULL;
+    }
+
+    if((err = pthread_mutex_unlock(&trie_lock)) != 0){
+        printf("Error unlocking trie mutex : %s", strerror(err));
+    }
+
+    // continue numbering where the logged messages of this room left off
+    if(*created){
+        room->last_seq = room_log_last_seq(room->room_name);
+    }
+
+    return room;
+}
+
+/**
+ * @brief finds or creates the room and adds the user to it
+ *
+ * -> the member set of the room and the room set of the connection are
+ *     both changed under room->lock
+ * -> a resume from before the ring of the room is sent from the log with no
+ *     lock held, the disk and a slow client do not stall the room. Then the
+ *     room is locked again and only the ring after the last message sent is
+ *     replayed. If the ring moved past that meanwhile the log is read again,
+ *     after CATCH_UP_TRIES rounds catch_up reads the rest under room->lock.
+ *
+ * @param user_info the joining connection
+ * @param room_name
+ * @param after_seq sequence number the client has seen, @see catch_up
+ * @param announce false for a connection taken over in a hot upgrade, it
+ *          was in the room all along
+ * @return chat_room_t* room the user is now in, NULL on error
+ */
+static chat_room_t* join_room(user_t* user_info, const char* room_name,
+                                uint64_t after_seq, bool announce)
+{
+    int err;
+    chat_room_t* room;
+    bool created;
+    int tries = (announce && user_info->wants_seq && room_log_enabled()) ?
+                    CATCH_UP_TRIES : 0;
+
+    while(true){
+
+        if(!(room = lock_room(room_name, &created))){
+            return NULL;
+        }
+
+        // numbering started over (room was gone and not logged), send it all
+        if(after_seq > room->last_seq){
+            after_seq = 0;
+        }
+
+        uint64_t oldest = history_oldest_seq(room);
+
+        if(tries-- <= 0 || after_seq + 1 >= oldest){
+            break;
+        }
+
+        pthread_mutex_unlock(&room->lock);
+        if(created){
+            reap_room(room_name);
+        }
+
+        char tag[MAX_ROOMNAME_LEN + 3];
+        int tag_len = snprintf(tag, sizeof(tag), "[%s] ", room_name);
+
+        if(send_log(user_info, room_name, user_info->tagged ? tag : NULL,
+                    tag_len, &after_seq, oldest) < 0){
+            printf("Error replaying history to %s\n", user_info->user_name);
+            tries = 0;
+        }
+    }
+
+    if(room_add_fd(room, user_info->connfd, user_info->user_name) < 0){
+        printf("Error adding user fd\n");
+        pthread_mutex_unlock(&room->lock);
+        // a room created for us would be left empty
+        reap_room(room_name);
+        return NULL;
+    }
+
+    room->num_people++;
+    conn_room_add(user_info, room);
+
+    if(announce){
+        if(catch_up(room, user_info, after_seq) < 0){
+            printf("Error replaying history to %s\n", user_info->user_name);
+        }
+
+        announce_presence(room, user_info->user_name, true);
+    }
+
+    if((err = pthread_mutex_unlock(&room->lock)) != 0){
+        printf("Error unlocking room mutex : %s", strerror(err));
+    }
+
+    return room;
+}
+
+/**
+ * @brief removes the given user from the room and tells the others about it
+ * 
+ * -> if the user is the last user in the room, the room is deleted
+ * 
+ * @param user_info user name and room name
+ * @param room room struct
+ * @return int 0 on success and negative on error
+ * 
+ */
+static int remove_user(user_t* user_info, chat_room_t* room)
+{
+    int err;
+    if((err = pthread_mutex_lock(&room->lock)) != 0){
+        printf("Error locking room mutex : %s", strerror(err));
+
+        return -err;
+    }
+
+    if(room_del_fd(room, user_info->connfd) < 0){
+        if((err = pthread_mutex_unlock(&room->lock)) != 0){
+            printf("Error unlocking room mutex : %s", strerror(err));
+            return -err;
+        }
+        return -ENOENT;
+    }
+
+    room->num_people--;
+    conn_room_del(user_info, room);
+
+    bool empty = (room->num_people == 0);
+
+    // the room may be gone as soon as it is unlocked
+    char room_name[MAX_ROOMNAME_LEN];
+    if(empty){
+        strcpy(room_name, room->room_name);
+    } else {
+        announce_presence(room, user_info->user_name, false);
+    }
+
+    if((err = pthread_mutex_unlock(&room->lock)) != 0){
+        printf("Error unlocking room mutex : %s", strerror(err));
+        return -err;
+    }
+
+    if(empty){
+        reap_room(room_name);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief starts sending the connection the messages of every room whose
+ *          name starts with prefix
+ *
+ * @return int 0 on success negative on error
+ */
+static int watch_prefix(user_t* user_info, const char* prefix)
+{
+    pthread_mutex_lock(&trie_lock);
+    int err = trie_watch(prefix, user_info->connfd);
+    pthread_mutex_unlock(&trie_lock);
+
+    if(err == 0){
+        strcpy(user_info->watches[user_info->num_watches++], prefix);
+    }
+
+    return err;
+}
+
+static void unwatch_prefix(user_t* user_info, int i)
+{
+    pthread_mutex_lock(&trie_lock);
+    trie_unwatch(user_info->watches[i], user_info->connfd);
+    pthread_mutex_unlock(&trie_lock);
+
+    user_info->num_watches--;
+    strcpy(user_info->watches[i], user_info->watches[user_info->num_watches]);
+}
+
+/**
+ * @brief takes the user out of the user directory and every room it is in,
+ *          newest first, and drops its watches
+ *
+ */
+static void leave_rooms(user_t* user_info)
+{
+    user_dir_del(user_info);
+
+    while(user_info->num_watches > 0){
+        unwatch_prefix(user_info, user_info->num_watches - 1);
+    }
+
+    while(user_info->num_rooms > 0){
+        if(remove_user(user_info,
+                        user_info->rooms[user_info->num_rooms-1]) < 0){
+            printf("Terminal Irony: error removing user\n");
+            break;
+        }
+    }
+}
+
+/**
+ * @brief closes the connection and frees it, the caller took it out of its
+ *          rooms
+ *
+ * -> the timer and the fd table let go of it before the fd is closed, once
+ *     closed the number may already belong to a new connection
+ *
+ * @param user_info
+ * @param error send ERROR before closing
+ */
+static void free_user(user_t* user_info, bool error)
+{
+    timer_del(&user_info->timer);
+    conn_rx_release(user_info);
+    conn_unregister(user_info);
+
+    if(!error){
+        close(user_info->connfd);
+    } else if(client_error(user_info->connfd, user_info->binary) < 0){
+        printf("Irony: Error sending error msg to client\n");
+    }
+
+    intern_release(user_info->user_name);
+    intern_release(user_info->room_name);
+    filter_release(&user_info->filter);
+    free(user_info);
+}
+
+
+/**
+ * @brief "<user>: <line>\n", cut to MAX_BUFF_LEN-1 bytes like any message
+ *
+ * -> the prefix was built on JOIN, a message is two copies and no format
+ *     string
+ *
+ * @return payload_t* NULL if out of memory
+ */
+static payload_t* format_msg(user_t* user_info, const char* line,
+                                size_t line_len)
+{
+    size_t prefix_len = user_info->prefix_len;
+
+    if(prefix_len + line_len + 1 > MAX_BUFF_LEN - 1){
+        line_len = MAX_BUFF_LEN - 1 - prefix_len - 1;
+    }
+
+    payload_t* payload = payload_alloc(prefix_len + line_len + 1);
+    if(!payload){
+        return NULL;
+    }
+
+    memcpy(payload->data, user_info->prefix, prefix_len);
+    memcpy(payload->data + prefix_len, line, line_len);
+    payload->data[prefix_len + line_len] = MSG_DELIMETER;
+
+    // a line of a text member holds no newline
+    if(user_info->binary && payload_make_text(payload) < 0){
+        payload_put(payload);
+        return NULL;
+    }
+
+    return payload;
+}
+
+/**
+ * @brief one message of the connection to a room
+ *
+ * -> over the rate limit of the connection it is dropped, delayed or ends
+ *     the connection, @see rate_limit.c
+ * -> a message with a banned phrase is dropped, @see filter.c
+ * -> so is a line repeated within the dedup window, @see dedup.c
+ *
+ * @return int 0 on success negative if the connection has to go
+ */
+static int send_msg(user_t* user_info, chat_room_t* room, const char* msg,
+                        size_t len)
+{
+    int err;
+    if(rate_enabled() && (err = rate_admit(&user_info->rate, len)) != 0){
+        return err > 0 ? 0 : err;
+    }
+
+    if(filter_match(&user_info->filter, msg, len)){
+        return 0;
+    }
+
+    uint64_t fp = 0;
+    if(dedup_enabled()){
+        fp = dedup_hash(msg, len);
+        if(dedup_conn_seen(&user_info->dedup, fp, timer_now_ms())){
+            return 0;
+        }
+    }
+
+    hot_add(HOT_USER_MSGS, user_info->user_name, 1);
+
+    payload_t* payload = format_msg(user_info, msg, len);
+
+    if(!payload){
+        return -ENOMEM;
+    }
+
+    err = broadcast_msg(room, payload, fp);
+    payload_put(payload);
+
+    return err;
+}
+
+/**
+ * @brief tells the client that a command on the given room failed, the
+ *          connection carries on
+ *
+ */
+static void room_error(user_t* user_info, const char* room_name)
+{
+    char buff[MAX_ROOMNAME_LEN + sizeof(error_buff) + 3];
+
+    int len = snprintf(buff, sizeof(buff), "[%s] %s", room_name, error_buff);
+
+    struct iovec iov = {buff, len};
+
+    if(writev_all(user_info->connfd, &iov, 1) < 0){
+        perror("Error in write");
+    }
+}
+
+/**
+ * @brief "[@<peer>] <from>: <msg>\n" to one connection, a NOTICE frame if
+ *          it speaks the binary protocol
+ *
+ * @param gen of the connection, @see writev_conn
+ */
+static void write_direct(int fd, uint32_t gen, bool binary, const char* peer,
+                            size_t peer_len, const user_t* from,
+                            const char* msg, size_t len)
+{
+    uint8_t hdr[FRAME_HDR_MAX];
+    struct iovec iov[7] = {
+        {hdr, 0},
+        {"[@", 2},
+        {(void*)peer, peer_len},
+        {"] ", 2},
+        {(void*)from->prefix, from->prefix_len},
+        {(void*)msg, len},
+        {"\n", 1},
+    };
+
+    if(binary){
+        iov[0].iov_len = frame_hdr(hdr, FRAME_NOTICE,
+                                    peer_len + from->prefix_len + len + 5);
+    }
+
+    int err;
+    if((err = writev_conn(fd, gen, iov, 7)) < 0 && err != -EBADF){
+        perror("Error in write");
+    }
+}
+
+typedef struct DirectTarget{
+    int fd;
+    uint32_t gen;
+    bool binary;
+}direct_target_t;
+
+// connections of the user, copied out of the user directory
+typedef struct DirectMsg{
+    user_t* from;
+    direct_target_t* targets;
+    int num_targets;
+    int cap_targets;
+    bool no_mem;
+}direct_msg_t;
+
+static void find_direct(user_t* to, void* arg)
+{
+    direct_msg_t* dm = (direct_msg_t*)arg;
+
+    // the sender gets its own copy
+    if(to == dm->from){
+        return;
+    }
+
+    if(dm->num_targets == dm->cap_targets){
+        int cap = dm->cap_targets ? 2*dm->cap_targets : 4;
+        direct_target_t* targets = (direct_target_t*)realloc(dm->targets,
+                                                cap*sizeof(direct_target_t));
+        if(!targets){
+            dm->no_mem = true;
+            return;
+        }
+        dm->targets = targets;
+        dm->cap_targets = cap;
+    }
+
+    dm->targets[dm->num_targets++] = (direct_target_t){
+        .fd = to->connfd,
+        .gen = conn_gen(to->connfd),
+        .binary = to->binary,
+    };
+}
+
+/**
+ * @brief /dm, sends the message to every connection of the user name and
+ *          echoes it to the sender
+ *
+ * -> found through the user directory, no room is involved. Like presence
+ *     it is not numbered, kept or logged
+ * -> the connections are copied out under the directory lock and written
+ *     after it is dropped, a slow one does not hold up joins and leaves
+ *
+ * @return int 0, an unknown user gets "[@<user>] ERROR". Negative if the
+ *          connection went over its rate limit and has to go
+ */
+static int direct_msg(user_t* user_info, const char* to, size_t to_len,
+                        const char* msg, size_t len)
+{
+    // the message has to fit in a line like any other
+    size_t max_len = MAX_BUFF_LEN - 1 - to_len - user_info->prefix_len - 5;
+    if(len > max_len){
+        len = max_len;
+    }
+
+    int err;
+    if(rate_enabled() && (err = rate_admit(&user_info->rate, len)) != 0){
+        return err > 0 ? 0 : err;
+    }
+
+    if(filter_match(&user_info->filter, msg, len)){
+        return 0;
+    }
+
+    direct_msg_t dm = {
+        .from = user_info,
+        .targets = NULL,
+        .num_targets = 0,
+        .cap_targets = 0,
+        .no_mem = false,
+    };
+
+    char name[MAX_USERNAME_LEN + 1];
+    name[0] = '@';
+    memcpy(name + 1, to, to_len);
+    name[to_len + 1] = '\0';
+
+    if(user_dir_visit(to, to_len, find_direct, &dm) == 0 || dm.no_mem){
+        free(dm.targets);
+        room_error(user_info, name);
+        return 0;
+    }
+
+    for(int i = 0; i < dm.num_targets; i++){
+        write_direct(dm.targets[i].fd, dm.targets[i].gen, dm.targets[i].binary,
+                        user_info->user_name, user_info->user_name_len,
+                        user_info, msg, len);
+    }
+    free(dm.targets);
+
+    write_direct(user_info->connfd, conn_gen(user_info->connfd),
+                    user_info->binary, to, to_len, user_info, msg, len);
+
+    return 0;
+}
+
+// rooms copied out per trie_lock hold, @see list_rooms
+#define LIST_PAGE (64)
+// rooms sent for one /list, the client asks again with an offset for more
+#define LIST_MAX_ROOMS (1024)
+
+/**
+ * @brief sends the rooms whose name starts with prefix and their members
+ *
+ * -> "[<prefix>*] ROOMS <total>", a "[<prefix>*] <room> <members>" line per
+ *     room and "[<prefix>*] END <n>" after the n rooms sent. At most
+ *     LIST_MAX_ROOMS at a time, "/list <prefix>* <offset+n>" gets more
+ * -> a page of rooms is copied out under trie_lock and written after it is
+ *     dropped, so a long listing or a slow client never holds up joins.
+ *     Rooms made or deleted in between may shift the later pages
+ *
+ * @return int 0 on success negative if the connection has to go
+ */
+static int list_rooms(user_t* user_info, const char* prefix, int offset)
+{
+    room_info_t page[LIST_PAGE];
+    char buff[LIST_PAGE*(2*MAX_ROOMNAME_LEN + 16)];
+    int sent = 0;
+    int total;
+    int err;
+
+    while(true){
+
+        int want = LIST_MAX_ROOMS - sent;
+        want = want < LIST_PAGE ? want : LIST_PAGE;
+
+        pthread_mutex_lock(&trie_lock);
+        int n = trie_list(prefix, offset + sent, page, want, &total);
+        pthread_mutex_unlock(&trie_lock);
+
+        int len = 0;
+        if(sent == 0){
+            len = snprintf(buff, sizeof(buff), "[%s*] ROOMS %d\n", prefix,
+                            total);
+        }
+
+        for(int i = 0; i < n; i++){
+            len += snprintf(buff + len, sizeof(buff) - len, "[%s*] %s %d\n",
+                            prefix, page[i].name, page[i].num_people);
+        }
+        sent += n;
+
+        if(n < want || sent == LIST_MAX_ROOMS){
+            len += snprintf(buff + len, sizeof(buff) - len, "[%s*] END %d\n",
+                            prefix, sent);
+        }
+
+        struct iovec iov = {buff, len};
+        if((err = writev_all(user_info->connfd, &iov, 1)) < 0){
+            return err;
+        }
+
+        if(n < want || sent == LIST_MAX_ROOMS){
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief one "/<command> ..." line
+ *
+ * -> /join <room> [<seq>]   joins one more room, <seq> as in JOIN. From the
+ *                           first /join on every line sent to the connection
+ *                           is tagged with its room, "[<room>] ..."
+ * -> /leave <room>          leaving the last room ends the connection
+ * -> /say <room> <message>  sends to a room other than the first one
+ * -> /who <room>            lists the members of a room the connection is in
+ * -> /roster <room>         like /who, then "[<room>] +<name>" and
+ *                           "[<room>] -<name>" on every later join and leave
+ * -> /watch <prefix>*       gets the messages of every room whose name
+ *                           starts with <prefix>, tagged like /join
+ * -> /unwatch <prefix>*
+ * -> /list <prefix>* [<offset>]  the rooms whose name starts with <prefix>,
+ *                           @see list_rooms
+ * -> /dm <user> <message>   to every connection of <user>, whichever rooms
+ *                           they are in, @see direct_msg
+ * -> a command on a room that can not be done gets "[<room>] ERROR" and
+ *     nothing else happens
+ * -> a malformed command, an argument missing or too long, gets
+ *     "[<command>] ERROR" and the connection carries on
+ *
+ * @param line the command, without the newline, @see is_command
+ * @param leave set when the connection left its last room
+ * @return int 0 on success negative if the connection has to go
+ */
+static int serve_command(user_t* user_info, const char* line, size_t len,
+                            bool* leave)
+{
+    const char* pos = line;
+    const char* end = line + len;
+    size_t cmd_len, name_len;
+
+    const char* cmd = join_token(&pos, end, &cmd_len);
+    const char* name = join_token(&pos, end, &name_len);
+
+    // every command is shorter than a room name
+    char cmd_name[MAX_ROOMNAME_LEN];
+    memcpy(cmd_name, cmd, cmd_len);
+    cmd_name[cmd_len] = '\0';
+
+    if(name_len == 0 || name_len >= MAX_ROOMNAME_LEN){
+        room_error(user_info, cmd_name);
+        return 0;
+    }
+
+    if(cmd_len == 3 && strncmp(cmd, "/dm", 3) == 0){
+
+        // the message is everything after the one space following the name
+        if(pos < end){
+            pos++;
+        }
+
+        return pos < end ? direct_msg(user_info, name, name_len, pos, end - pos)
+                         : 0;
+    }
+
+    char room_name[MAX_ROOMNAME_LEN];
+    memcpy(room_name, name, name_len);
+    room_name[name_len] = '\0';
+
+    chat_room_t* room = conn_room_find(user_info, room_name);
+
+    if(cmd_len == 5 && strncmp(cmd, "/join", 5) == 0){
+
+        size_t seq_len;
+        const char* seq_str = join_token(&pos, end, &seq_len);
+        uint64_t after_seq;
+
+        if(parse_seq(seq_str, seq_len, &after_seq) < 0){
+            room_error(user_info, cmd_name);
+            return 0;
+        }
+
+        if(room || user_info->num_rooms == MAX_CONN_ROOMS){
+            room_error(user_info, room_name);
+            return 0;
+        }
+
+        // before the new room can send anything
+        __atomic_store_n(&user_info->tagged, true, __ATOMIC_RELAXED);
+
+        if(!join_room(user_info, room_name, after_seq, true)){
+            room_error(user_info, room_name);
+        }
+
+        return 0;
+    }
+
+    if(cmd_len == 6 && strncmp(cmd, "/leave", 6) == 0){
+
+        if(!room){
+            room_error(user_info, room_name);
+            return 0;
+        }
+
+        if(remove_user(user_info, room) < 0){
+            return -1;
+        }
+
+        *leave = (user_info->num_rooms == 0);
+
+        return 0;
+    }
+
+    if(cmd_len == 4 && strncmp(cmd, "/say", 4) == 0){
+
+        // the message is everything after the one space following the room
+        if(pos < end){
+            pos++;
+        }
+
+        if(!room){
+            room_error(user_info, room_name);
+            return 0;
+        }
+
+        return pos < end ? send_msg(user_info, room, pos, end - pos) : 0;
+    }
+
+    if((cmd_len == 4 && strncmp(cmd, "/who", 4) == 0) ||
+        (cmd_len == 7 && strncmp(cmd, "/roster", 7) == 0)){
+
+        if(!room){
+            room_error(user_info, room_name);
+            return 0;
+        }
+
+        pthread_mutex_lock(&room->lock);
+        int err = room_who_locked(room, user_info->connfd, cmd_len == 7);
+        pthread_mutex_unlock(&room->lock);
+
+        if(err == -ENOMEM){
+            room_error(user_info, room_name);
+            return 0;
+        }
+
+        return err;
+    }
+
+    if(cmd_len == 5 && strncmp(cmd, "/list", 5) == 0 &&
+        room_name[name_len-1] == '*'){
+
+        size_t offset_len;
+        const char* offset_str = join_token(&pos, end, &offset_len);
+        uint64_t offset;
+
+        if(parse_seq(offset_str, offset_len, &offset) < 0 ||
+            offset > INT32_MAX){
+            room_error(user_info, cmd_name);
+            return 0;
+        }
+
+        room_name[name_len-1] = '\0';
+
+        return list_rooms(user_info, room_name, offset);
+    }
+
+    // "<prefix>*", the prefix may be empty
+    if(room_name[name_len-1] == '*' &&
+        ((cmd_len == 6 && strncmp(cmd, "/watch", 6) == 0) ||
+         (cmd_len == 8 && strncmp(cmd, "/unwatch", 8) == 0))){
+
+        char prefix[MAX_ROOMNAME_LEN];
+        size_t prefix_len = name_len - 1;
+        memcpy(prefix, room_name, prefix_len);
+        prefix[prefix_len] = '\0';
+
+        // a watch this one is a prefix of, or the other way round
+        int i = 0;
+        for(; i < user_info->num_watches; i++){
+            size_t len = strlen(user_info->watches[i]);
+            if(strncmp(user_info->watches[i], prefix,
+                        len < prefix_len ? len : prefix_len) == 0){
+                break;
+            }
+        }
+
+        if(cmd_len == 8){
+            if(i < user_info->num_watches &&
+                strcmp(user_info->watches[i], prefix) == 0){
+                unwatch_prefix(user_info, i);
+            } else {
+                room_error(user_info, room_name);
+            }
+            return 0;
+        }
+
+        // overlapping watches would get every message twice
+        if(i < user_info->num_watches ||
+            user_info->num_watches == MAX_CONN_WATCHES){
+            room_error(user_info, room_name);
+            return 0;
+        }
+
+        __atomic_store_n(&user_info->tagged, true, __ATOMIC_RELAXED);
+
+        if(watch_prefix(user_info, prefix) < 0){
+            room_error(user_info, room_name);
+        }
+
+        return 0;
+    }
+
+    // /list or /watch without the '*'
+    room_error(user_info, cmd_name);
+    return 0;
+}
+
+/**
+ * @brief whether the line starts with one of the commands of serve_command
+ *
+ * -> only those are commands, any other line is a message, "/shrug" and
+ *     paths included
+ *
+ */
+static bool is_command(const char* line, size_t len)
+{
+    static const char* const commands[] = {
+        "/join", "/leave", "/say", "/who", "/roster", "/watch", "/unwatch",
+        "/list", "/dm",
+    };
+
+    if(len == 0 || line[0] != '/'){
+        return false;
+    }
+
+    const char* pos = line;
+    size_t cmd_len;
+    const char* cmd = join_token(&pos, line + len, &cmd_len);
+
+    for(size_t i = 0; i < sizeof(commands)/sizeof(commands[0]); i++){
+        if(strlen(commands[i]) == cmd_len &&
+            strncmp(commands[i], cmd, cmd_len) == 0){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief handles every complete line from start on
+ *
+ * -> a line starting with a command is one, @see serve_command. A '/' in
+ *     front of a command sends it as a message, "//join" sends "/join".
+ *     Every other line is sent as it is.
+ * -> with validate_utf8 a line that is not text ends the connection,
+ *     @see utf8.c
+ * -> everything else goes to the first room of the connection
+ * -> a partial last line waits in the receive buffer for the next read
+ *
+ * @param leave set when the connection left its last room, lines after it
+ *          are ignored
+ * @return char* start of the input not handled yet, NULL on error
+ */
+static char* serve_lines(user_t* user_info, char* start, bool* leave)
+{
+    char* rx_end = user_info->rx + user_info->rx_len;
+    char* pos;
+
+    while((pos = memchr(start, MSG_DELIMETER, rx_end - start)) != NULL){
+
+        size_t line_len = pos - start;
+        int err = 0;
+
+        if(server_config.validate_utf8 && !utf8_valid_line(start, line_len)){
+            printf("invalid UTF-8\n");
+            return NULL;
+        }
+
+        if(is_command(start, line_len)){
+            err = serve_command(user_info, start, line_len, leave);
+        } else if(line_len > 0){
+            bool escaped = (start[0] == '/' &&
+                            is_command(start + 1, line_len - 1));
+            err = send_msg(user_info, user_info->rooms[0], start + escaped,
+                            line_len - escaped);
+        }
+
+        if(err < 0){
+            return NULL;
+        }
+
+        start = pos + 1;
+
+        if(*leave){
+            break;
+        }
+    }
+
+    return start;
+}
+
+/**
+ * @brief handles every complete frame from start on, @see frame.c
+ *
+ * -> the payload of a MSG frame is sent to binary members as it is, any
+ *     bytes. Text members get it as one line, its newlines made spaces, so
+ *     a binary client can not forge lines of others. @see payload_make_text
+ *
+ * @param leave set when the client sent LEAVE, frames after it are ignored
+ * @return char* start of the input not handled yet, NULL on error
+ */
+static char* serve_frames(user_t* user_info, char* start, bool* leave)
+{
+    char* rx_end = user_info->rx + user_info->rx_len;
+    ssize_t frame_len;
+
+    while((frame_len = frame_complete(start, rx_end - start,
+                                        MAX_BUFF_LEN - 1)) > 0){
+
+        uint64_t len;
+        int hdr_len = frame_varint_get((const uint8_t*)start, frame_len, &len);
+        uint8_t type = start[hdr_len];
+        const char* msg = start + hdr_len + 1;
+        size_t msg_len = frame_len - hdr_len - 1;
+
+        if(type == FRAME_LEAVE){
+            *leave = true;
+            return start + frame_len;
+        }
+
+        if(type != FRAME_MSG){
+            printf("Unexpected frame type %d\n", type);
+            return NULL;
+        }
+
+        if(server_config.validate_utf8 && !utf8_valid_line(msg, msg_len)){
+            printf("invalid UTF-8\n");
+            return NULL;
+        }
+
+        if(msg_len > 0 &&
+            send_msg(user_info, user_info->rooms[0], msg, msg_len) < 0){
+            return NULL;
+        }
+
+        start += frame_len;
+    }
+
+    return frame_len < 0 ? NULL : start;
+}
+
+/**
+ * @brief Each connection spawns a new thread and then executes this function
+ *      this function
+ * 
+ * @param arg the connection, registered by spawn_conn
+ * @return void* returns NULL only on error.
+ * 
+ */
+void *client_serve(void* arg)
+{
+    if(pthread_detach(pthread_self()) != 0){
+        printf("error detaching");
+        exit(-1);
+    }
+
+    char* packet_start = NULL;
+
+    user_t *user_info = (user_t*)arg;
+
+    int *clientfd = &user_info->connfd;
+
+    // a connection taken over in a hot upgrade may already be in its rooms
+    bool new_request = (user_info->num_rooms == 0);
+
+    while(1) {
+
+        if((packet_start = read_wrapper(*clientfd, new_request,
+                                        user_info)) == NULL){
+
+            // out of the rooms first, the fd number is reused once closed
+            leave_rooms(user_info);
+            free_user(user_info, true);
+            return NULL;
+        }
+
+        if(new_request){
+            //search if room already exists else create it, then add the user
+            if(join_room(user_info, user_info->room_name,
+                            user_info->resume_seq, true) == NULL){
+                free_user(user_info, true);
+                return NULL;
+            }
+
+            user_dir_add(user_info);
+
+            new_request = false;// user has been added so not a new req anymore
+                                // userful in case of merged packets.
+        }
+
+        bool leave = false;
+        char* rest = user_info->binary ?
+                        serve_frames(user_info, packet_start, &leave) :
+                        serve_lines(user_info, packet_start, &leave);
+
+        if(!rest || leave){
+
+            leave_rooms(user_info);
+            free_user(user_info, !leave);
+            return NULL;
+        }
+
+        conn_rx_consume(user_info, rest - user_info->rx);
+    }
+}
+
+static int64_t min_deadline(int64_t a, int64_t b)
+{
+    return a < b ? a : b;
+}
+
+/**
+ * @brief the one timer of every connection, enforces the JOIN deadline, the
+ *          idle timeout and the heartbeat
+ *
+ * -> reads only bump last_active_ms, the timer works out here what is due
+ *     and re-arms itself for the earliest next deadline.
+ * -> a timed out connection is shut down, its thread sees the read fail and
+ *     leaves the room the usual way.
+ * -> PING is sent without blocking, a member whose socket buffer is full,
+ *     or that another thread is writing to, does not need to be told it is
+ *     alive. @see writev_try
+ *
+ */
+static void conn_timer_fire(timer_node_t* timer)
+{
+    user_t* user_info = (user_t*)((char*)timer - offsetof(user_t, timer));
+    int64_t now = timer_now_ms();
+    int64_t next = INT64_MAX;
+
+    // the connection is about to move to another process
+    if(upgrade_in_progress()){
+        timer_add(timer, 1000, conn_timer_fire);
+        return;
+    }
+
+    bool joined = __atomic_load_n(&user_info->num_rooms, __ATOMIC_ACQUIRE) > 0;
+    int64_t last = __atomic_load_n(&user_info->last_active_ms,
+                                    __ATOMIC_RELAXED);
+
+    if(!joined && server_config.join_timeout_sec){
+
+        int64_t deadline = user_info->connected_ms +
+                            server_config.join_timeout_sec*1000LL;
+        if(now >= deadline){
+            shutdown(user_info->connfd, SHUT_RDWR);
+            return;
+        }
+        next = min_deadline(next, deadline);
+    }
+
+    if(joined && server_config.idle_timeout_sec){
+
+        int64_t deadline = last + server_config.idle_timeout_sec*1000LL;
+        if(now >= deadline){
+            shutdown(user_info->connfd, SHUT_RDWR);
+            return;
+        }
+        next = min_deadline(next, deadline);
+    }
+
+    if(joined && server_config.heartbeat_sec){
+
+        int64_t since = last > user_info->last_ping_ms ? last
+                                                       : user_info->last_ping_ms;
+        int64_t due = since + server_config.heartbeat_sec*1000LL;
+
+        if(now >= due){
+            uint8_t hdr[FRAME_HDR_MAX];
+            struct iovec iov = {(void*)ping_buff, strlen(ping_buff)};
+
+            if(user_info->binary){
+                iov = (struct iovec){hdr, frame_hdr(hdr, FRAME_PING, 0)};
+            }
+
+            writev_try(user_info->connfd, &iov, 1);
+            user_info->last_ping_ms = now;
+            due = now + server_config.heartbeat_sec*1000LL;
+        }
+        next = min_deadline(next, due);
+    }
+
+    if(next != INT64_MAX){
+        timer_add(timer, next - now, conn_timer_fire);
+    }
+}
+
+static void conn_timer_start(user_t* user_info)
+{
+    int64_t now = timer_now_ms();
+
+    user_info->connected_ms = now;
+    user_info->last_active_ms = now;
+    user_info->last_ping_ms = now;
+
+    if(server_config.join_timeout_sec || server_config.idle_timeout_sec ||
+        server_config.heartbeat_sec){
+        // the first firing works out the real deadline
+        timer_add(&user_info->timer, TIMER_TICK_MS, conn_timer_fire);
+    }
+}
+
+/**
+ * @brief registers the connection and starts the thread serving it
+ *
+ * @param user_info connection, freed here on error
+ * @param registered already registered, an adopted connection in its rooms
+ * @return int 0 on success negative on error
+ */
+static pthread_attr_t conn_thread_attr;
+
+static int spawn_conn(user_t* user_info, bool registered)
+{
+    int err;
+
+    if(!registered && (err = conn_register(user_info)) < 0){
+        printf("Error registering connection %d\n", user_info->connfd);
+        free_user(user_info, false);
+        return err;
+    }
+
+    conn_timer_start(user_info);
+
+    if((err = pthread_create(&user_info->thread, &conn_thread_attr,
+                                client_serve, user_info)) != 0){
+        printf("Error creating thread : %s\n", strerror(err));
+        // an adopted connection is in its rooms already
+        leave_rooms(user_info);
+        free_user(user_info, false);
+        return -err;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief continues serving a connection handed over by the previous server
+ *
+ * @param user_info
+ * @param rooms rooms it was in, @see adopt_fn
+ */
+static int adopt_conn(user_t* user_info, const char* rooms)
+{
+    if(rooms){
+        build_prefix(user_info);
+
+        bool failed = (conn_register(user_info) < 0);
 
-            if(init){
-                if(validate_join(start_ptr, user_info) < 0) {
-                    printf("Malformed join req\n");
-                    return NULL;
-                }
+        const char* name = rooms;
+        for(; *name; name += strlen(name) + 1){
+            failed = failed || !join_room(user_info, name, 0, false);
+        }
 
-                init = false;// should not validate again
-                user_info->connfd = fd;
+        // watched prefixes follow, with their '*'
+        char prefix[MAX_ROOMNAME_LEN];
+        for(name++; *name && !failed; name += strlen(name) + 1){
+            size_t len = strlen(name) - 1;
+            memcpy(prefix, name, len);
+            prefix[len] = '\0';
+            failed = (watch_prefix(user_info, prefix) < 0);
+        }
 
-                return (char*)(pos+1); // since pos points to newline
+        // rooms whose roster it follows, it has the list already
+        for(name++; *name && !failed; name += strlen(name) + 1){
+            chat_room_t* room = conn_room_find(user_info, name);
+            if(room){
+                pthread_mutex_lock(&room->lock);
+                failed = (room_roster_follow_locked(room, user_info->connfd) < 0);
+                pthread_mutex_unlock(&room->lock);
             }
+        }
 
-            return start_ptr;
+        if(!failed){
+            user_dir_add(user_info);
+        } else {
+            leave_rooms(user_info);
+            free_user(user_info, true);
+            return -1;
         }
-        remainder -= n;
-        buff += n;
     }
 
-    return NULL;
+    return spawn_conn(user_info, rooms != NULL);
 }
 
-static int client_error(int fd)
+static int save_rooms(const char* path)
 {
-    if(write(fd, error_buff, strlen(error_buff)) < 0){
-        perror("error in write");
-        return -errno;
-    }
+    pthread_mutex_lock(&trie_lock);
+    int err = snapshot_write(path);
+    pthread_mutex_unlock(&trie_lock);
 
-    if(close(fd) < 0){
-        perror("error in close");
-        return -errno;
-    }
+    return err;
+}
 
-    return 0;
+static int load_rooms(const char* path)
+{
+    pthread_mutex_lock(&trie_lock);
+    int err = snapshot_load(path);
+    pthread_mutex_unlock(&trie_lock);
+
+    return err;
 }
 
-static int broadcast_msg(chat_room_t* room, const char* msg)
+/**
+ * @brief admin "STATS <room>", what one room holds
+ *
+ */
+static int room_stats(int fd, char* room_name)
 {
-    int err;
+    room_name[strcspn(room_name, " \t")] = '\0';
 
-    if((err = pthread_mutex_lock(&room->lock)) != 0){
-        printf("Error locking room mutex : %s", strerror(err));
+    pthread_mutex_lock(&trie_lock);
 
-        return -err;
+    chat_room_t* room = search_room(room_name);
+    if(!room){
+        pthread_mutex_unlock(&trie_lock);
+        return admin_reply(fd, "ERROR no such room\n");
     }
 
-    for(int i = 0; i < room->num_people; i++){
+    pthread_mutex_lock(&room->lock);
+    pthread_mutex_unlock(&trie_lock);
 
-        if((err = write(room->user_fds->data[i], msg, 
-                    strnlen(msg, MAX_BUFF_LEN)))
-                    == -1){
+    int members = room->num_people;
+    int member_cap = room->user_fds->cap;
+    int history_msgs = room->history_count;
+    size_t history_bytes = room->history_bytes;
+    size_t mem_bytes = room->mem_bytes;
 
-            perror("Error in write");
-            if((err = pthread_mutex_unlock(&room->lock)) != 0){
-                printf("Error unlocking room mutex : %s", strerror(err));
-                return -err;
-            }
-            return -errno;
-        }
+    pthread_mutex_unlock(&room->lock);
+
+    return admin_reply(fd, "members %d\nmember_cap %d\nhistory_msgs %d\n"
+                        "history_bytes %zu\nbytes %zu\nEND\n", members,
+                        member_cap, history_msgs, history_bytes, mem_bytes);
+}
+
+/**
+ * @brief admin "STATS [room]", memory held per kind and in total, one
+ *          "<name> <value>" per line then END. @see mem_acct.h
+ *
+ */
+static int admin_stats(int fd, char* args)
+{
+    if(*args){
+        return room_stats(fd, args);
     }
 
-    if((err = pthread_mutex_unlock(&room->lock)) != 0){
-        printf("Error unlocking room mutex : %s", strerror(err));
-        return -err;
+    pthread_mutex_lock(&trie_lock);
+    int rooms = room_count();
+    pthread_mutex_unlock(&trie_lock);
+
+    int err;
+    if((err = admin_reply(fd, "connections %d\nrooms %d\n", conn_count(),
+                            rooms)) < 0){
+        return err;
     }
 
-    return 0;
+    for(int kind = 0; kind < MEM_NUM_KINDS; kind++){
+        if((err = admin_reply(fd, "%s_bytes %zu\n", mem_acct_name(kind),
+                                mem_acct_get(kind))) < 0){
+            return err;
+        }
+    }
+
+    rate_counts_t rate;
+    rate_counts(&rate);
+
+    return admin_reply(fd, "total_bytes %zu\nrate_limited %" PRIu64 "\n"
+                        "rate_dropped %" PRIu64 "\nrate_delayed %" PRIu64 "\n"
+                        "rate_disconnected %" PRIu64 "\n"
+                        "dedup_suppressed %" PRIu64 "\n"
+                        "log_dropped %" PRIu64 "\nEND\n",
+                        mem_acct_total(), rate.limited, rate.dropped,
+                        rate.delayed, rate.disconnected, dedup_suppressed(),
+                        room_log_dropped());
 }
 
 /**
- * @brief removes the given user from the room
- * 
- * -> if the user is the last user in the room, the room is deleted
- * 
- * @param user_info user name and room name
- * @param room room struct
- * @return int 0 on success and negative on error
- * 
+ * @brief admin "FILTER [RELOAD]", the banned phrase set in use. RELOAD
+ *          compiles the file given with --filter again and swaps it in
+ *
  */
-static int remove_user(user_t* user_info, chat_room_t* room)
+static int admin_filter(int fd, char* args)
 {
     int err;
-    if((err = pthread_mutex_lock(&room->lock)) != 0){
-        printf("Error locking room mutex : %s", strerror(err));
 
-        return -err;
-    }
-    int i;
-    for(i = 0; i < room->num_people; i++){
-        if(room->user_fds->data[i] == user_info->connfd){
-            break;
-        }
-    }
+    if(strncasecmp(args, "RELOAD", 6) == 0){
 
-    if(i < room->num_people){
-        for(int j = i; j < room->num_people-1; j++){
-            room->user_fds->data[j] = room->user_fds->data[j+1];
+        if(!server_config.filter_path){
+            return admin_reply(fd, "ERROR no filter file\n");
         }
-    } else {
-        if((err = pthread_mutex_unlock(&room->lock)) != 0){
-            printf("Error unlocking room mutex : %s", strerror(err));
-            return -err;
+
+        if((err = filter_load(server_config.filter_path)) < 0){
+            return admin_reply(fd, "ERROR filter not loaded\n");
         }
-        return -ENOENT;
     }
 
-    room->user_fds->size--;
-    room->num_people--;
+    filter_stats_t stats;
+    filter_stats(&stats);
 
-    if(room->num_people == 0){
-        if(delete_room(room) < 0){
-            printf("Error in deleting room\n");
-            return -1;
-        }
-    }
+    return admin_reply(fd, "patterns %d\nstates %d\nbytes %zu\ngen %u\n"
+                        "blocked %" PRIu64 "\nEND\n", stats.patterns,
+                        stats.states, stats.bytes, stats.gen, stats.blocked);
+}
 
-    if((err = pthread_mutex_unlock(&room->lock)) != 0){
-        printf("Error unlocking room mutex : %s", strerror(err));
-        return -err;
+static int hot_line(const char* metric, const hot_entry_t* entry,
+                    int64_t per_sec, void* arg)
+{
+    return admin_reply(*(int*)arg, "%s %s %" PRId64 "\n", metric, entry->name,
+                        per_sec);
+}
+
+/**
+ * @brief admin "HOT", the busiest rooms and users of the last interval, an
+ *          "interval_ms" line then "<metric> <name> <per second>" lines,
+ *          busiest first, then END. @see hot.c
+ *
+ */
+static int admin_hot(int fd, char* args)
+{
+    (void)args;
+
+    if(!server_config.hot_interval_ms){
+        return admin_reply(fd, "ERROR not tracked, see --hot-interval-ms\n");
     }
 
-    free(user_info->room_name);
-    free(user_info->user_name);
-    free(user_info);
+    int err;
+    if((err = admin_reply(fd, "interval_ms %d\n",
+                            server_config.hot_interval_ms)) < 0 ||
+        (err = hot_report(hot_line, &fd)) < 0){
+        return err;
+    }
 
-    return 0;
+    return admin_reply(fd, "END\n");
 }
 
-
+#ifdef LOCK_PROFILE
 /**
- * @brief Each connection spawns a new thread and then executes this function
- *      this function
- * 
- * @param arg contains the argument, connectionfd in this case
- * @return void* returns NULL only on error.
- * 
+ * @brief admin "LOCKS", wait and hold times of every lock call site, most
+ *          waited on first, then END. @see lock_prof.c
+ *
  */
-void *client_serve(void* arg)
+static int admin_locks(int fd, char* args)
 {
     int err;
-    if(pthread_detach(pthread_self()) != 0){
-        printf("error detaching");
-        exit(-1);
+    if((err = lock_prof_dump(fd)) < 0){
+        return admin_reply(fd, "ERROR out of memory\n");
     }
 
-    char* packet_start = NULL;
-
-    char in_buff[MAX_BUFF_LEN];
+    return admin_reply(fd, "END\n");
+}
+#endif
 
-    char out_buff[MAX_BUFF_LEN];
+typedef struct PublishTarget{
+    int fd;
+    chat_room_t* room;
+}publish_target_t;
 
-    int *clientfd = (int*)arg;
+static int cmp_room_ptr(const void* a, const void* b)
+{
+    uintptr_t x = (uintptr_t)*(chat_room_t* const*)a;
+    uintptr_t y = (uintptr_t)*(chat_room_t* const*)b;
 
-    bool new_request = true;
+    return (x > y) - (x < y);
+}
 
-    user_t *user_info = (user_t*)malloc(sizeof(user_t));
-    chat_room_t *room;
+static int cmp_target_fd(const void* a, const void* b)
+{
+    return ((const publish_target_t*)a)->fd - ((const publish_target_t*)b)->fd;
+}
 
-    if(!user_info){
-        printf(" Out of Memory\n");
-        return NULL;
+/**
+ * @brief sends the payload once to every member of the given rooms, caller
+ *          holds the lock of every room
+ *
+ * @return int number of connections it was sent to
+ */
+static int publish_locked(chat_room_t** rooms, int num_rooms,
+                            payload_t* payload)
+{
+    int num_targets = 0;
+    for(int i = 0; i < num_rooms; i++){
+        num_targets += rooms[i]->num_people;
     }
-    while(1) {
-
-        memset(in_buff, 0, MAX_BUFF_LEN);
-        memset(out_buff, 0, MAX_BUFF_LEN);
-
-        if((packet_start = read_wrapper(*clientfd, in_buff, new_request,
-                                             user_info)) == NULL){
-
-            if(!new_request) {
 
-                char user_name_temp[MAX_USERNAME_LEN];
-                memset(user_name_temp, 0, MAX_USERNAME_LEN);
-
-                strncpy(user_name_temp, user_info->user_name, MAX_USERNAME_LEN);
+    publish_target_t* targets = (publish_target_t*)malloc(
+                                    num_targets*sizeof(publish_target_t) + 1);
+    if(!targets){
+        return -ENOMEM;
+    }
 
-                if(client_error(*clientfd) < 0){
-                    printf("Irony: Error sending error msg to client\n");
-                }
+    int n = 0;
+    for(int i = 0; i < num_rooms; i++){
+        for(int j = 0; j < rooms[i]->num_people; j++){
+            targets[n].fd = rooms[i]->user_fds->data[j];
+            targets[n].room = rooms[i];
+            n++;
+        }
+    }
 
-                if(remove_user(user_info, room) < 0){
-                    printf("Terminal Irony: error removing user\n");
-                }
+    // a connection in several of the rooms shows up once per room
+    qsort(targets, n, sizeof(publish_target_t), cmp_target_fd);
 
-                snprintf(out_buff, MAX_BUFF_LEN, "%s %s\n", user_name_temp,
-                            left_buff);
+    int sent = 0;
+    for(int i = 0; i < n; i++){
 
-                if(broadcast_msg(room, out_buff) < 0){
-                    printf("Terminal Irony: Unable to tell other users that %s"\
-                            " left\n", user_name_temp);
-                }
+        if(i > 0 && targets[i].fd == targets[i-1].fd){
+            continue;
+        }
 
-            } else {
-                if(client_error(*clientfd) < 0){
-                    printf("Irony: Error sending error msg to client\n");
-                }
-            }
-            return NULL;
+        if(room_send_member_locked(targets[i].room, targets[i].fd,
+                                    payload) < 0){
+            perror("Error in write");
+            continue;
         }
+        sent++;
+    }
 
-        if(new_request){
-            //search if room already exists else create it
+    free(targets);
 
-            if((err = pthread_mutex_lock(&trie_lock)) != 0){
-                printf("Error locking trie mutex : %s", strerror(err));
-                if(client_error(*clientfd) < 0){
-                    printf("Irony: Error sending error msg to client\n");
-                }
-                free(user_info);
-                return NULL;
-            }
+    return sent;
+}
 
-            room = search_room(user_info->room_name);
+/**
+ * @brief admin "PUBLISH <room>[,<room>...] <sender> <message>", sends
+ *          "<sender>: <message>" once to every connection in any of the
+ *          rooms and replies with how many rooms and connections it reached
+ *
+ * -> the message is formatted once, one payload is shared by every write
+ * -> a connection in several of the rooms gets it once, tagged with one of
+ *     them if it is tagged at all
+ * -> like presence it only reaches who is there. It is not numbered, kept
+ *     in the history or logged, a payload has room for one room's number
+ * -> the rooms are all locked at once, in address order so two PUBLISH do
+ *     not deadlock, so nobody comes or goes while the members are collected
+ *     and written to. Rooms that do not exist are skipped
+ *
+ */
+static int admin_publish(int fd, char* args)
+{
+    char* list = args;
+    size_t list_len = strcspn(list, " \t");
 
-            if((err = pthread_mutex_unlock(&trie_lock)) != 0){
-                printf("Error unlocking trie mutex : %s", strerror(err));
-                if(client_error(*clientfd) < 0){
-                    printf("Irony: Error sending error msg to client\n");
-                }
-                free(user_info);
-                return NULL;
-            }
+    char* sender = list + list_len + strspn(list + list_len, " \t");
+    size_t sender_len = strcspn(sender, " \t");
 
-            if(!room){
+    char* msg = sender + sender_len;
+    if(*msg){
+        msg++;
+    }
+    size_t msg_len = strlen(msg);
 
-                if((err = pthread_mutex_lock(&trie_lock)) != 0){
-                    printf("Error locking trie mutex : %s", strerror(err));
-                    if(client_error(*clientfd) < 0){
-                        printf("Irony: Error sending error msg to client\n");
-                    }
-                    free(user_info);
-                    return NULL;
-                }
+    if(list_len == 0 || sender_len == 0 || sender_len >= MAX_USERNAME_LEN ||
+        msg_len == 0){
+        return admin_reply(fd, "ERROR usage PUBLISH <room>[,<room>...] "
+                                "<sender> <message>\n");
+    }
+    list[list_len] = '\0';
 
-                room = create_room(user_info->room_name);
+    if(sender_len + 2 + msg_len + 1 > MAX_BUFF_LEN - 1){
+        msg_len = MAX_BUFF_LEN - 1 - sender_len - 2 - 1;
+    }
 
-                if(!room){
-                    if(remove_user(user_info, room) < 0){
-                        printf("Terminal Irony: error removing user\n");
-                    }
-                    if(client_error(*clientfd) < 0){
-                        printf("Irony: Error sending error msg to client\n");
-                    }
+    payload_t* payload = payload_alloc(sender_len + 2 + msg_len + 1);
+    int max_rooms = 1;
+    for(char* c = list; *c; c++){
+        max_rooms += (*c == ',');
+    }
+    chat_room_t** rooms = (chat_room_t**)malloc(max_rooms*sizeof(chat_room_t*));
 
-                    if((err = pthread_mutex_unlock(&trie_lock)) != 0){
-                        printf("Error unlocking trie mutex : %s", strerror(err));
-                    }
+    if(!payload || !rooms){
+        if(payload){
+            payload_put(payload);
+        }
+        free(rooms);
+        return admin_reply(fd, "ERROR out of memory\n");
+    }
 
-                    return NULL;
-                }
+    memcpy(payload->data, sender, sender_len);
+    memcpy(payload->data + sender_len, ": ", 2);
+    memcpy(payload->data + sender_len + 2, msg, msg_len);
+    payload->data[sender_len + 2 + msg_len] = MSG_DELIMETER;
 
-                if((err = pthread_mutex_unlock(&trie_lock)) != 0){
-                    printf("Error unlocking trie mutex : %s", strerror(err));
-                    if(client_error(*clientfd) < 0){
-                        printf("Irony: Error sending error msg to client\n");
-                    }
-                    if(remove_user(user_info, room) < 0){
-                        printf("Terminal Irony: error removing user\n");
-                    }
-                    return NULL;
-                }
-            }
+    int num_rooms = 0;
 
-            //lock room
-            if((err = pthread_mutex_lock(&room->lock)) != 0){
-                printf("Error locking room mutex : %s", strerror(err));
-                if(client_error(*clientfd) < 0){
-                    printf("Irony: Error sending error msg to client\n");
-                }
-                if(remove_user(user_info, room) < 0){
-                    printf("Terminal Irony: error removing user\n");
-                }
-                return NULL;
-            }
+    pthread_mutex_lock(&trie_lock);
 
-            if(insert_into_rs_array(&room->user_fds, *clientfd) < 0){
-                printf("Error adding user fd\n");
-                if(client_error(*clientfd) < 0){
-                    printf("Irony: Error sending error msg to client\n");
-                }
-                if(remove_user(user_info, room) < 0){
-                    printf("Terminal Irony: error removing user\n");
-                }
-                if((err = pthread_mutex_unlock(&room->lock)) != 0){
-                    printf("Error unlocking trie mutex : %s", strerror(err));
-                }
-                return NULL;
-            }
+    char* save;
+    for(char* name = strtok_r(list, ",", &save); name;
+            name = strtok_r(NULL, ",", &save)){
+        chat_room_t* room = search_room(name);
+        if(room){
+            rooms[num_rooms++] = room;
+        }
+    }
 
-            room->num_people++;
+    qsort(rooms, num_rooms, sizeof(chat_room_t*), cmp_room_ptr);
 
-            if((err = pthread_mutex_unlock(&room->lock)) != 0){
-                printf("Error unlocking trie mutex : %s", strerror(err));
+    int unique = 0;
+    for(int i = 0; i < num_rooms; i++){
+        if(unique == 0 || rooms[unique-1] != rooms[i]){
+            rooms[unique++] = rooms[i];
+            pthread_mutex_lock(&rooms[i]->lock);
+        }
+    }
+    num_rooms = unique;
 
-                if(client_error(*clientfd) < 0){
-                    printf("Irony: Error sending error msg to client\n");
-                }
-                if(remove_user(user_info, room) < 0){
-                    printf("Terminal Irony: error removing user\n");
-                }
-                return NULL;
-            }
+    pthread_mutex_unlock(&trie_lock);
 
-            snprintf(out_buff, MAX_BUFF_LEN, "%s %s\n", user_info->user_name,
-                        join_buff);
+    int sent = publish_locked(rooms, num_rooms, payload);
 
-            if(broadcast_msg(room, out_buff) < 0){
+    for(int i = 0; i < num_rooms; i++){
+        pthread_mutex_unlock(&rooms[i]->lock);
+    }
 
-                if(client_error(*clientfd) < 0){
-                    printf("Irony: Error sending error msg to client\n");
-                }
-                if(remove_user(user_info, room) < 0){
-                    printf("Terminal Irony: error removing user\n");
-                }
-                return NULL;
-            }
+    payload_put(payload);
+    free(rooms);
 
-            new_request = false;// user has been added so not a new req anymore
-                                // userful in case of merged packets.
-        }
+    if(sent < 0){
+        return admin_reply(fd, "ERROR out of memory\n");
+    }
 
-        packet_start = strtok(packet_start, "\n");
-        while(packet_start != NULL){
+    return admin_reply(fd, "rooms %d\nconnections %d\nEND\n", num_rooms,
+                        sent);
+}
 
-            // printf("sending %s to users in room %s len is %ld\n", packet_start,
-            //         user_info->room_name, strnlen(packet_start, MAX_BUFF_LEN));
+static void on_shutdown_signal(int sig)
+{
+    (void)sig;
+    shutting_down = 1;
+}
 
-            snprintf(out_buff, MAX_BUFF_LEN, "%s: %s\n", user_info->user_name,
-                        packet_start);
+/**
+ * @brief saves the rooms if asked to and exits, called from the accept loop
+ *          once a shutdown signal arrived
+ *
+ * -> the room log is synced first, like an upgrade does, a snapshot never
+ *     numbers past what is on disk. Members still sending are synced again
+ *     before exit.
+ *
+ */
+static void shutdown_server(int serverfd)
+{
+    close(serverfd);
 
+    room_log_sync();
 
-            if(broadcast_msg(room, out_buff) < 0){
+    if(server_config.snapshot_path){
+        // held until exit, nobody may create or delete rooms anymore
+        pthread_mutex_lock(&trie_lock);
 
-                if(client_error(*clientfd) < 0){
-                    printf("Irony: Error sending error msg to client\n");
-                }
-                if(remove_user(user_info, room) < 0){
-                    printf("Terminal Irony: error removing user\n");
-                }
-                return NULL;
-            }
-            packet_start = strtok(NULL, "\n");
+        if(snapshot_write(server_config.snapshot_path) < 0){
+            exit(-EIO);
         }
     }
-}
 
-int main(int argc, char *argv[])
-{
-    if(argc > 2){
-        usage();
-    }
+    room_log_sync();
 
-    int port = DEFAULT_PORT;
-    if(argc == 2){
-        port = atoi(argv[1]);
-    }
+    exit(0);
+}
 
-    int serverfd, client_addrlen;
-    struct sockaddr_in *server, *client;
+/**
+ * @brief creates the listening socket of the chat server
+ *
+ * @param port
+ * @return int listening socket, exits on error
+ */
+static int open_listen_socket(int port)
+{
+    int serverfd;
+    struct sockaddr_in *server;
 
     server = (struct sockaddr_in*)malloc(sizeof(struct sockaddr_in));
     if(!server){
@@ -550,6 +2510,13 @@ int main(int argc, char *argv[])
         printf(" Server Socket successfully created\n");
     }
 
+    // a restart must not wait for the old connections to leave TIME_WAIT
+    int reuse = 1;
+    if(setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                    sizeof(reuse)) < 0){
+        perror("setsockopt failed");
+    }
+
     if ((bind(serverfd, (struct sockaddr*)server, 
                 sizeof(struct sockaddr))) != 0) { 
         perror("socket bind failed"); 
@@ -564,24 +2531,166 @@ int main(int argc, char *argv[])
         exit(-errno);
     }
 
+    free(server);
+
+    return serverfd;
+}
+
+int main(int argc, char *argv[])
+{
+    if(parse_args(argc, argv) < 0){
+        usage();
+        exit(-EINVAL);
+    }
+
+    // a peer hanging up mid broadcast must not take the whole server down
+    signal(SIGPIPE, SIG_IGN);
+
+    // no SA_RESTART, accept has to return so the snapshot can be written
+    struct sigaction shutdown_action;
+    memset(&shutdown_action, 0, sizeof(struct sigaction));
+    shutdown_action.sa_handler = on_shutdown_signal;
+    sigemptyset(&shutdown_action.sa_mask);
+    sigaction(SIGTERM, &shutdown_action, NULL);
+    sigaction(SIGINT, &shutdown_action, NULL);
+
+    int serverfd = -1, client_addrlen;
+    struct sockaddr_in *client;
+
     int err;
     if ((err = pthread_mutex_init(&trie_lock, NULL)) != 0) { 
         printf(" mutex init failed for trie: %s\n", strerror(err));
         exit(-err);
     }
 
+    if(conn_table_init() < 0){
+        printf("Out of memory for connection table");
+        exit(-ENOMEM);
+    }
+
     if(!init_trie()){
         printf("Out of memory for trie");
         exit(-ENOMEM);
     }
 
+    history_init(server_config.history_msgs, server_config.history_bytes);
+
+    if(server_config.log_dir){
+        log_config_t log_config = {
+            .dir = server_config.log_dir,
+            .shards = server_config.log_shards,
+            .segment_bytes = server_config.log_segment_bytes,
+            .retain_bytes = server_config.log_retain_bytes,
+            .retain_sec = server_config.log_retain_sec,
+        };
+
+        if((err = room_log_init(&log_config)) < 0){
+            printf("Error opening message log in %s\n", server_config.log_dir);
+            exit(err);
+        }
+    }
+
+    if((err = presence_init(server_config.presence_interval_ms)) < 0){
+        printf("Error starting presence flusher\n");
+        exit(err);
+    }
+
+    if((err = timer_wheel_init(TIMER_TICK_MS)) < 0){
+        printf("Error starting timer wheel\n");
+        exit(err);
+    }
+
+    buf_pool_init(server_config.rx_pool_buffers);
+    user_dir_init();
+    intern_init();
+
+    mem_limits_t mem_limits = {
+        .conn_max = server_config.conn_mem_max,
+        .room_max = server_config.room_mem_max,
+        .total_max = server_config.mem_max,
+    };
+    mem_acct_init(&mem_limits);
+
+    rate_limits_t rate_limits = {
+        .msgs_per_sec = server_config.rate_msgs,
+        .bytes_per_sec = server_config.rate_bytes,
+        .policy = server_config.rate_policy,
+    };
+    rate_init(&rate_limits);
+    dedup_init(server_config.dedup_window_ms, server_config.dedup_room);
+
+#ifdef LOCK_PROFILE
+    if((err = lock_prof_init()) < 0){
+        printf("Error starting lock profiling\n");
+        exit(err);
+    }
+#endif
+
+    if(server_config.hot_interval_ms &&
+        (err = hot_init(server_config.hot_interval_ms)) < 0){
+        printf("Error starting hot tracking\n");
+        exit(err);
+    }
+
+    if(server_config.filter_path &&
+        (err = filter_load(server_config.filter_path)) < 0){
+        printf("Error loading filter %s\n", server_config.filter_path);
+        exit(err);
+    }
+
+    pthread_attr_init(&conn_thread_attr);
+    if((err = pthread_attr_setstacksize(&conn_thread_attr,
+                                        CONN_STACK_SIZE)) != 0){
+        printf("Error setting thread stack size : %s\n", strerror(err));
+        exit(-err);
+    }
+
+    if(server_config.upgrade_path){
+        serverfd = upgrade_takeover(server_config.upgrade_path, load_rooms,
+                                    adopt_conn);
+        if(serverfd < 0 && serverfd != -ENOENT){
+            printf("Error taking over from %s, starting fresh\n",
+                    server_config.upgrade_path);
+        }
+    }
+
+    if(serverfd < 0){
+
+        if(server_config.snapshot_path &&
+            load_rooms(server_config.snapshot_path) < 0){
+            printf("Error restoring snapshot %s\n",
+                    server_config.snapshot_path);
+        }
+
+        serverfd = open_listen_socket(server_config.port);
+    }
+
+    if(server_config.admin_port){
+        admin_register("STATS", admin_stats);
+        admin_register("PUBLISH", admin_publish);
+        admin_register("FILTER", admin_filter);
+        admin_register("HOT", admin_hot);
+#ifdef LOCK_PROFILE
+        admin_register("LOCKS", admin_locks);
+#endif
+        if(admin_init(server_config.admin_port) < 0){
+            printf("Error opening admin port %d\n", server_config.admin_port);
+        }
+    }
+
+    if(server_config.upgrade_path &&
+        upgrade_listen(server_config.upgrade_path, serverfd, save_rooms) < 0){
+        printf("Error listening for upgrades on %s\n",
+                server_config.upgrade_path);
+    }
+
     while(true){
 
         client = (struct sockaddr_in*)malloc(sizeof(struct sockaddr_in));
 
-        int *clientfd = (int*)malloc(sizeof(int));
+        user_t *user_info = (user_t*)calloc(1, sizeof(user_t));
 
-        if(!client || !clientfd){
+        if(!client || !user_info){
 
             perror("Malloc failed:");
 
@@ -599,16 +2708,30 @@ int main(int argc, char *argv[])
 
         client_addrlen = sizeof(struct sockaddr);
 
-        *clientfd = accept(serverfd, (struct sockaddr *)client, 
-                            &client_addrlen);
+        user_info->connfd = accept(serverfd, (struct sockaddr *)client, 
+                                    (socklen_t*)&client_addrlen);
+        free(client);
+
+        if(shutting_down){
+            shutdown_server(serverfd);
+        }
+
         /* if connection was successful then spawn a thread and 
         * let it handle the client else we wait for a new one again*/
-        if(*clientfd > 0){
-            pthread_t thread;
-            pthread_create(&thread, NULL, client_serve, (void*)clientfd);
+        if(user_info->connfd > 0 && !mem_acct_total_fits()){
+            // out of budget, tell the client instead of letting it hang
+            client_error(user_info->connfd, false);
+            free(user_info);
+        } else if(user_info->connfd > 0){
+            spawn_conn(user_info, false);
+        } else {
+            free(user_info);
         }
 
+        if(upgrade_in_progress()){
+            upgrade_park_main();
+        }
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,69 @@
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define DEFAULT_PORT (1234)
+
+// presence events of rooms with at least this many members are coalesced
+#define DEFAULT_PRESENCE_THRESHOLD (1000)
+#define DEFAULT_PRESENCE_INTERVAL_MS (1000)
+
+// last messages of a room replayed to new members
+#define DEFAULT_HISTORY_MSGS (20)
+#define DEFAULT_HISTORY_BYTES (64*1024)
+
+// connections that do not JOIN in time are dropped
+#define DEFAULT_JOIN_TIMEOUT_SEC (30)
+#define TIMER_TICK_MS (100)
+
+// spare receive buffers kept for long lines, @see buf_pool.c
+#define DEFAULT_RX_POOL_BUFFERS (64)
+// connection threads only need a few small frames, not the default 8MB
+#define CONN_STACK_SIZE (128*1024)
+
+// durable message log, only written when a log dir is given
+#define DEFAULT_LOG_SHARDS (16)
+#define DEFAULT_LOG_SEGMENT_BYTES (64*1024*1024)
+#define DEFAULT_LOG_RETAIN_BYTES (1024L*1024*1024)
+
+/**
+ * @brief runtime knobs of the server, filled in from the command line in main
+ *          and read-only afterwards
+ *
+ */
+typedef struct ServerConfig{
+    int port;
+    int presence_threshold;     // 0 disables coalescing
+    int presence_interval_ms;
+    int history_msgs;           // 0 disables history
+    size_t history_bytes;       // 0 means only history_msgs applies
+    const char* log_dir;        // NULL disables the durable log
+    int log_shards;
+    size_t log_segment_bytes;
+    size_t log_retain_bytes;    // per shard, 0 keeps everything
+    int log_retain_sec;         // 0 keeps everything
+    const char* snapshot_path;  // NULL disables snapshots
+    const char* upgrade_path;   // NULL disables hot upgrades
+    int join_timeout_sec;       // 0 lets connections wait forever to JOIN
+    int idle_timeout_sec;       // 0 never drops silent members
+    int heartbeat_sec;          // 0 never pings silent members
+    int rx_pool_buffers;        // spare receive buffers kept, 0 for none
+    int admin_port;             // 0 disables the admin port
+    size_t conn_mem_max;        // bytes per connection, 0 for no cap
+    size_t room_mem_max;        // bytes per room, 0 for no cap
+    size_t mem_max;             // bytes in total, 0 for no cap
+    int rate_msgs;              // per connection and second, 0 for no limit
+    size_t rate_bytes;          // per connection and second, 0 for no limit
+    int rate_policy;            // rate_policy_t, @see rate_limit.h
+    const char* filter_path;    // NULL disables the banned phrase filter
+    bool validate_utf8;         // drop clients sending anything but text
+    int dedup_window_ms;        // repeats within are dropped, 0 keeps them
+    bool dedup_room;            // also repeats of other members of a room
+    int hot_interval_ms;        // top rooms and users over this, 0 for off
+}server_config_t;
+
+extern server_config_t server_config;
+
+#endif
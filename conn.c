@@ -0,0 +1,373 @@
+/**
+ * @file conn.c
+ * @brief table of live connections indexed by fd
+ *
+ * -> rooms only store fds, senders look the connection up here when the
+ *     message depends on who it is written to.
+ * -> a connection is registered before it joins a room and unregistered
+ *     after it left it, so a sender holding room->lock always finds a live
+ *     user_t for every member.
+ * -> the memory of a connection is charged while it is registered.
+ * -> every fd that was ever registered has a write lock. Threads of several
+ *     rooms, watchers, /dm and the timer write to one client, each holding
+ *     other locks, the write lock keeps their records from interleaving.
+ *     It is taken last and never kept while waiting for another lock.
+ * -> the generation of an fd changes under its write lock when a connection
+ *     registers or unregisters. A writer that does not keep the connection
+ *     registered otherwise, e.g. by holding the lock of one of its rooms,
+ *     notes the generation and writes with writev_conn. Once the
+ *     connection is gone and its fd reused nothing is written to it.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+#include "conn.h"
+#include "buf_pool.h"
+#include "mem_acct.h"
+#include "utils.h"
+
+static user_t** conn_table;
+// write lock per fd, made on the first register and kept for the fd after
+static pthread_mutex_t** write_locks;
+static uint32_t* write_gens;
+static int conn_table_len;
+static int num_conns;
+
+// serializes register/unregister with conn_for_each, lookups go without it
+static pthread_mutex_t conn_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief sizes the table to the fd limit of the process
+ *
+ * @return int 0 on success negative on error
+ */
+int conn_table_init()
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) < 0){
+        perror("Error getting fd limit");
+        return -errno;
+    }
+
+    conn_table_len = (limit.rlim_cur == RLIM_INFINITY ||
+                        limit.rlim_cur > (1 << 24)) ? (1 << 24)
+                                                    : (int)limit.rlim_cur;
+
+    conn_table = (user_t**)calloc(conn_table_len, sizeof(user_t*));
+    write_locks = (pthread_mutex_t**)calloc(conn_table_len,
+                                            sizeof(pthread_mutex_t*));
+    write_gens = (uint32_t*)calloc(conn_table_len, sizeof(uint32_t));
+    if(!conn_table || !write_locks || !write_gens){
+        printf("No memory for connection table\n");
+        free(conn_table);
+        free(write_locks);
+        free(write_gens);
+        conn_table = NULL;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void conn_gen_bump(int fd)
+{
+    pthread_mutex_lock(write_locks[fd]);
+    __atomic_add_fetch(&write_gens[fd], 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(write_locks[fd]);
+}
+
+int conn_register(user_t* user_info)
+{
+    if(user_info->connfd < 0 || user_info->connfd >= conn_table_len){
+        return -EBADF;
+    }
+
+    pthread_mutex_lock(&conn_table_lock);
+
+    if(!write_locks[user_info->connfd]){
+        pthread_mutex_t* lock = (pthread_mutex_t*)malloc(
+                                                    sizeof(pthread_mutex_t));
+        if(!lock){
+            pthread_mutex_unlock(&conn_table_lock);
+            return -ENOMEM;
+        }
+        pthread_mutex_init(lock, NULL);
+        __atomic_store_n(&write_locks[user_info->connfd], lock,
+                            __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&conn_table[user_info->connfd], user_info,
+                        __ATOMIC_RELEASE);
+    num_conns++;
+    pthread_mutex_unlock(&conn_table_lock);
+
+    conn_gen_bump(user_info->connfd);
+
+    user_info->mem_bytes += sizeof(user_t);
+    mem_acct_add(MEM_CONNS, sizeof(user_t));
+
+    return 0;
+}
+
+void conn_unregister(user_t* user_info)
+{
+    if(user_info->connfd < 0 || user_info->connfd >= conn_table_len){
+        return;
+    }
+
+    user_t* expected = user_info;
+    bool was_registered = false;
+
+    pthread_mutex_lock(&conn_table_lock);
+    if(__atomic_compare_exchange_n(&conn_table[user_info->connfd], &expected,
+                                    NULL, false, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED)){
+        num_conns--;
+        was_registered = true;
+    }
+    pthread_mutex_unlock(&conn_table_lock);
+
+    // waits for a write in progress, none is left once the fd is closed
+    if(was_registered){
+        conn_gen_bump(user_info->connfd);
+    }
+
+    mem_acct_add(MEM_CONNS, -(long)user_info->mem_bytes);
+    user_info->mem_bytes = 0;
+}
+
+int conn_count()
+{
+    return __atomic_load_n(&num_conns, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief charges bytes to the connection, negative bytes credit them back
+ *
+ * -> called by the thread owning the connection, or before it was started
+ *
+ * @param user_info
+ * @param bytes
+ * @return int 0 on success, -ENOMEM if the connection would go over its cap
+ */
+int conn_mem_charge(user_t* user_info, long bytes)
+{
+    if(bytes > 0 && !mem_acct_conn_fits(user_info->mem_bytes, bytes)){
+        return -ENOMEM;
+    }
+
+    user_info->mem_bytes += bytes;
+    mem_acct_add(MEM_CONNS, bytes);
+
+    return 0;
+}
+
+/**
+ * @brief calls visit for every registered connection
+ *
+ * -> a connection can not unregister, and so can not be freed, while visit
+ *     runs. visit must not register or unregister connections.
+ *
+ * @param visit
+ * @param arg passed through to visit
+ */
+void conn_for_each(conn_visit_fn visit, void* arg)
+{
+    pthread_mutex_lock(&conn_table_lock);
+
+    for(int fd = 0; fd < conn_table_len; fd++){
+        if(conn_table[fd]){
+            visit(conn_table[fd], arg);
+        }
+    }
+
+    pthread_mutex_unlock(&conn_table_lock);
+}
+
+/**
+ * @brief connection using the given fd
+ *
+ * @param fd
+ * @return user_t* NULL if no connection is registered for fd
+ */
+user_t* conn_lookup(int fd)
+{
+    if(fd < 0 || fd >= conn_table_len){
+        return NULL;
+    }
+
+    return __atomic_load_n(&conn_table[fd], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief lock serializing writes to fd, @see writev_all
+ *
+ * @return pthread_mutex_t* NULL if fd was never registered, nobody else
+ *          writes to it then
+ */
+pthread_mutex_t* conn_write_lock(int fd)
+{
+    if(fd < 0 || fd >= conn_table_len){
+        return NULL;
+    }
+
+    return __atomic_load_n(&write_locks[fd], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief generation of the connection using fd, @see writev_conn
+ *
+ * -> read while the connection is known to be registered, e.g. under the
+ *     lock it was found with
+ *
+ */
+uint32_t conn_gen(int fd)
+{
+    if(fd < 0 || fd >= conn_table_len){
+        return 0;
+    }
+
+    return __atomic_load_n(&write_gens[fd], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief makes room to read more bytes into the receive buffer
+ *
+ * -> a line that does not fit rx_inline moves to a buffer from the pool,
+ *     charged to the connection
+ *
+ * @param user_info
+ * @return size_t bytes that fit after rx_len, 0 if the line is too long or
+ *          no buffer could be had. rx always has a spare byte for the 0
+ */
+size_t conn_rx_reserve(user_t* user_info)
+{
+    if(!user_info->rx){
+        user_info->rx = user_info->rx_inline;
+    }
+
+    if(user_info->rx == user_info->rx_inline){
+
+        if(user_info->rx_len < RX_INLINE_LEN - 1){
+            return RX_INLINE_LEN - 1 - user_info->rx_len;
+        }
+
+        if(conn_mem_charge(user_info, MAX_BUFF_LEN) < 0){
+            return 0;
+        }
+
+        char* buff = buf_pool_get();
+        if(!buff){
+            conn_mem_charge(user_info, -MAX_BUFF_LEN);
+            return 0;
+        }
+
+        memcpy(buff, user_info->rx_inline, user_info->rx_len);
+        user_info->rx = buff;
+    }
+
+    return MAX_BUFF_LEN - 1 - user_info->rx_len;
+}
+
+/**
+ * @brief drops the first len bytes of the receive buffer, the partial line
+ *          after them moves to the front
+ *
+ * -> the pool buffer is given back as soon as what is left fits inline
+ *
+ * @param user_info
+ * @param len
+ */
+void conn_rx_consume(user_t* user_info, size_t len)
+{
+    size_t left = user_info->rx_len - len;
+
+    if(user_info->rx != user_info->rx_inline && left < RX_INLINE_LEN){
+        memcpy(user_info->rx_inline, user_info->rx + len, left);
+        buf_pool_put(user_info->rx);
+        conn_mem_charge(user_info, -MAX_BUFF_LEN);
+        user_info->rx = user_info->rx_inline;
+    } else {
+        memmove(user_info->rx, user_info->rx + len, left);
+    }
+
+    user_info->rx_len = left;
+    user_info->rx[left] = '\0';
+}
+
+void conn_rx_release(user_t* user_info)
+{
+    if(user_info->rx && user_info->rx != user_info->rx_inline){
+        buf_pool_put(user_info->rx);
+        conn_mem_charge(user_info, -MAX_BUFF_LEN);
+    }
+
+    user_info->rx = NULL;
+    user_info->rx_len = 0;
+}
+
+/**
+ * @brief adds a room to the rooms of the connection, caller holds room->lock
+ *          and has just added the connection to the members of the room
+ *
+ * @param user_info
+ * @param room
+ * @return int 0 on success, -ENOSPC if the connection is in too many rooms
+ */
+int conn_room_add(user_t* user_info, chat_room_t* room)
+{
+    if(user_info->num_rooms == MAX_CONN_ROOMS){
+        return -ENOSPC;
+    }
+
+    user_info->rooms[user_info->num_rooms] = room;
+    __atomic_store_n(&user_info->num_rooms, user_info->num_rooms + 1,
+                        __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * @brief counterpart of conn_room_add, the others keep their order
+ *
+ */
+void conn_room_del(user_t* user_info, chat_room_t* room)
+{
+    int i = 0;
+    while(i < user_info->num_rooms && user_info->rooms[i] != room){
+        i++;
+    }
+
+    if(i == user_info->num_rooms){
+        return;
+    }
+
+    for(; i < user_info->num_rooms - 1; i++){
+        user_info->rooms[i] = user_info->rooms[i+1];
+    }
+
+    __atomic_store_n(&user_info->num_rooms, user_info->num_rooms - 1,
+                        __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief room of the connection with the given name, called by the thread
+ *          serving the connection
+ *
+ * @return chat_room_t* NULL if the connection is not in it
+ */
+chat_room_t* conn_room_find(user_t* user_info, const char* room_name)
+{
+    for(int i = 0; i < user_info->num_rooms; i++){
+        if(strcmp(user_info->rooms[i]->room_name, room_name) == 0){
+            return user_info->rooms[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,96 @@
+#ifndef __CONN_H
+#define __CONN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "timer_wheel.h"
+#include "utils.h"
+#include "rate_limit.h"
+#include "filter.h"
+#include "dedup.h"
+
+// receive buffer inside every connection, longer lines borrow from the pool
+#define RX_INLINE_LEN (256)
+// rooms one connection can be in at the same time
+#define MAX_CONN_ROOMS (32)
+// room name prefixes one connection can watch
+#define MAX_CONN_WATCHES (8)
+
+struct ChatRoom;
+
+/**
+ * @brief per connection state, owned by the thread serving the connection
+ *
+ */
+typedef struct user{
+    int connfd;
+    // interned, NULL until the JOIN was parsed. @see intern.c
+    const char* user_name;
+    const char* room_name;
+    int user_name_len;
+    int room_name_len;
+    // "<user>: " put in front of every message, built once on JOIN
+    char prefix[MAX_USERNAME_LEN + 2];
+    int prefix_len;
+    bool wants_seq;         // joined with a sequence number, @see payload.h
+    uint64_t resume_seq;    // last sequence number the client has seen
+    bool binary;            // speaks the framed protocol, @see frame.c
+
+    // rooms the connection is in, oldest first, empty until the JOIN went
+    // through. Lines without a room go to rooms[0]. Changed only by the
+    // thread serving the connection, under the lock of the room
+    struct ChatRoom* rooms[MAX_CONN_ROOMS];
+    int num_rooms;
+    bool tagged;            // lines sent to it start with "[<room>] "
+    // prefixes watched with /watch, none of them a prefix of another.
+    // Changed only by the thread serving the connection. @see trie_watch
+    char watches[MAX_CONN_WATCHES][MAX_ROOMNAME_LEN];
+    int num_watches;
+
+    pthread_t thread;       // thread serving the connection
+    bool parked;            // thread stopped for a hot upgrade
+
+    // bytes read but not yet handled, kept over a hot upgrade. rx is
+    // rx_inline or a buffer from the pool, NULL until the first read
+    char* rx;
+    size_t rx_len;
+    char rx_inline[RX_INLINE_LEN];
+
+    // idle, join deadline and heartbeat checks. @see conn_timer_fire
+    timer_node_t timer;
+    int64_t connected_ms;
+    int64_t last_active_ms; // last time anything was read, lazily checked
+    int64_t last_ping_ms;
+
+    size_t mem_bytes;       // charged to MEM_CONNS, @see mem_acct.c
+    rate_state_t rate;      // @see rate_limit.c
+    filter_ref_t filter;    // @see filter.c
+    dedup_conn_t dedup;     // @see dedup.c
+
+    // chain of its user directory bucket, @see user_dir.c
+    struct user* dir_next;
+    bool in_dir;
+}user_t;
+
+typedef void (*conn_visit_fn)(user_t* user_info, void* arg);
+
+int conn_table_init();
+int conn_register(user_t* user_info);
+void conn_unregister(user_t* user_info);
+user_t* conn_lookup(int fd);
+pthread_mutex_t* conn_write_lock(int fd);
+uint32_t conn_gen(int fd);
+void conn_for_each(conn_visit_fn visit, void* arg);
+int conn_count();
+int conn_mem_charge(user_t* user_info, long bytes);
+size_t conn_rx_reserve(user_t* user_info);
+void conn_rx_consume(user_t* user_info, size_t len);
+void conn_rx_release(user_t* user_info);
+int conn_room_add(user_t* user_info, struct ChatRoom* room);
+void conn_room_del(user_t* user_info, struct ChatRoom* room);
+struct ChatRoom* conn_room_find(user_t* user_info, const char* room_name);
+
+#endif
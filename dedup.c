@@ -0,0 +1,144 @@
+/**
+ * @file dedup.c
+ * @brief drops a line repeated within a time window
+ *
+ * -> A message is known by a 64 bit hash of its text, the sender is not
+ *     part of it. Two different lines sharing a hash are rare enough that
+ *     losing one of them is fine.
+ * -> Every connection remembers the hashes of its last DEDUP_CONN_SLOTS
+ *     lines, a bot repeating itself in one room or across rooms is caught
+ *     there without any lock.
+ * -> With room_wide every room also remembers the last lines sent to it by
+ *     anyone, in a small set associative table checked under room->lock,
+ *     which broadcasting holds anyway. Many connections sending the same
+ *     line to a room get it through once per window.
+ * -> A repeat refreshes the time of the entry, a line sent over and over
+ *     stays suppressed until it pauses for a whole window.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "utils.h"
+
+static int window;
+static bool room_wide;
+static uint64_t num_suppressed;
+
+/**
+ * @brief turns the duplicate check on
+ *
+ * @param window_ms repeats within this are dropped, 0 disables the check
+ * @param wide also drop repeats of what others sent to the room
+ */
+void dedup_init(int window_ms, bool wide)
+{
+    window = window_ms;
+    room_wide = wide;
+}
+
+bool dedup_enabled()
+{
+    return window > 0;
+}
+
+/**
+ * @brief 64 bit hash of the message, 8 bytes at a time
+ *
+ * @return uint64_t never 0
+ */
+uint64_t dedup_hash(const char* msg, size_t len)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ len;
+    uint64_t word;
+    size_t i = 0;
+
+    for(; i + 8 <= len; i += 8){
+        memcpy(&word, msg + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+
+    word = 0;
+    memcpy(&word, msg + i, len - i);
+    hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 29;
+
+    return hash ? hash : 1;
+}
+
+/**
+ * @brief looks for fp in the entries, refreshed if found within the window
+ *          and put in place of the oldest one if not
+ *
+ * @return true if it is a repeat
+ */
+static bool seen(dedup_entry_t* entries, int n, uint64_t fp, int64_t now_ms)
+{
+    dedup_entry_t* oldest = &entries[0];
+
+    for(int i = 0; i < n; i++){
+
+        if(entries[i].fp == fp && now_ms - entries[i].ts_ms < window){
+            entries[i].ts_ms = now_ms;
+            __atomic_add_fetch(&num_suppressed, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+
+        if(entries[i].ts_ms < oldest->ts_ms){
+            oldest = &entries[i];
+        }
+    }
+
+    oldest->fp = fp;
+    oldest->ts_ms = now_ms;
+
+    return false;
+}
+
+/**
+ * @brief whether the connection sent the same line within the window
+ *
+ * @param conn of the connection, only touched by the thread serving it
+ * @param fp @see dedup_hash
+ * @param now_ms
+ * @return true if it is a repeat and has to be dropped
+ */
+bool dedup_conn_seen(dedup_conn_t* conn, uint64_t fp, int64_t now_ms)
+{
+    return seen(conn->recent, DEDUP_CONN_SLOTS, fp, now_ms);
+}
+
+/**
+ * @brief whether anyone sent the same line to the room within the window,
+ *          caller holds room->lock
+ *
+ * -> the table of a room is allocated with its first message and charged
+ *     to the room, it goes with it
+ *
+ * @return true if it is a repeat and has to be dropped
+ */
+bool dedup_room_seen_locked(chat_room_t* room, uint64_t fp, int64_t now_ms)
+{
+    if(!room_wide){
+        return false;
+    }
+
+    if(!room->dedup){
+        if(!mem_acct_room_fits(room->mem_bytes, sizeof(dedup_room_t)) ||
+            !(room->dedup = (dedup_room_t*)calloc(1, sizeof(dedup_room_t)))){
+            return false;
+        }
+        room_mem_charge(room, MEM_ROOMS, sizeof(dedup_room_t));
+    }
+
+    return seen(room->dedup->sets[fp % DEDUP_ROOM_SETS], DEDUP_ROOM_WAYS, fp,
+                now_ms);
+}
+
+uint64_t dedup_suppressed()
+{
+    return __atomic_load_n(&num_suppressed, __ATOMIC_RELAXED);
+}
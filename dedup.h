@@ -0,0 +1,44 @@
+#ifndef __DEDUP_H
+#define __DEDUP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// last messages of a connection remembered
+#define DEDUP_CONN_SLOTS (8)
+// messages remembered per room, set associative
+#define DEDUP_ROOM_SETS (16)
+#define DEDUP_ROOM_WAYS (4)
+
+typedef struct DedupEntry{
+    uint64_t fp;            // 0 for an empty slot
+    int64_t ts_ms;          // last time it was sent
+}dedup_entry_t;
+
+/**
+ * @brief per connection, only touched by the thread serving it
+ *
+ */
+typedef struct DedupConn{
+    dedup_entry_t recent[DEDUP_CONN_SLOTS];
+}dedup_conn_t;
+
+/**
+ * @brief per room, protected by room->lock
+ *
+ */
+typedef struct DedupRoom{
+    dedup_entry_t sets[DEDUP_ROOM_SETS][DEDUP_ROOM_WAYS];
+}dedup_room_t;
+
+struct ChatRoom;
+
+void dedup_init(int window_ms, bool wide);
+bool dedup_enabled();
+uint64_t dedup_hash(const char* msg, size_t len);
+bool dedup_conn_seen(dedup_conn_t* conn, uint64_t fp, int64_t now_ms);
+bool dedup_room_seen_locked(struct ChatRoom* room, uint64_t fp, int64_t now_ms);
+uint64_t dedup_suppressed();
+
+#endif
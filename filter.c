@@ -0,0 +1,404 @@
+/**
+ * @file filter.c
+ * @brief drops messages containing any of a list of banned phrases
+ *
+ * -> The phrases, one per line of a file, are compiled into an Aho-Corasick
+ *     automaton with every transition filled in, so matching a message is one
+ *     table lookup per byte whatever the number of phrases. Matching ignores
+ *     ASCII case.
+ * -> Bytes that appear in no phrase share one column of the table, the
+ *     table is states x classes and not states x 256.
+ * -> A reload compiles the new set aside and swaps it in. Every connection
+ *     keeps a reference to the set it matched with last and only looks at
+ *     filter_lock when the generation changed, the common case reads one
+ *     atomic. An old set is freed once the last connection moved off it.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "filter.h"
+#include "mem_acct.h"
+
+#define FILTER_MAX_STATES (1 << 22)
+#define FILTER_LINE_LEN (1024)
+
+typedef struct Filter{
+    uint8_t cls[256];       // byte -> column, 0 for bytes in no phrase
+    int num_classes;
+    int num_states;
+    int num_patterns;
+    uint32_t* next;         // num_states rows of num_classes, state 0 is root
+    uint8_t* match;         // a phrase ends in the state or a suffix of it
+    size_t bytes;
+    int refs;               // protected by filter_lock
+}filter_t;
+
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static filter_t* current;
+static unsigned filter_gen;
+
+static uint64_t num_blocked;
+
+static void free_filter(filter_t* filter)
+{
+    mem_acct_add(MEM_FILTER, -(long)filter->bytes);
+    free(filter->next);
+    free(filter->match);
+    free(filter);
+}
+
+/**
+ * @brief drops a reference, caller holds filter_lock
+ *
+ */
+static void put_filter(filter_t* filter)
+{
+    if(filter && --filter->refs == 0){
+        free_filter(filter);
+    }
+}
+
+/**
+ * @brief grows the state table to hold one more state
+ *
+ * @return int the new state, -ENOMEM if out of memory or states
+ */
+static int add_state(filter_t* filter, int* cap)
+{
+    if(filter->num_states == *cap){
+
+        if(*cap >= FILTER_MAX_STATES){
+            return -ENOMEM;
+        }
+
+        int new_cap = *cap ? 2*(*cap) : 1024;
+        uint32_t* next = (uint32_t*)realloc(filter->next, sizeof(uint32_t)*
+                                            new_cap*filter->num_classes);
+        if(!next){
+            return -ENOMEM;
+        }
+        filter->next = next;
+
+        uint8_t* match = (uint8_t*)realloc(filter->match, new_cap);
+        if(!match){
+            return -ENOMEM;
+        }
+        filter->match = match;
+
+        *cap = new_cap;
+    }
+
+    int state = filter->num_states++;
+    memset(filter->next + (size_t)state*filter->num_classes, 0,
+            sizeof(uint32_t)*filter->num_classes);
+    filter->match[state] = 0;
+
+    return state;
+}
+
+/**
+ * @brief reads the next phrase of the file into line
+ *
+ * -> a line that does not fit in FILTER_LINE_LEN is skipped whole, matching
+ *     on a piece of it would ban a shorter phrase than the one written
+ *
+ * @param fp
+ * @param line of FILTER_LINE_LEN bytes
+ * @param skipped counts the lines that were too long
+ * @return ssize_t length of the phrase without its line end, -1 at the end
+ */
+static ssize_t next_phrase(FILE* fp, char* line, int* skipped)
+{
+    while(fgets(line, FILTER_LINE_LEN, fp)){
+
+        size_t len = strlen(line);
+        if(line[len-1] == '\n' || feof(fp)){
+            return strcspn(line, "\r\n");
+        }
+
+        int c;
+        while((c = fgetc(fp)) != EOF && c != '\n');
+        (*skipped)++;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief one class per byte used by a phrase, upper and lower case share
+ *
+ */
+static void build_classes(filter_t* filter, FILE* fp)
+{
+    char line[FILTER_LINE_LEN];
+    bool used[256] = {false};
+    int skipped = 0;
+    ssize_t len;
+
+    while((len = next_phrase(fp, line, &skipped)) >= 0){
+        for(ssize_t i = 0; i < len; i++){
+            used[tolower((unsigned char)line[i])] = true;
+        }
+    }
+
+    filter->num_classes = 1;
+    for(int b = 0; b < 256; b++){
+        if(used[b]){
+            filter->cls[b] = filter->num_classes++;
+        }
+    }
+
+    for(int b = 0; b < 256; b++){
+        filter->cls[b] = filter->cls[tolower(b)];
+    }
+}
+
+/**
+ * @brief the trie of all phrases, state 0 is the root and 0 in next means
+ *          no child yet
+ *
+ */
+static int build_trie(filter_t* filter, FILE* fp)
+{
+    char line[FILTER_LINE_LEN];
+    int cap = 0;
+    int skipped = 0;
+    ssize_t len;
+    int err;
+
+    if((err = add_state(filter, &cap)) < 0){
+        return err;
+    }
+
+    while((len = next_phrase(fp, line, &skipped)) >= 0){
+
+        if(len == 0){
+            continue;
+        }
+
+        uint32_t state = 0;
+        for(ssize_t i = 0; i < len; i++){
+
+            uint32_t* slot = filter->next + (size_t)state*filter->num_classes +
+                                filter->cls[(unsigned char)line[i]];
+            if(*slot == 0){
+                int child = add_state(filter, &cap);
+                if(child < 0){
+                    return child;
+                }
+                // add_state may have moved the table
+                slot = filter->next + (size_t)state*filter->num_classes +
+                        filter->cls[(unsigned char)line[i]];
+                *slot = child;
+            }
+            state = *slot;
+        }
+
+        filter->match[state] = 1;
+        filter->num_patterns++;
+    }
+
+    if(skipped){
+        printf("Skipped %d filter phrases longer than %d bytes\n", skipped,
+                FILTER_LINE_LEN - 2);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief turns the trie into the automaton, breadth first
+ *
+ * -> a missing transition of a state is the one of its failure state, the
+ *     longest proper suffix of it that is in the trie. Failure states are
+ *     shallower so they are done by the time they are needed.
+ *
+ */
+static int build_links(filter_t* filter)
+{
+    int nc = filter->num_classes;
+    uint32_t* fail = (uint32_t*)calloc(filter->num_states, sizeof(uint32_t));
+    uint32_t* queue = (uint32_t*)malloc(sizeof(uint32_t)*filter->num_states);
+
+    if(!fail || !queue){
+        free(fail);
+        free(queue);
+        return -ENOMEM;
+    }
+
+    int head = 0, tail = 0;
+
+    // children of the root fail to the root, missing ones loop on it
+    for(int c = 0; c < nc; c++){
+        if(filter->next[c]){
+            queue[tail++] = filter->next[c];
+        }
+    }
+
+    while(head < tail){
+
+        uint32_t state = queue[head++];
+        uint32_t* row = filter->next + (size_t)state*nc;
+        uint32_t* fail_row = filter->next + (size_t)fail[state]*nc;
+
+        filter->match[state] |= filter->match[fail[state]];
+
+        for(int c = 0; c < nc; c++){
+            if(row[c]){
+                fail[row[c]] = fail_row[c];
+                queue[tail++] = row[c];
+            } else {
+                row[c] = fail_row[c];
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+
+    return 0;
+}
+
+static filter_t* compile(const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if(!fp){
+        printf("Error opening filter %s : %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    filter_t* filter = (filter_t*)calloc(1, sizeof(filter_t));
+    if(!filter){
+        fclose(fp);
+        return NULL;
+    }
+
+    build_classes(filter, fp);
+    rewind(fp);
+
+    if(build_trie(filter, fp) < 0 || build_links(filter) < 0){
+        printf("No memory for filter %s\n", path);
+        fclose(fp);
+        free(filter->next);
+        free(filter->match);
+        free(filter);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    filter->bytes = sizeof(filter_t) + filter->num_states*
+                    (sizeof(uint32_t)*filter->num_classes + 1);
+    mem_acct_add(MEM_FILTER, filter->bytes);
+
+    return filter;
+}
+
+/**
+ * @brief compiles the phrases in the file and makes them the ones every
+ *          message is matched against
+ *
+ * -> connections move to the new set with their next message
+ *
+ * @param path one phrase per line, empty lines and lines longer than
+ *          FILTER_LINE_LEN-2 bytes are skipped
+ * @return int number of phrases, negative on error and the old set stays
+ */
+int filter_load(const char* path)
+{
+    filter_t* filter = compile(path);
+    if(!filter){
+        return -EINVAL;
+    }
+
+    filter->refs = 1;
+    int patterns = filter->num_patterns;
+
+    pthread_mutex_lock(&filter_lock);
+    filter_t* old = current;
+    current = filter;
+    __atomic_add_fetch(&filter_gen, 1, __ATOMIC_RELEASE);
+    put_filter(old);
+    pthread_mutex_unlock(&filter_lock);
+
+    return patterns;
+}
+
+/**
+ * @brief whether the message contains a banned phrase
+ *
+ * @param ref of the connection, only touched by the thread serving it
+ * @param msg
+ * @param len
+ * @return true if it has to be dropped
+ */
+bool filter_match(filter_ref_t* ref, const char* msg, size_t len)
+{
+    unsigned gen = __atomic_load_n(&filter_gen, __ATOMIC_ACQUIRE);
+
+    if(ref->gen != gen){
+        pthread_mutex_lock(&filter_lock);
+        put_filter(ref->filter);
+        if((ref->filter = current) != NULL){
+            current->refs++;
+        }
+        ref->gen = filter_gen;
+        pthread_mutex_unlock(&filter_lock);
+    }
+
+    filter_t* filter = ref->filter;
+    if(!filter){
+        return false;
+    }
+
+    const uint32_t* next = filter->next;
+    const uint8_t* cls = filter->cls;
+    int nc = filter->num_classes;
+    uint32_t state = 0;
+
+    for(size_t i = 0; i < len; i++){
+        state = next[(size_t)state*nc + cls[(unsigned char)msg[i]]];
+        if(filter->match[state]){
+            __atomic_add_fetch(&num_blocked, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief drops the reference of a connection that goes away
+ *
+ */
+void filter_release(filter_ref_t* ref)
+{
+    if(ref->filter){
+        pthread_mutex_lock(&filter_lock);
+        put_filter(ref->filter);
+        pthread_mutex_unlock(&filter_lock);
+        ref->filter = NULL;
+    }
+}
+
+void filter_stats(filter_stats_t* stats)
+{
+    memset(stats, 0, sizeof(filter_stats_t));
+
+    pthread_mutex_lock(&filter_lock);
+    if(current){
+        stats->patterns = current->num_patterns;
+        stats->states = current->num_states;
+        stats->bytes = current->bytes;
+    }
+    stats->gen = filter_gen;
+    pthread_mutex_unlock(&filter_lock);
+
+    stats->blocked = __atomic_load_n(&num_blocked, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,33 @@
+#ifndef __FILTER_H
+#define __FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct Filter;
+
+/**
+ * @brief the pattern set a connection matches with, kept until a reload.
+ *          @see filter_match
+ *
+ */
+typedef struct FilterRef{
+    struct Filter* filter;
+    unsigned gen;
+}filter_ref_t;
+
+typedef struct FilterStats{
+    int patterns;
+    int states;
+    size_t bytes;
+    unsigned gen;           // number of pattern sets loaded so far
+    uint64_t blocked;
+}filter_stats_t;
+
+int filter_load(const char* path);
+bool filter_match(filter_ref_t* ref, const char* msg, size_t len);
+void filter_release(filter_ref_t* ref);
+void filter_stats(filter_stats_t* stats);
+
+#endif
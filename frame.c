@@ -0,0 +1,188 @@
+/**
+ * @file frame.c
+ * @brief length prefixed binary protocol, spoken by connections whose first
+ *          byte is FRAME_MAGIC
+ *
+ * -> every frame is <varint length><type><payload>, length counts the type
+ *     byte and the payload. Varints are LEB128, 7 bits per byte, low first.
+ *     A frame is found in O(1), its payload is not scanned for a delimiter.
+ * -> client to server:
+ *      JOIN    <u8 room len><room><u8 user len><user>[<varint seq>]
+ *              seq asks for sequence numbers and a resume, like the 4th
+ *              token of the text JOIN
+ *      MSG     the message, any bytes. Text members get it as one line, its
+ *              newlines made spaces
+ *      LEAVE   empty, the server leaves the room and closes the connection
+ * -> server to client:
+ *      MSG     <varint seq><u8 name len><name><message>, seq 0 when the
+ *              client did not ask for sequence numbers
+ *      NOTICE  joins, leaves and digests, the text line without newline
+ *      ERROR   empty, the connection is closed right after
+ *      PING    empty, answer with anything
+ * -> Rooms store every message in its text form "<user>: <message>\n",
+ *     binary members are sent a header and two slices of it. A message
+ *     holding newlines also gets a copy with them made spaces, that one goes
+ *     to text members. @see payload_make_text
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "frame.h"
+#include "utils.h"
+
+/**
+ * @brief encodes value as a varint
+ *
+ * @return int bytes written, at most FRAME_VARINT_MAX
+ */
+int frame_varint_put(uint8_t* buff, uint64_t value)
+{
+    int n = 0;
+
+    while(value >= 0x80){
+        buff[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buff[n++] = (uint8_t)value;
+
+    return n;
+}
+
+/**
+ * @brief decodes a varint
+ *
+ * @return int bytes read, 0 if buff ends inside the varint, negative if it
+ *          is longer than FRAME_VARINT_MAX
+ */
+int frame_varint_get(const uint8_t* buff, size_t len, uint64_t* value)
+{
+    uint64_t result = 0;
+
+    for(int i = 0; i < FRAME_VARINT_MAX; i++){
+
+        if((size_t)i == len){
+            return 0;
+        }
+
+        result |= (uint64_t)(buff[i] & 0x7f) << (7*i);
+
+        if(!(buff[i] & 0x80)){
+            *value = result;
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief size of the frame at the start of buff
+ *
+ * @param buff
+ * @param len bytes in buff
+ * @param max_len largest frame, length prefix included, that is accepted
+ * @return ssize_t bytes of the first frame if all of it is in buff, 0 if
+ *          more is needed, negative if it is malformed or too big
+ */
+ssize_t frame_complete(const char* buff, size_t len, size_t max_len)
+{
+    uint64_t frame_len;
+    int n = frame_varint_get((const uint8_t*)buff, len, &frame_len);
+
+    if(n <= 0){
+        return n;
+    }
+
+    // a frame has at least its type
+    if(frame_len == 0 || frame_len > max_len - n){
+        return -1;
+    }
+
+    return (len >= n + frame_len) ? (ssize_t)(n + frame_len) : 0;
+}
+
+/**
+ * @brief length and type of a frame with payload_len bytes of payload
+ *
+ * @return int bytes of hdr used
+ */
+int frame_hdr(uint8_t* hdr, uint8_t type, size_t payload_len)
+{
+    int n = frame_varint_put(hdr, payload_len + 1);
+    hdr[n++] = type;
+
+    return n;
+}
+
+/**
+ * @brief MSG frame of a message in its text form "<user>: <message>\n"
+ *
+ * -> names have no spaces, so the first ": " ends the name
+ *
+ * @param iov 3 entries, header, name and message
+ * @param hdr FRAME_HDR_MAX bytes, filled in
+ * @param text
+ * @param len
+ * @param seq 0 if the client is not sent sequence numbers
+ * @return int number of iov entries used
+ */
+int frame_msg_iov(struct iovec* iov, uint8_t* hdr, const char* text,
+                    size_t len, uint64_t seq)
+{
+    size_t name_len = 0;
+    size_t body = 0;
+
+    for(size_t i = 0; i + 1 < len && i < MAX_USERNAME_LEN; i++){
+        if(text[i] == ':' && text[i+1] == ' '){
+            name_len = i;
+            body = i + 2;
+            break;
+        }
+    }
+
+    size_t body_len = len - body;
+    if(body_len > 0 && text[len-1] == MSG_DELIMETER){
+        body_len--;
+    }
+
+    uint8_t seq_buff[FRAME_VARINT_MAX];
+    int seq_len = frame_varint_put(seq_buff, seq);
+
+    int n = frame_hdr(hdr, FRAME_MSG, seq_len + 1 + name_len + body_len);
+    memcpy(hdr + n, seq_buff, seq_len);
+    n += seq_len;
+    hdr[n++] = (uint8_t)name_len;
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = n;
+    iov[1].iov_base = (void*)text;
+    iov[1].iov_len = name_len;
+    iov[2].iov_base = (void*)(text + body);
+    iov[2].iov_len = body_len;
+
+    return 3;
+}
+
+/**
+ * @brief NOTICE, ERROR or PING frame of a text line, trailing newlines are
+ *          dropped
+ *
+ * @param iov 2 entries, header and text
+ * @param hdr FRAME_HDR_MAX bytes, filled in
+ * @return int number of iov entries used
+ */
+int frame_text_iov(struct iovec* iov, uint8_t* hdr, uint8_t type,
+                    const char* text, size_t len)
+{
+    while(len > 0 && text[len-1] == MSG_DELIMETER){
+        len--;
+    }
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = frame_hdr(hdr, type, len);
+    iov[1].iov_base = (void*)text;
+    iov[1].iov_len = len;
+
+    return 2;
+}
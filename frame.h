@@ -0,0 +1,33 @@
+#ifndef __FRAME_H
+#define __FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// first byte of a connection that speaks the binary protocol
+#define FRAME_MAGIC (0xB7)
+
+// frame types, @see frame.c for the payload of each
+#define FRAME_JOIN (1)
+#define FRAME_MSG (2)
+#define FRAME_LEAVE (3)
+#define FRAME_NOTICE (4)
+#define FRAME_ERROR (5)
+#define FRAME_PING (6)
+
+#define FRAME_VARINT_MAX (10)
+// length, type, sequence number and name length of a MSG frame
+#define FRAME_HDR_MAX (FRAME_VARINT_MAX + 1 + FRAME_VARINT_MAX + 1)
+
+int frame_varint_put(uint8_t* buff, uint64_t value);
+int frame_varint_get(const uint8_t* buff, size_t len, uint64_t* value);
+ssize_t frame_complete(const char* buff, size_t len, size_t max_len);
+int frame_hdr(uint8_t* hdr, uint8_t type, size_t payload_len);
+int frame_msg_iov(struct iovec* iov, uint8_t* hdr, const char* text,
+                    size_t len, uint64_t seq);
+int frame_text_iov(struct iovec* iov, uint8_t* hdr, uint8_t type,
+                    const char* text, size_t len);
+
+#endif
@@ -0,0 +1,234 @@
+/**
+ * @file history.c
+ * @brief per room ring of the last messages, replayed to new members
+ *
+ * -> The ring stores the same refcounted payloads that were broadcast, so
+ *     keeping a message costs one reference and replay is a writev of the
+ *     stored buffers, nothing is formatted or copied again.
+ * -> Bounded both by number of messages and by bytes, the oldest messages
+ *     are dropped first. The ring array is only allocated on the first
+ *     message so rooms nobody talks in cost nothing.
+ * -> All functions expect the caller to hold room->lock.
+ * -> The ring and the messages in it are charged to the room as
+ *     MEM_HISTORY, and count against the memory cap of the room.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "history.h"
+#include "frame.h"
+#include "conn.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+// replay runs on the small stack of a connection thread, a batch covers
+// the default ring in one writev
+#define REPLAY_BATCH (IOV_MAX < 64 ? IOV_MAX : 64)
+
+static int history_max_msgs;
+static size_t history_max_bytes;
+
+/**
+ * @brief sets the size of every room's ring
+ *
+ * @param max_msgs messages kept per room, 0 disables history
+ * @param max_bytes bytes kept per room, 0 means only max_msgs applies
+ */
+void history_init(int max_msgs, size_t max_bytes)
+{
+    history_max_msgs = max_msgs;
+    history_max_bytes = max_bytes;
+}
+
+static void drop_oldest(chat_room_t* room)
+{
+    payload_t* oldest = room->history[room->history_head];
+
+    room->history[room->history_head] = NULL;
+    room->history_head = (room->history_head + 1) % history_max_msgs;
+    room->history_count--;
+    room->history_bytes -= oldest->len;
+    room_mem_charge(room, MEM_HISTORY, -(long)PAYLOAD_MEM(oldest));
+
+    payload_put(oldest);
+}
+
+/**
+ * @brief keeps a reference to payload as the newest message of the room
+ *
+ * @param room
+ * @param payload
+ * @return int 0 on success negative on error
+ */
+int history_push(chat_room_t* room, payload_t* payload)
+{
+    if(history_max_msgs <= 0){
+        return 0;
+    }
+
+    if(history_max_bytes && payload->len > history_max_bytes){
+        return -E2BIG;
+    }
+
+    if(!room->history){
+        room->history = (payload_t**)calloc(history_max_msgs,
+                                            sizeof(payload_t*));
+        if(!room->history){
+            printf("No memory for room history\n");
+            return -ENOMEM;
+        }
+        room_mem_charge(room, MEM_HISTORY,
+                        sizeof(payload_t*)*history_max_msgs);
+    }
+
+    while(room->history_count == history_max_msgs || (history_max_bytes &&
+            room->history_bytes + payload->len > history_max_bytes)){
+        drop_oldest(room);
+    }
+
+    // a room at its memory cap keeps fewer messages
+    size_t bytes = PAYLOAD_MEM(payload);
+    while(room->history_count > 0 &&
+            !mem_acct_room_fits(room->mem_bytes, bytes)){
+        drop_oldest(room);
+    }
+
+    if(!mem_acct_room_fits(room->mem_bytes, bytes)){
+        return -E2BIG;
+    }
+
+    int tail = (room->history_head + room->history_count) % history_max_msgs;
+
+    room->history[tail] = payload_get(payload);
+    room->history_count++;
+    room->history_bytes += payload->len;
+    room_mem_charge(room, MEM_HISTORY, bytes);
+
+    return 0;
+}
+
+/**
+ * @brief i-th stored message, 0 is the oldest
+ *
+ * @param room
+ * @param i less than room->history_count
+ * @return payload_t*
+ */
+payload_t* history_at(chat_room_t* room, int i)
+{
+    return room->history[(room->history_head + i) % history_max_msgs];
+}
+
+/**
+ * @brief sequence number of the oldest stored message
+ *
+ * @param room
+ * @return uint64_t the next sequence number if nothing is stored
+ */
+uint64_t history_oldest_seq(chat_room_t* room)
+{
+    if(room->history_count == 0){
+        return room->last_seq + 1;
+    }
+
+    return room->history[room->history_head]->seq;
+}
+
+/**
+ * @brief sends the stored messages, oldest first, to a new member
+ *
+ * -> how each message looks depends on the member, "#<seq> " prefix if it
+ *     asked for sequence numbers, MSG frames if it speaks the binary
+ *     protocol, the room tag if it is in several rooms
+ *
+ * @param room
+ * @param user_info the new member
+ * @param after_seq only messages with a larger sequence number are sent
+ * @return int 0 on success negative on error
+ */
+int history_replay(chat_room_t* room, const user_t* user_info,
+                    uint64_t after_seq)
+{
+    struct iovec iov[REPLAY_BATCH];
+    // a frame takes three iovecs, header name and message
+    uint8_t hdrs[REPLAY_BATCH/3][FRAME_HDR_MAX];
+    bool with_seq = user_info->wants_seq;
+    int i = 0;
+
+    // the ring is in sequence order, skip what the client already has
+    while(i < room->history_count &&
+        room->history[(room->history_head + i) % history_max_msgs]->seq
+            <= after_seq){
+        i++;
+    }
+
+    while(i < room->history_count){
+
+        int iovcnt = 0;
+
+        for(; i < room->history_count && iovcnt + 3 <= REPLAY_BATCH; i++){
+            payload_t* payload =
+                room->history[(room->history_head + i) % history_max_msgs];
+
+            if(user_info->binary){
+                iovcnt += frame_msg_iov(iov + iovcnt, hdrs[iovcnt/3],
+                                        payload->data, payload->len,
+                                        with_seq ? payload->seq : 0);
+                continue;
+            }
+
+            if(user_info->tagged){
+                iov[iovcnt].iov_base = room->tag;
+                iov[iovcnt].iov_len = room->tag_len;
+                iovcnt++;
+            }
+
+            iov[iovcnt].iov_base = payload->text;
+            iov[iovcnt].iov_len = payload->len;
+
+            if(with_seq){
+                iov[iovcnt].iov_base = payload->text - payload->seq_len;
+                iov[iovcnt].iov_len += payload->seq_len;
+            }
+            iovcnt++;
+        }
+
+        int err;
+        if((err = writev_all(user_info->connfd, iov, iovcnt)) < 0){
+            perror("Error replaying history");
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief drops every stored message and the ring itself
+ *
+ * @param room
+ */
+void history_clear(chat_room_t* room)
+{
+    while(room->history_count > 0){
+        drop_oldest(room);
+    }
+
+    if(room->history){
+        room_mem_charge(room, MEM_HISTORY,
+                        -(long)sizeof(payload_t*)*history_max_msgs);
+    }
+
+    free(room->history);
+    room->history = NULL;
+    room->history_head = 0;
+    room->history_bytes = 0;
+}
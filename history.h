@@ -0,0 +1,16 @@
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include "utils.h"
+#include "payload.h"
+#include "conn.h"
+
+void history_init(int max_msgs, size_t max_bytes);
+int history_push(chat_room_t* room, payload_t* payload);
+int history_replay(chat_room_t* room, const user_t* user_info,
+                    uint64_t after_seq);
+uint64_t history_oldest_seq(chat_room_t* room);
+payload_t* history_at(chat_room_t* room, int i);
+void history_clear(chat_room_t* room);
+
+#endif
@@ -0,0 +1,345 @@
+/**
+ * @file hot.c
+ * @brief the busiest rooms and users of the last interval, for operators
+ *
+ * -> Every metric is counted in a count-min sketch, a few rows of counters
+ *     where a name adds to one counter per row. The smallest of its
+ *     counters is an estimate of its count that is never too low. Next to
+ *     the sketch a min heap keeps the HOT_TOP_K names with the largest
+ *     estimates, the candidates. Memory is fixed whatever the number of
+ *     rooms and users.
+ * -> Connection threads count into HOT_STRIPES stripes, each with its own
+ *     lock, a thread always uses the same one. Threads sending to one hot
+ *     room do not all queue on one lock.
+ * -> Every interval_ms a thread adds the sketches of all stripes up,
+ *     re-estimates the candidates of every stripe against the sum, keeps the
+ *     top ones as the report and clears the stripes for the next interval.
+ *     The admin HOT command reads the last report.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "hot.h"
+
+#define HOT_STRIPES (8)
+#define HOT_DEPTH (4)
+#define HOT_WIDTH (512)
+
+typedef struct HotSketch{
+    uint32_t counts[HOT_DEPTH][HOT_WIDTH];
+    hot_entry_t top[HOT_TOP_K];     // min heap on count
+    int num_top;
+}hot_sketch_t;
+
+typedef struct HotStripe{
+    pthread_mutex_t lock;
+    hot_sketch_t sketches[HOT_NUM_METRICS];
+}hot_stripe_t;
+
+static const char* metric_names[HOT_NUM_METRICS] = {
+    [HOT_ROOM_MSGS] = "room_msgs",
+    [HOT_ROOM_BYTES] = "room_bytes",
+    [HOT_USER_MSGS] = "user_msgs",
+};
+
+static hot_stripe_t* stripes;
+static int interval;
+static int next_stripe;
+static __thread int my_stripe = -1;
+
+// last report, protected by report_lock
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static hot_entry_t report[HOT_NUM_METRICS][HOT_TOP_K];
+static int report_len[HOT_NUM_METRICS];
+static int64_t report_ms;   // length of the interval it covers
+
+static uint64_t hash_name(const char* name)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for(; *name; name++){
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+// row i uses h1 + i*h2, two halves of one hash make all the rows
+static int column(uint64_t hash, int row)
+{
+    uint32_t h1 = hash;
+    uint32_t h2 = (hash >> 32) | 1;
+
+    return (h1 + row*h2) % HOT_WIDTH;
+}
+
+static uint64_t estimate(const hot_sketch_t* sketch, uint64_t hash)
+{
+    uint64_t est = UINT32_MAX;
+
+    for(int row = 0; row < HOT_DEPTH; row++){
+        uint32_t count = sketch->counts[row][column(hash, row)];
+        est = count < est ? count : est;
+    }
+
+    return est;
+}
+
+static void sift_down(hot_entry_t* heap, int n, int i)
+{
+    while(true){
+
+        int least = i;
+        int left = 2*i + 1, right = 2*i + 2;
+
+        if(left < n && heap[left].count < heap[least].count){
+            least = left;
+        }
+        if(right < n && heap[right].count < heap[least].count){
+            least = right;
+        }
+        if(least == i){
+            return;
+        }
+
+        hot_entry_t tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+static void sift_up(hot_entry_t* heap, int i)
+{
+    while(i > 0 && heap[(i-1)/2].count > heap[i].count){
+        hot_entry_t tmp = heap[i];
+        heap[i] = heap[(i-1)/2];
+        heap[(i-1)/2] = tmp;
+        i = (i-1)/2;
+    }
+}
+
+/**
+ * @brief offers a name with its estimate to the top list of a sketch
+ *
+ * -> a name already on it has its count raised, estimates only grow
+ *
+ */
+static void offer(hot_entry_t* heap, int* n, const char* name, uint64_t est)
+{
+    for(int i = 0; i < *n; i++){
+        if(strcmp(heap[i].name, name) == 0){
+            heap[i].count = est;
+            sift_down(heap, *n, i);
+            return;
+        }
+    }
+
+    if(*n < HOT_TOP_K){
+        strcpy(heap[*n].name, name);
+        heap[*n].count = est;
+        sift_up(heap, (*n)++);
+    } else if(est > heap[0].count){
+        strcpy(heap[0].name, name);
+        heap[0].count = est;
+        sift_down(heap, *n, 0);
+    }
+}
+
+/**
+ * @brief counts count for name in the stripe of the calling thread
+ *
+ * @param metric
+ * @param name room or user name
+ * @param count messages or bytes
+ */
+void hot_add(hot_metric_t metric, const char* name, uint64_t count)
+{
+    if(!stripes){
+        return;
+    }
+
+    if(my_stripe < 0){
+        my_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) %
+                    HOT_STRIPES;
+    }
+
+    hot_stripe_t* stripe = &stripes[my_stripe];
+    hot_sketch_t* sketch = &stripe->sketches[metric];
+    uint64_t hash = hash_name(name);
+
+    pthread_mutex_lock(&stripe->lock);
+
+    for(int row = 0; row < HOT_DEPTH; row++){
+        uint32_t* counter = &sketch->counts[row][column(hash, row)];
+        *counter = (*counter > UINT32_MAX - count) ? UINT32_MAX :
+                    *counter + count;
+    }
+
+    offer(sketch->top, &sketch->num_top, name, estimate(sketch, hash));
+
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+static int cmp_count_desc(const void* a, const void* b)
+{
+    uint64_t x = ((const hot_entry_t*)a)->count;
+    uint64_t y = ((const hot_entry_t*)b)->count;
+
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief one interval is over, the stripes are summed into the report and
+ *          cleared
+ *
+ */
+static void merge(int64_t elapsed_ms)
+{
+    static hot_sketch_t sum;
+    hot_entry_t candidates[HOT_STRIPES*HOT_TOP_K];
+
+    for(int metric = 0; metric < HOT_NUM_METRICS; metric++){
+
+        memset(&sum, 0, sizeof(sum));
+        int num_candidates = 0;
+
+        for(int s = 0; s < HOT_STRIPES; s++){
+
+            pthread_mutex_lock(&stripes[s].lock);
+            hot_sketch_t* sketch = &stripes[s].sketches[metric];
+
+            // saturates like hot_add, a wrapped sum would drop the hottest
+            // name out of the report
+            for(int row = 0; row < HOT_DEPTH; row++){
+                for(int col = 0; col < HOT_WIDTH; col++){
+                    uint32_t* counter = &sum.counts[row][col];
+                    uint32_t count = sketch->counts[row][col];
+                    *counter = (*counter > UINT32_MAX - count) ? UINT32_MAX :
+                                *counter + count;
+                }
+            }
+
+            memcpy(candidates + num_candidates, sketch->top,
+                    sizeof(hot_entry_t)*sketch->num_top);
+            num_candidates += sketch->num_top;
+
+            memset(sketch, 0, sizeof(hot_sketch_t));
+            pthread_mutex_unlock(&stripes[s].lock);
+        }
+
+        // a name hot in several stripes is offered once per stripe, offer
+        // keeps one entry for it
+        for(int i = 0; i < num_candidates; i++){
+            offer(sum.top, &sum.num_top, candidates[i].name,
+                    estimate(&sum, hash_name(candidates[i].name)));
+        }
+
+        qsort(sum.top, sum.num_top, sizeof(hot_entry_t), cmp_count_desc);
+
+        pthread_mutex_lock(&report_lock);
+        memcpy(report[metric], sum.top, sizeof(hot_entry_t)*sum.num_top);
+        report_len[metric] = sum.num_top;
+        report_ms = elapsed_ms;
+        pthread_mutex_unlock(&report_lock);
+    }
+}
+
+static void* hot_merger(void* arg)
+{
+    (void)arg;
+
+    struct timespec ts = {
+        .tv_sec = interval / 1000,
+        .tv_nsec = (long)(interval % 1000) * 1000000L,
+    };
+
+    while(true){
+        nanosleep(&ts, NULL);
+        merge(interval);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief starts counting, and the thread merging the stripes
+ *
+ * @param interval_ms length of the interval a report covers
+ * @return int 0 on success negative on error
+ */
+int hot_init(int interval_ms)
+{
+    if(interval_ms <= 0){
+        return -EINVAL;
+    }
+
+    hot_stripe_t* all = (hot_stripe_t*)calloc(HOT_STRIPES,
+                                                sizeof(hot_stripe_t));
+    if(!all){
+        return -ENOMEM;
+    }
+
+    for(int s = 0; s < HOT_STRIPES; s++){
+        pthread_mutex_init(&all[s].lock, NULL);
+    }
+
+    interval = interval_ms;
+
+    pthread_t thread;
+    int err;
+    if((err = pthread_create(&thread, NULL, hot_merger, NULL)) != 0){
+        printf("Error creating hot merger : %s\n", strerror(err));
+        free(all);
+        return -err;
+    }
+    pthread_detach(thread);
+
+    __atomic_store_n(&stripes, all, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * @brief calls visit for every entry of the last report, busiest first per
+ *          metric
+ *
+ * @param visit gets the metric name, the entry and its count per second, a
+ *          negative return stops the report
+ * @return int 0, the error of visit, or -ENOENT if counting is off
+ */
+int hot_report(hot_visit_fn visit, void* arg)
+{
+    if(!stripes){
+        return -ENOENT;
+    }
+
+    hot_entry_t entries[HOT_NUM_METRICS][HOT_TOP_K];
+    int lens[HOT_NUM_METRICS];
+    int64_t ms;
+
+    pthread_mutex_lock(&report_lock);
+    memcpy(entries, report, sizeof(report));
+    memcpy(lens, report_len, sizeof(report_len));
+    ms = report_ms;
+    pthread_mutex_unlock(&report_lock);
+
+    int err;
+    for(int metric = 0; metric < HOT_NUM_METRICS; metric++){
+        for(int i = 0; i < lens[metric]; i++){
+            int64_t per_sec = ms ? entries[metric][i].count*1000 / ms : 0;
+            if((err = visit(metric_names[metric], &entries[metric][i], per_sec,
+                            arg)) < 0){
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef __HOT_H
+#define __HOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "utils.h"
+
+// what is counted, one sketch and top list each
+typedef enum HotMetric{
+    HOT_ROOM_MSGS,      // messages sent to a room
+    HOT_ROOM_BYTES,     // bytes written for them, message times members
+    HOT_USER_MSGS,      // messages a user name sent
+    HOT_NUM_METRICS,
+}hot_metric_t;
+
+#define HOT_TOP_K (10)
+
+typedef struct HotEntry{
+    char name[MAX_ROOMNAME_LEN];    // user names are no longer
+    uint64_t count;
+}hot_entry_t;
+
+typedef int (*hot_visit_fn)(const char* metric, const hot_entry_t* entry,
+                            int64_t per_sec, void* arg);
+
+int hot_init(int interval_ms);
+void hot_add(hot_metric_t metric, const char* name, uint64_t count);
+int hot_report(hot_visit_fn visit, void* arg);
+
+#endif
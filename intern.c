@@ -0,0 +1,202 @@
+/**
+ * @file intern.c
+ * @brief one shared copy of every user and room name in use
+ *
+ * -> intern_name hands out a handle, a pointer to the 0 terminated name in
+ *     the table. Everyone holding a name shares that one copy, and two
+ *     handles are the same name exactly if they are the same pointer, so
+ *     comparing names is comparing pointers.
+ * -> Handles are counted, the copy is freed when the last holder releases
+ *     it. A handle stays valid for as long as its holder does not release
+ *     it, whatever other holders do.
+ * -> INTERN_SHARDS hash tables each with their own lock, like the user
+ *     directory. @see user_dir.c
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "intern.h"
+#include "mem_acct.h"
+
+#define INTERN_SHARDS (64)
+#define INTERN_INIT_CAP (64)
+
+typedef struct InternEntry{
+    struct InternEntry* next;
+    uint32_t hash;
+    uint32_t refs;          // protected by the shard lock
+    char name[];
+}intern_entry_t;
+
+typedef struct InternShard{
+    pthread_mutex_t lock;
+    intern_entry_t** buckets;   // NULL until the first name, cap is a power of 2
+    size_t cap;
+    size_t count;
+}intern_shard_t;
+
+static intern_shard_t shards[INTERN_SHARDS];
+
+static uint32_t hash_name(const char* name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for(size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+void intern_init()
+{
+    for(int i = 0; i < INTERN_SHARDS; i++){
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+static intern_entry_t** bucket_of(intern_shard_t* shard, uint32_t hash)
+{
+    return &shard->buckets[(hash / INTERN_SHARDS) & (shard->cap - 1)];
+}
+
+/**
+ * @brief doubles the buckets of a shard, caller holds its lock
+ *
+ * @return int 0 on success, -1 if out of memory
+ */
+static int grow_shard(intern_shard_t* shard)
+{
+    size_t old_cap = shard->cap;
+    intern_entry_t** old = shard->buckets;
+
+    size_t cap = old_cap ? 2*old_cap : INTERN_INIT_CAP;
+    intern_entry_t** buckets = (intern_entry_t**)calloc(cap,
+                                                    sizeof(intern_entry_t*));
+    if(!buckets){
+        return -1;
+    }
+
+    shard->buckets = buckets;
+    shard->cap = cap;
+
+    for(size_t i = 0; i < old_cap; i++){
+        intern_entry_t* entry = old[i];
+        while(entry){
+            intern_entry_t* next = entry->next;
+            intern_entry_t** bucket = bucket_of(shard, entry->hash);
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    free(old);
+    mem_acct_add(MEM_NAMES, (long)sizeof(intern_entry_t*)*(cap - old_cap));
+
+    return 0;
+}
+
+/**
+ * @brief the handle of a name, copied into the table if nobody holds it yet
+ *
+ * -> every handle handed out has to be given back with intern_release
+ *
+ * @param name need not be 0 terminated
+ * @param len
+ * @return const char* the shared 0 terminated copy, NULL if out of memory
+ */
+const char* intern_name(const char* name, size_t len)
+{
+    uint32_t hash = hash_name(name, len);
+    intern_shard_t* shard = &shards[hash % INTERN_SHARDS];
+    intern_entry_t* entry = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(shard->cap){
+        for(entry = *bucket_of(shard, hash); entry; entry = entry->next){
+            if(entry->hash == hash && strncmp(entry->name, name, len) == 0 &&
+                entry->name[len] == '\0'){
+                break;
+            }
+        }
+    }
+
+    if(entry){
+        entry->refs++;
+        pthread_mutex_unlock(&shard->lock);
+        return entry->name;
+    }
+
+    // a shard that can not grow keeps longer chains
+    if(shard->count >= shard->cap && grow_shard(shard) < 0 && !shard->cap){
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    entry = (intern_entry_t*)malloc(sizeof(intern_entry_t) + len + 1);
+    if(!entry){
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    entry->hash = hash;
+    entry->refs = 1;
+
+    intern_entry_t** bucket = bucket_of(shard, hash);
+    entry->next = *bucket;
+    *bucket = entry;
+    shard->count++;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    mem_acct_add(MEM_NAMES, sizeof(intern_entry_t) + len + 1);
+
+    return entry->name;
+}
+
+/**
+ * @brief gives back a handle of intern_name, NULL is ignored
+ *
+ */
+void intern_release(const char* handle)
+{
+    if(!handle){
+        return;
+    }
+
+    intern_entry_t* entry = (intern_entry_t*)(handle -
+                                            offsetof(intern_entry_t, name));
+    intern_shard_t* shard = &shards[entry->hash % INTERN_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(--entry->refs > 0){
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    for(intern_entry_t** pp = bucket_of(shard, entry->hash); *pp;
+            pp = &(*pp)->next){
+        if(*pp == entry){
+            *pp = entry->next;
+            shard->count--;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    mem_acct_add(MEM_NAMES, -(long)(sizeof(intern_entry_t) + strlen(handle)
+                                    + 1));
+    free(entry);
+}
@@ -0,0 +1,10 @@
+#ifndef __INTERN_H
+#define __INTERN_H
+
+#include <stddef.h>
+
+void intern_init();
+const char* intern_name(const char* name, size_t len);
+void intern_release(const char* handle);
+
+#endif
@@ -0,0 +1,383 @@
+/**
+ * @file lock_prof.c
+ * @brief where threads queue on locks, only built with make profile
+ *
+ * -> Every lock call site of chat_server.c and utils.c gets a lock_site_t,
+ *     see the macros of lock_prof.h. They register themselves on first use.
+ *     Read and write locks of an rwlock are sites like mutex locks.
+ * -> A lock call first tries to take it. Only when it is taken is the wait
+ *     timed, an uncontended lock costs a trylock and a clock read for the
+ *     hold time.
+ * -> The hold time goes from acquiring to unlocking, charged to the site
+ *     that acquired. Each thread keeps the locks it holds on a small stack.
+ * -> Wait and hold are counted in log2 histograms per site. A report sorted
+ *     by total wait goes to the admin LOCKS command, or to stdout on
+ *     SIGUSR1.
+ *
+ */
+#ifdef LOCK_PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "lock_prof.h"
+
+// the real ones from here on
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+#undef pthread_rwlock_rdlock
+#undef pthread_rwlock_wrlock
+#undef pthread_rwlock_unlock
+
+// locks a thread may hold at once and still have timed
+#define LOCK_PROF_DEPTH (8)
+
+typedef struct HeldLock{
+    void* lock;                     // a mutex or an rwlock
+    lock_site_t* site;
+    uint64_t since_ns;
+}held_lock_t;
+
+static lock_site_t* sites;
+static __thread held_lock_t held[LOCK_PROF_DEPTH];
+static __thread int num_held;
+static int dump_pipe[2] = {-1, -1};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int bucket(uint64_t ns)
+{
+    int b = 63 - __builtin_clzll(ns | 1) - 9;
+
+    return b < 0 ? 0 : (b >= LOCK_PROF_BUCKETS ? LOCK_PROF_BUCKETS - 1 : b);
+}
+
+static void record(uint64_t* total, uint64_t* max, uint64_t* hist,
+                    uint64_t ns)
+{
+    __atomic_add_fetch(total, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist[bucket(ns)], 1, __ATOMIC_RELAXED);
+
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while(ns > old && !__atomic_compare_exchange_n(max, &old, ns, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void site_register(lock_site_t* site)
+{
+    if(__atomic_exchange_n(&site->registered, 1, __ATOMIC_ACQ_REL)){
+        return;
+    }
+
+    site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&sites, &site->next, site, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief times a lock whose trylock returned err, block takes it for real
+ *
+ * @return int what the lock call returns
+ */
+static int timed_lock(void* lock, lock_site_t* site, int err,
+                        int (*block)(void*))
+{
+    uint64_t acquired_ns;
+
+    if(err == EBUSY){
+        uint64_t start_ns = now_ns();
+
+        if((err = block(lock)) != 0){
+            return err;
+        }
+
+        acquired_ns = now_ns();
+        __atomic_add_fetch(&site->contended, 1, __ATOMIC_RELAXED);
+        record(&site->wait_ns, &site->wait_max_ns, site->wait_hist,
+                acquired_ns - start_ns);
+    } else if(err != 0){
+        return err;
+    } else {
+        acquired_ns = now_ns();
+        __atomic_add_fetch(&site->wait_hist[0], 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&site->acquired, 1, __ATOMIC_RELAXED);
+
+    if(num_held < LOCK_PROF_DEPTH){
+        held[num_held++] = (held_lock_t){lock, site, acquired_ns};
+    }
+
+    return 0;
+}
+
+/**
+ * @brief the time since lock was taken is charged to the site that took it
+ *
+ * -> locks are mostly released in reverse order, the search starts at the
+ *     top of the stack
+ *
+ */
+static void release(void* lock)
+{
+    for(int i = num_held - 1; i >= 0; i--){
+
+        if(held[i].lock != lock){
+            continue;
+        }
+
+        lock_site_t* site = held[i].site;
+        record(&site->hold_ns, &site->hold_max_ns, site->hold_hist,
+                now_ns() - held[i].since_ns);
+
+        memmove(&held[i], &held[i+1], (num_held - i - 1)*sizeof(held_lock_t));
+        num_held--;
+        break;
+    }
+}
+
+static int block_mutex(void* lock)
+{
+    return pthread_mutex_lock((pthread_mutex_t*)lock);
+}
+
+static int block_rdlock(void* lock)
+{
+    return pthread_rwlock_rdlock((pthread_rwlock_t*)lock);
+}
+
+static int block_wrlock(void* lock)
+{
+    return pthread_rwlock_wrlock((pthread_rwlock_t*)lock);
+}
+
+/**
+ * @brief pthread_mutex_lock timed for site
+ *
+ * @return int what pthread_mutex_lock returns
+ */
+int lock_prof_lock(pthread_mutex_t* mutex, lock_site_t* site)
+{
+    if(!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)){
+        site_register(site);
+    }
+
+    return timed_lock(mutex, site, pthread_mutex_trylock(mutex), block_mutex);
+}
+
+/**
+ * @brief pthread_mutex_unlock, the time since the lock is charged to the
+ *          site that took it
+ *
+ */
+int lock_prof_unlock(pthread_mutex_t* mutex)
+{
+    release(mutex);
+
+    return pthread_mutex_unlock(mutex);
+}
+
+/**
+ * @brief pthread_rwlock_rdlock timed for site, waits behind a writer only
+ *
+ * @return int what pthread_rwlock_rdlock returns
+ */
+int lock_prof_rdlock(pthread_rwlock_t* rwlock, lock_site_t* site)
+{
+    if(!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)){
+        site_register(site);
+    }
+
+    return timed_lock(rwlock, site, pthread_rwlock_tryrdlock(rwlock),
+                        block_rdlock);
+}
+
+/**
+ * @brief pthread_rwlock_wrlock timed for site
+ *
+ * @return int what pthread_rwlock_wrlock returns
+ */
+int lock_prof_wrlock(pthread_rwlock_t* rwlock, lock_site_t* site)
+{
+    if(!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)){
+        site_register(site);
+    }
+
+    return timed_lock(rwlock, site, pthread_rwlock_trywrlock(rwlock),
+                        block_wrlock);
+}
+
+/**
+ * @brief pthread_rwlock_unlock, read or write, @see lock_prof_unlock
+ *
+ */
+int lock_prof_rwunlock(pthread_rwlock_t* rwlock)
+{
+    release(rwlock);
+
+    return pthread_rwlock_unlock(rwlock);
+}
+
+static void dump_hist(int fd, const char* name, const uint64_t* hist)
+{
+    dprintf(fd, "  %s", name);
+
+    for(int b = 0; b < LOCK_PROF_BUCKETS; b++){
+        uint64_t n = __atomic_load_n(&hist[b], __ATOMIC_RELAXED);
+        if(n){
+            // upper bound of the bucket in ns, the last one has none
+            if(b == LOCK_PROF_BUCKETS - 1){
+                dprintf(fd, " inf:%" PRIu64, n);
+            } else {
+                dprintf(fd, " %" PRIu64 ":%" PRIu64, (uint64_t)1 << (b + 10),
+                        n);
+            }
+        }
+    }
+
+    dprintf(fd, "\n");
+}
+
+static int cmp_wait_desc(const void* a, const void* b)
+{
+    uint64_t x = __atomic_load_n(&(*(lock_site_t* const*)a)->wait_ns,
+                                    __ATOMIC_RELAXED);
+    uint64_t y = __atomic_load_n(&(*(lock_site_t* const*)b)->wait_ns,
+                                    __ATOMIC_RELAXED);
+
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief writes every site, most waited on first
+ *
+ * -> "<lock> <file>:<line> acquired N contended N wait_ns N wait_max_ns N
+ *     hold_ns N hold_max_ns N", then wait and hold histograms as
+ *     "<below ns>:<count>" pairs. Counters are read while others keep
+ *     counting, a line is not one instant.
+ *
+ * @return int number of sites, negative on error
+ */
+int lock_prof_dump(int fd)
+{
+    int num_sites = 0;
+    lock_site_t* head = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+
+    for(lock_site_t* site = head; site; site = site->next){
+        num_sites++;
+    }
+
+    lock_site_t** sorted = (lock_site_t**)malloc(
+                                num_sites*sizeof(lock_site_t*) + 1);
+    if(!sorted){
+        return -ENOMEM;
+    }
+
+    int n = 0;
+    for(lock_site_t* site = head; site; site = site->next){
+        sorted[n++] = site;
+    }
+
+    qsort(sorted, n, sizeof(lock_site_t*), cmp_wait_desc);
+
+    for(int i = 0; i < n; i++){
+
+        lock_site_t* site = sorted[i];
+        const char* lock = site->lock[0] == '&' ? site->lock + 1 : site->lock;
+
+        dprintf(fd, "%s %s:%d acquired %" PRIu64 " contended %" PRIu64
+                " wait_ns %" PRIu64 " wait_max_ns %" PRIu64 " hold_ns %" PRIu64
+                " hold_max_ns %" PRIu64 "\n", lock, site->file, site->line,
+                __atomic_load_n(&site->acquired, __ATOMIC_RELAXED),
+                __atomic_load_n(&site->contended, __ATOMIC_RELAXED),
+                __atomic_load_n(&site->wait_ns, __ATOMIC_RELAXED),
+                __atomic_load_n(&site->wait_max_ns, __ATOMIC_RELAXED),
+                __atomic_load_n(&site->hold_ns, __ATOMIC_RELAXED),
+                __atomic_load_n(&site->hold_max_ns, __ATOMIC_RELAXED));
+        dump_hist(fd, "wait", site->wait_hist);
+        dump_hist(fd, "hold", site->hold_hist);
+    }
+
+    free(sorted);
+
+    return n;
+}
+
+static void on_dump_signal(int sig)
+{
+    (void)sig;
+    int saved = errno;
+
+    // the dump itself is not async signal safe, a thread does it
+    if(write(dump_pipe[1], "", 1) < 0){
+        // full pipe, a dump is pending anyway
+    }
+
+    errno = saved;
+}
+
+static void* lock_prof_dumper(void* arg)
+{
+    char c;
+
+    while(true){
+        if(read(dump_pipe[0], &c, 1) <= 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return NULL;
+        }
+
+        printf("LOCKS\n");
+        fflush(stdout);
+        lock_prof_dump(STDOUT_FILENO);
+        printf("END\n");
+        fflush(stdout);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief dumps the report to stdout on SIGUSR1
+ *
+ * @return int 0 on success negative on error
+ */
+int lock_prof_init()
+{
+    if(pipe(dump_pipe) < 0){
+        return -errno;
+    }
+
+    pthread_t thread;
+    int err;
+    if((err = pthread_create(&thread, NULL, lock_prof_dumper, NULL)) != 0){
+        printf("Error creating lock profile dumper : %s\n", strerror(err));
+        return -err;
+    }
+    pthread_detach(thread);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_dump_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+
+    return 0;
+}
+
+#endif
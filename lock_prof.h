@@ -0,0 +1,71 @@
+#ifndef __LOCK_PROF_H
+#define __LOCK_PROF_H
+
+/**
+ * built with make profile every pthread_mutex_lock and pthread_mutex_unlock
+ * of a file including this header, after pthread.h, is timed, and so are
+ * pthread_rwlock_rdlock, pthread_rwlock_wrlock and pthread_rwlock_unlock.
+ * @see lock_prof.c. Otherwise this header changes nothing.
+ */
+#ifdef LOCK_PROFILE
+
+#include <stdint.h>
+#include <pthread.h>
+
+// log2 buckets of nanoseconds, the first under 1us, the last 16ms and more
+#define LOCK_PROF_BUCKETS (16)
+
+/**
+ * @brief one call site locking a mutex or rwlock, a static of the expanded
+ *          macro
+ *
+ */
+typedef struct LockSite{
+    const char* lock;           // the expression locked, e.g. &room->lock
+    const char* file;
+    int line;
+    int registered;
+    struct LockSite* next;
+    uint64_t acquired;
+    uint64_t contended;         // had to wait, the lock was taken
+    uint64_t wait_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_ns;
+    uint64_t hold_max_ns;
+    uint64_t wait_hist[LOCK_PROF_BUCKETS];
+    uint64_t hold_hist[LOCK_PROF_BUCKETS];
+}lock_site_t;
+
+int lock_prof_lock(pthread_mutex_t* mutex, lock_site_t* site);
+int lock_prof_unlock(pthread_mutex_t* mutex);
+int lock_prof_rdlock(pthread_rwlock_t* rwlock, lock_site_t* site);
+int lock_prof_wrlock(pthread_rwlock_t* rwlock, lock_site_t* site);
+int lock_prof_rwunlock(pthread_rwlock_t* rwlock);
+int lock_prof_init();
+int lock_prof_dump(int fd);
+
+#define pthread_mutex_lock(m) ({                                            \
+    static lock_site_t lock_site_ = {.lock = #m, .file = __FILE__,          \
+                                        .line = __LINE__};                  \
+    lock_prof_lock((m), &lock_site_);                                       \
+})
+
+#define pthread_mutex_unlock(m) lock_prof_unlock(m)
+
+#define pthread_rwlock_rdlock(l) ({                                         \
+    static lock_site_t lock_site_ = {.lock = #l, .file = __FILE__,          \
+                                        .line = __LINE__};                  \
+    lock_prof_rdlock((l), &lock_site_);                                     \
+})
+
+#define pthread_rwlock_wrlock(l) ({                                         \
+    static lock_site_t lock_site_ = {.lock = #l, .file = __FILE__,          \
+                                        .line = __LINE__};                  \
+    lock_prof_wrlock((l), &lock_site_);                                     \
+})
+
+#define pthread_rwlock_unlock(l) lock_prof_rwunlock(l)
+
+#endif
+
+#endif
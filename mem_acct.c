@@ -0,0 +1,95 @@
+/**
+ * @file mem_acct.c
+ * @brief byte counts of what connections, rooms and queues hold
+ *
+ * -> Every module charges what it allocates for a connection or a room to
+ *     one of the kinds below and credits it back when freed. Connections
+ *     and rooms also keep their own total, mem_bytes, which is checked
+ *     against the per connection and per room caps before they grow.
+ * -> Counts are the sizes asked of malloc, allocator overhead is not seen.
+ * -> Counters are plain atomics, readers get a consistent value per kind
+ *     but not across kinds.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "mem_acct.h"
+
+static long mem_bytes[MEM_NUM_KINDS];
+static mem_limits_t limits;
+
+static const char* mem_names[MEM_NUM_KINDS] = {
+    [MEM_CONNS] = "conns",
+    [MEM_RX_SPARE] = "rx_spare",
+    [MEM_ROOMS] = "rooms",
+    [MEM_HISTORY] = "history",
+    [MEM_TRIE] = "trie",
+    [MEM_LOG_QUEUE] = "log_queue",
+    [MEM_USER_DIR] = "user_dir",
+    [MEM_NAMES] = "names",
+    [MEM_FILTER] = "filter",
+};
+
+void mem_acct_init(const mem_limits_t* mem_limits)
+{
+    memcpy(&limits, mem_limits, sizeof(mem_limits_t));
+}
+
+/**
+ * @brief charges bytes to kind, negative bytes credit them back
+ *
+ */
+void mem_acct_add(mem_kind_t kind, long bytes)
+{
+    __atomic_add_fetch(&mem_bytes[kind], bytes, __ATOMIC_RELAXED);
+}
+
+size_t mem_acct_get(mem_kind_t kind)
+{
+    long bytes = __atomic_load_n(&mem_bytes[kind], __ATOMIC_RELAXED);
+    return bytes > 0 ? bytes : 0;
+}
+
+size_t mem_acct_total()
+{
+    size_t total = 0;
+
+    for(int kind = 0; kind < MEM_NUM_KINDS; kind++){
+        total += mem_acct_get(kind);
+    }
+
+    return total;
+}
+
+const char* mem_acct_name(mem_kind_t kind)
+{
+    return mem_names[kind];
+}
+
+/**
+ * @brief can a connection holding conn_bytes take more
+ *
+ */
+bool mem_acct_conn_fits(size_t conn_bytes, size_t more)
+{
+    return !limits.conn_max || conn_bytes + more <= limits.conn_max;
+}
+
+/**
+ * @brief can a room holding room_bytes take more
+ *
+ */
+bool mem_acct_room_fits(size_t room_bytes, size_t more)
+{
+    return !limits.room_max || room_bytes + more <= limits.room_max;
+}
+
+/**
+ * @brief is the server as a whole still under its cap
+ *
+ */
+bool mem_acct_total_fits()
+{
+    return !limits.total_max || mem_acct_total() < limits.total_max;
+}
@@ -0,0 +1,43 @@
+#ifndef __MEM_ACCT_H
+#define __MEM_ACCT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief what accounted memory is used for
+ *
+ */
+typedef enum MemKind{
+    MEM_CONNS,          // user_t, names and borrowed receive buffers
+    MEM_RX_SPARE,       // receive buffers waiting in the pool
+    MEM_ROOMS,          // chat_room_t, names and member arrays
+    MEM_HISTORY,        // history rings and the messages they hold
+    MEM_TRIE,           // trie nodes
+    MEM_LOG_QUEUE,      // messages waiting for the log writer
+    MEM_USER_DIR,       // buckets of the user directory
+    MEM_NAMES,          // interned user and room names, @see intern.c
+    MEM_FILTER,         // banned phrase automaton, @see filter.c
+    MEM_NUM_KINDS,
+}mem_kind_t;
+
+/**
+ * @brief caps on accounted memory, 0 for no cap
+ *
+ */
+typedef struct MemLimits{
+    size_t conn_max;    // per connection
+    size_t room_max;    // per room, member array and history
+    size_t total_max;   // new connections are turned away above this
+}mem_limits_t;
+
+void mem_acct_init(const mem_limits_t* limits);
+void mem_acct_add(mem_kind_t kind, long bytes);
+size_t mem_acct_get(mem_kind_t kind);
+size_t mem_acct_total();
+const char* mem_acct_name(mem_kind_t kind);
+bool mem_acct_conn_fits(size_t conn_bytes, size_t more);
+bool mem_acct_room_fits(size_t room_bytes, size_t more);
+bool mem_acct_total_fits();
+
+#endif
@@ -0,0 +1,147 @@
+/**
+ * @file payload.c
+ * @brief refcounted message buffers. @see payload.h
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "payload.h"
+
+/**
+ * @brief allocates a payload of len bytes for the caller to fill in,
+ *          refcount starts at one
+ *
+ * @param len
+ * @return payload_t* NULL if out of memory
+ */
+payload_t* payload_alloc(size_t len)
+{
+    payload_t* payload = (payload_t*)malloc(PAYLOAD_BYTES(len));
+
+    if(!payload){
+        printf("No memory for payload\n");
+        return NULL;
+    }
+
+    payload->refcnt = 1;
+    payload->seq = 0;
+    payload->seq_len = 0;
+    payload->len = len;
+    payload->data = payload->buff + PAYLOAD_SEQ_ROOM;
+    payload->text = payload->data;
+
+    return payload;
+}
+
+/**
+ * @brief allocates a payload holding a copy of data, refcount starts at one
+ *
+ * @param data
+ * @param len
+ * @return payload_t* NULL if out of memory
+ */
+payload_t* payload_create(const char* data, size_t len)
+{
+    payload_t* payload = payload_alloc(len);
+
+    if(payload){
+        memcpy(payload->data, data, len);
+    }
+
+    if(payload && payload_make_text(payload) < 0){
+        payload_put(payload);
+        return NULL;
+    }
+
+    return payload;
+}
+
+/**
+ * @brief gives a message with newlines before its last byte a text form of
+ *          one line, called once data is filled in
+ *
+ * -> only binary members can send such a message. Text members get a copy
+ *     with every newline but the last made a space, binary members still
+ *     get the bytes as they were sent
+ * -> the copy has its own room for the "#<seq> " prefix
+ *
+ * @param payload
+ * @return int 0 on success, -ENOMEM
+ */
+int payload_make_text(payload_t* payload)
+{
+    if(payload->len < 2 || !memchr(payload->data, '\n', payload->len - 1)){
+        return 0;
+    }
+
+    char* text = (char*)malloc(PAYLOAD_SEQ_ROOM + payload->len);
+    if(!text){
+        printf("No memory for payload\n");
+        return -ENOMEM;
+    }
+
+    text += PAYLOAD_SEQ_ROOM;
+    memcpy(text, payload->data, payload->len);
+
+    for(size_t i = 0; i < payload->len - 1; i++){
+        if(text[i] == '\n'){
+            text[i] = ' ';
+        }
+    }
+
+    payload->text = text;
+
+    return 0;
+}
+
+/**
+ * @brief stamps the payload with its sequence number in the room, writes
+ *          "#<seq> " right in front of data
+ *
+ * @param payload
+ * @param seq
+ */
+void payload_set_seq(payload_t* payload, uint64_t seq)
+{
+    char* pos = payload->data;
+
+    *--pos = ' ';
+
+    uint64_t n = seq;
+    do{
+        *--pos = '0' + (n % 10);
+        n /= 10;
+    }while(n);
+
+    *--pos = '#';
+
+    payload->seq = seq;
+    payload->seq_len = payload->data - pos;
+
+    if(payload->text != payload->data){
+        memcpy(payload->text - payload->seq_len, pos, payload->seq_len);
+    }
+}
+
+payload_t* payload_get(payload_t* payload)
+{
+    __atomic_add_fetch(&payload->refcnt, 1, __ATOMIC_RELAXED);
+    return payload;
+}
+
+void payload_put(payload_t* payload)
+{
+    if(!payload){
+        return;
+    }
+
+    if(__atomic_sub_fetch(&payload->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+        if(payload->text != payload->data){
+            free(payload->text - PAYLOAD_SEQ_ROOM);
+        }
+        free(payload);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef __PAYLOAD_H
+#define __PAYLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// room in front of the message for "#<seq> ", 20 digits of uint64 + 2
+#define PAYLOAD_SEQ_ROOM (22)
+
+/**
+ * @brief preformatted message shared by everyone who sends or stores it.
+ * -> formatted once, written to every member, kept in the room history
+ *     without copying. Freed when the last reference is dropped.
+ * -> data points PAYLOAD_SEQ_ROOM bytes into buff, once the room has stamped
+ *     the message the "#<seq> " prefix is written right before data, so
+ *     clients that asked for sequence numbers are sent data - seq_len.
+ * -> text members are sent text instead of data. It is data, unless the
+ *     message of a binary member holds newlines, @see payload_make_text
+ *
+ */
+typedef struct Payload{
+    int refcnt;
+    uint64_t seq;       // 0 if not a sequenced chat message
+    size_t seq_len;
+    size_t len;
+    char* data;
+    char* text;
+    char buff[];
+}payload_t;
+
+// bytes malloc'd for a payload of len bytes
+#define PAYLOAD_BYTES(len) (sizeof(payload_t) + PAYLOAD_SEQ_ROOM + (len))
+// bytes malloc'd for payload, with its text copy if it has one
+#define PAYLOAD_MEM(payload) (PAYLOAD_BYTES((payload)->len) +                \
+        ((payload)->text != (payload)->data ? PAYLOAD_SEQ_ROOM +            \
+                                                (payload)->len : 0))
+
+payload_t* payload_alloc(size_t len);
+payload_t* payload_create(const char* data, size_t len);
+int payload_make_text(payload_t* payload);
+void payload_set_seq(payload_t* payload, uint64_t seq);
+payload_t* payload_get(payload_t* payload);
+void payload_put(payload_t* payload);
+
+#endif
@@ -0,0 +1,239 @@
+/**
+ * @file presence.c
+ * @brief coalesces "has joined"/"has left" announcements of big rooms
+ *
+ * -> In a room with N members every join or leave costs N writes, so with
+ *     reconnect churn the presence chatter dwarfs the real messages.
+ * -> Once a room has at least presence_threshold members its joins and leaves
+ *     are recorded in the room instead of being broadcast, and a flusher
+ *     thread sends one digest per room every presence_interval_ms:
+ *         "alice, bob, carol and 37 others have joined"
+ * -> Rooms with pending events sit on a singly linked dirty list.
+ *
+ * Locking: room->lock protects the digest of a room, presence_lock protects
+ * the dirty list. Members take room->lock then presence_lock, so the flusher
+ * (which walks the list) only ever trylocks a room. A room that is busy is
+ * left on the list for the next tick.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+
+#include "presence.h"
+
+// joins and leaves are formatted into one buffer, names are short
+#define DIGEST_BUFF_LEN (2*PRESENCE_MAX_NAMES*(MAX_USERNAME_LEN+2) + 128)
+
+static pthread_mutex_t presence_lock = PTHREAD_MUTEX_INITIALIZER;
+static chat_room_t* dirty_head;
+static int flush_interval_ms;
+
+static void note_name(presence_list_t* list, const char* user_name)
+{
+    if(list->num_names < PRESENCE_MAX_NAMES){
+        strncpy(list->names[list->num_names], user_name, MAX_USERNAME_LEN-1);
+        list->names[list->num_names][MAX_USERNAME_LEN-1] = '\0';
+        list->num_names++;
+    }
+
+    list->total++;
+}
+
+/**
+ * @brief record a join or leave for the next digest of the room, caller holds
+ *          room->lock
+ *
+ * @param room
+ * @param user_name
+ * @param joined true for a join, false for a leave
+ */
+void presence_note(chat_room_t* room, const char* user_name, bool joined)
+{
+    note_name(joined ? &room->joined : &room->left, user_name);
+
+    if(room->presence_queued){
+        return;
+    }
+
+    pthread_mutex_lock(&presence_lock);
+    room->presence_queued = true;
+    room->presence_next = dirty_head;
+    dirty_head = room;
+    pthread_mutex_unlock(&presence_lock);
+}
+
+/**
+ * @brief drop the pending digest of a room which is about to be deleted,
+ *          caller holds room->lock
+ *
+ * @param room
+ */
+void presence_cancel(chat_room_t* room)
+{
+    if(room->presence_queued){
+
+        pthread_mutex_lock(&presence_lock);
+        for(chat_room_t** pp = &dirty_head; *pp; pp = &(*pp)->presence_next){
+            if(*pp == room){
+                *pp = room->presence_next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&presence_lock);
+
+        room->presence_queued = false;
+        room->presence_next = NULL;
+    }
+
+    memset(&room->joined, 0, sizeof(presence_list_t));
+    memset(&room->left, 0, sizeof(presence_list_t));
+}
+
+/**
+ * @brief appends "a, b and N others have <verb>\n" to buff
+ *
+ * @return int number of bytes appended
+ */
+static int format_list(char* buff, size_t len, const presence_list_t* list,
+                        const char* verb)
+{
+    if(list->total == 0){
+        return 0;
+    }
+
+    int off = 0;
+    int others = list->total - list->num_names;
+
+    for(int i = 0; i < list->num_names; i++){
+
+        const char* sep = "";
+        if(i > 0){
+            sep = (i == list->num_names-1 && others == 0) ? " and " : ", ";
+        }
+
+        off += snprintf(buff+off, len-off, "%s%s", sep, list->names[i]);
+    }
+
+    if(others > 0){
+        off += snprintf(buff+off, len-off, " and %d other%s", others,
+                        others == 1 ? "" : "s");
+    }
+
+    off += snprintf(buff+off, len-off, " %s %s\n",
+                    list->total == 1 ? "has" : "have", verb);
+
+    return off;
+}
+
+/**
+ * @brief sends the digest of one room and resets it, caller holds room->lock
+ *
+ */
+static void flush_room(chat_room_t* room)
+{
+    char buff[DIGEST_BUFF_LEN];
+
+    int len = format_list(buff, DIGEST_BUFF_LEN, &room->joined, "joined");
+    len += format_list(buff+len, DIGEST_BUFF_LEN-len, &room->left, "left");
+
+    memset(&room->joined, 0, sizeof(presence_list_t));
+    memset(&room->left, 0, sizeof(presence_list_t));
+
+    if(len > 0){
+        room_broadcast_locked(room, buff, len);
+    }
+}
+
+/**
+ * @brief unlinks the first room on the dirty list whose lock can be taken
+ *          without blocking
+ *
+ * @param skip number of busy rooms at the head of the list to step over
+ *
+ * @return chat_room_t* locked room or NULL when no room could be taken
+ */
+static chat_room_t* take_dirty_room(int* skip)
+{
+    chat_room_t* room = NULL;
+
+    pthread_mutex_lock(&presence_lock);
+
+    chat_room_t** pp = &dirty_head;
+    for(int i = 0; *pp && i < *skip; i++){
+        pp = &(*pp)->presence_next;
+    }
+
+    while(*pp){
+
+        if(pthread_mutex_trylock(&(*pp)->lock) == 0){
+            room = *pp;
+            *pp = room->presence_next;
+            room->presence_queued = false;
+            room->presence_next = NULL;
+            break;
+        }
+
+        // busy, someone is sending to it right now. try on the next tick
+        pp = &(*pp)->presence_next;
+        (*skip)++;
+    }
+
+    pthread_mutex_unlock(&presence_lock);
+
+    return room;
+}
+
+static void* presence_flusher(void* arg)
+{
+    (void)arg;
+
+    struct timespec interval;
+    interval.tv_sec = flush_interval_ms / 1000;
+    interval.tv_nsec = (long)(flush_interval_ms % 1000) * 1000000L;
+
+    while(true){
+
+        nanosleep(&interval, NULL);
+
+        int skip = 0;
+        chat_room_t* room;
+
+        while((room = take_dirty_room(&skip)) != NULL){
+            flush_room(room);
+            pthread_mutex_unlock(&room->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief starts the digest flusher thread
+ *
+ * @param interval_ms time between two digests of a room
+ *
+ * @return int 0 on success negative on error
+ */
+int presence_init(int interval_ms)
+{
+    if(interval_ms <= 0){
+        return -EINVAL;
+    }
+
+    flush_interval_ms = interval_ms;
+
+    pthread_t thread;
+    int err;
+    if((err = pthread_create(&thread, NULL, presence_flusher, NULL)) != 0){
+        printf("Error creating presence flusher : %s\n", strerror(err));
+        return -err;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef __PRESENCE_H
+#define __PRESENCE_H
+
+#include "utils.h"
+
+int presence_init(int interval_ms);
+void presence_note(chat_room_t* room, const char* user_name, bool joined);
+void presence_cancel(chat_room_t* room);
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * @file rate_limit.c
+ * @brief per connection token buckets on messages and bytes per second
+ *
+ * -> One message in a room of N members costs N writes, a single client
+ *     sending as fast as it can takes the fan out of the whole server.
+ *     Every message a connection sends takes a token from its message
+ *     bucket and one per byte from its byte bucket first.
+ * -> A bucket holds one second worth of its rate and refills with the
+ *     time since it was last looked at, nothing runs in the background.
+ * -> The buckets live in user_t and only the thread serving the connection
+ *     touches them, so they need no lock. The counters are atomics.
+ * -> Delaying sleeps in the thread serving the connection. It reads
+ *     nothing meanwhile, TCP pushes back on the client.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "rate_limit.h"
+#include "timer_wheel.h"
+
+// a bucket holds this much of its rate
+#define RATE_BURST_MS (1000)
+// longer idle times fill any bucket, and keep the refill from overflowing
+#define RATE_MAX_IDLE_MS (60*1000)
+
+static rate_limits_t limits;
+static rate_counts_t counts;
+
+void rate_init(const rate_limits_t* rate_limits)
+{
+    memcpy(&limits, rate_limits, sizeof(rate_limits_t));
+}
+
+bool rate_enabled()
+{
+    return limits.msgs_per_sec > 0 || limits.bytes_per_sec > 0;
+}
+
+static void refill(token_bucket_t* bucket, int64_t rate, int64_t now)
+{
+    int64_t elapsed = now - bucket->last_ms;
+    if(elapsed > RATE_MAX_IDLE_MS || bucket->last_ms == 0){
+        elapsed = RATE_MAX_IDLE_MS;
+    }
+
+    bucket->tokens += elapsed*rate;
+    if(bucket->tokens > rate*RATE_BURST_MS){
+        bucket->tokens = rate*RATE_BURST_MS;
+    }
+
+    bucket->last_ms = now;
+}
+
+/**
+ * @brief ms until the bucket can pay cost, a cost larger than the bucket
+ *          only waits for a full one
+ *
+ */
+static int64_t wait_ms(const token_bucket_t* bucket, int64_t rate, int64_t cost)
+{
+    if(rate == 0){
+        return 0;
+    }
+
+    int64_t need = cost*1000;
+    if(need > rate*RATE_BURST_MS){
+        need = rate*RATE_BURST_MS;
+    }
+
+    if(bucket->tokens >= need){
+        return 0;
+    }
+
+    return (need - bucket->tokens + rate - 1) / rate;
+}
+
+static int64_t rate_wait(rate_state_t* rate, size_t len, int64_t now)
+{
+    refill(&rate->msgs, limits.msgs_per_sec, now);
+    refill(&rate->bytes, limits.bytes_per_sec, now);
+
+    int64_t msgs_wait = wait_ms(&rate->msgs, limits.msgs_per_sec, 1);
+    int64_t bytes_wait = wait_ms(&rate->bytes, limits.bytes_per_sec, len);
+
+    return msgs_wait > bytes_wait ? msgs_wait : bytes_wait;
+}
+
+/**
+ * @brief takes the tokens of one message of len bytes from the buckets of
+ *          the connection
+ *
+ * -> a message over the limit is handled as the policy says, delaying
+ *     returns once the buckets refilled, at most RATE_BURST_MS later
+ *
+ * @param rate buckets of the connection
+ * @param len bytes of the message
+ * @return int 0 to send it, 1 to drop it, -EPERM to drop the connection
+ */
+int rate_admit(rate_state_t* rate, size_t len)
+{
+    int64_t wait = rate_wait(rate, len, timer_now_ms());
+
+    if(wait > 0){
+
+        __atomic_add_fetch(&counts.limited, 1, __ATOMIC_RELAXED);
+
+        switch(limits.policy){
+        case RATE_DROP:
+            __atomic_add_fetch(&counts.dropped, 1, __ATOMIC_RELAXED);
+            return 1;
+        case RATE_DISCONNECT:
+            __atomic_add_fetch(&counts.disconnected, 1, __ATOMIC_RELAXED);
+            return -EPERM;
+        case RATE_DELAY:
+            __atomic_add_fetch(&counts.delayed, 1, __ATOMIC_RELAXED);
+            while(wait > 0){
+                struct timespec ts = {
+                    .tv_sec = wait / 1000,
+                    .tv_nsec = (wait % 1000) * 1000000L,
+                };
+                nanosleep(&ts, NULL);
+                wait = rate_wait(rate, len, timer_now_ms());
+            }
+            break;
+        }
+    }
+
+    if(limits.msgs_per_sec > 0){
+        rate->msgs.tokens -= 1000;
+    }
+    if(limits.bytes_per_sec > 0){
+        rate->bytes.tokens -= (int64_t)len*1000;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief the policy named on the command line
+ *
+ * @return int 0 on success, -EINVAL for an unknown name
+ */
+int rate_policy_parse(const char* name, rate_policy_t* policy)
+{
+    if(strcmp(name, "drop") == 0){
+        *policy = RATE_DROP;
+    } else if(strcmp(name, "delay") == 0){
+        *policy = RATE_DELAY;
+    } else if(strcmp(name, "disconnect") == 0){
+        *policy = RATE_DISCONNECT;
+    } else {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+void rate_counts(rate_counts_t* out)
+{
+    out->limited = __atomic_load_n(&counts.limited, __ATOMIC_RELAXED);
+    out->dropped = __atomic_load_n(&counts.dropped, __ATOMIC_RELAXED);
+    out->delayed = __atomic_load_n(&counts.delayed, __ATOMIC_RELAXED);
+    out->disconnected = __atomic_load_n(&counts.disconnected,
+                                            __ATOMIC_RELAXED);
+}
@@ -0,0 +1,64 @@
+#ifndef __RATE_LIMIT_H
+#define __RATE_LIMIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief what happens to a message over the limit
+ *
+ */
+typedef enum RatePolicy{
+    RATE_DROP,          // thrown away, the connection carries on
+    RATE_DELAY,         // sent once the bucket refilled, reads stop meanwhile
+    RATE_DISCONNECT,    // the connection is dropped with ERROR
+}rate_policy_t;
+
+/**
+ * @brief limits of every connection, 0 for no limit
+ *
+ */
+typedef struct RateLimits{
+    int msgs_per_sec;
+    size_t bytes_per_sec;
+    rate_policy_t policy;
+}rate_limits_t;
+
+/**
+ * @brief tokens in thousandths so that a millisecond of a slow rate still
+ *          adds some, may go below 0 for one message larger than the bucket
+ *
+ */
+typedef struct TokenBucket{
+    int64_t tokens;
+    int64_t last_ms;
+}token_bucket_t;
+
+/**
+ * @brief per connection, only touched by the thread serving it
+ *
+ */
+typedef struct RateState{
+    token_bucket_t msgs;
+    token_bucket_t bytes;
+}rate_state_t;
+
+/**
+ * @brief server wide counts of messages over the limit
+ *
+ */
+typedef struct RateCounts{
+    uint64_t limited;
+    uint64_t dropped;
+    uint64_t delayed;
+    uint64_t disconnected;
+}rate_counts_t;
+
+void rate_init(const rate_limits_t* limits);
+bool rate_enabled();
+int rate_admit(rate_state_t* rate, size_t len);
+int rate_policy_parse(const char* name, rate_policy_t* policy);
+void rate_counts(rate_counts_t* counts);
+
+#endif
@@ -0,0 +1,1180 @@
+/**
+ * @file room_log.c
+ * @brief optional durable log of every chat message
+ *
+ * -> Rooms are hashed onto a fixed number of shards, each shard is an append
+ *     only sequence of segment files <dir>/shardNNN-<index>.log. A million
+ *     rooms must not mean a million open files.
+ * -> Broadcasting threads never touch the disk: room_log_append only queues a
+ *     reference to the payload. A single writer thread drains the queue,
+ *     batches records per shard into one write() and then fdatasync()s each
+ *     shard it wrote to once per batch (group commit).
+ * -> A shard rolls to a new segment once the active one is segment_bytes
+ *     big. Sealed segments are deleted oldest first when the shard is over
+ *     retain_bytes or the segment is older than retain_sec.
+ * -> Readers mmap the segments, a segment deleted while mapped stays
+ *     readable until it is unmapped.
+ * -> Every shard keeps a small hash of room name -> newest sequence number
+ *     logged, rebuilt from the segments on start, so a room that is created
+ *     again continues its numbering instead of reusing logged numbers.
+ * -> The hash also keeps a few marks per room, where in which segment a
+ *     record of the room with a given sequence number starts, spread over
+ *     everything logged for the room. A resume starts reading at the mark
+ *     just before the sequence number it wants and stops at the first record
+ *     it does not, instead of scanning the whole shard.
+ * -> Records still queued or being written are read from memory, a resume
+ *     never misses a message the writer thread has not got to yet.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "room_log.h"
+#include "utils.h"
+
+#define LOG_PATH_LEN (4096)
+// records waiting for the writer, further appends are dropped and counted
+#define LOG_MAX_QUEUED (1<<20)
+#define SEQ_INDEX_INIT_CAP (64)
+// marks kept per room, and messages of a room between the newest two
+#define LOG_MARKS (8)
+#define LOG_MARK_SEQS (256)
+
+typedef struct LogEntry{
+    struct LogEntry* next;
+    payload_t* payload;
+    int64_t ts_ms;
+    uint16_t room_len;
+    char room_name[MAX_ROOMNAME_LEN];
+}log_entry_t;
+
+/**
+ * @brief where a record starts, every record of its room from seq on is at or
+ *          after it
+ *
+ */
+typedef struct LogPos{
+    uint64_t seq;
+    uint64_t segment;
+    size_t off;
+}log_pos_t;
+
+typedef struct SeqSlot{
+    uint64_t seq;           // 0 marks an empty slot
+    uint16_t room_len;
+    uint16_t num_marks;
+    char room_name[MAX_ROOMNAME_LEN];
+    log_pos_t marks[LOG_MARKS];     // oldest first
+}seq_slot_t;
+
+typedef struct LogSegment{
+    uint64_t index;
+    size_t size;
+    time_t mtime;
+    struct LogSegment* next;
+}log_segment_t;
+
+typedef struct LogShard{
+    pthread_mutex_t lock;       // protects the segment list
+    log_segment_t* oldest;
+    log_segment_t* active;      // newest segment, the one being appended to
+    size_t total_bytes;
+
+    pthread_mutex_t index_lock; // protects the sequence index
+    seq_slot_t* index;
+    size_t index_cap;
+    size_t index_used;
+
+    // below are only touched by the writer thread
+    int fd;
+    char* buff;
+    size_t buff_len;
+    size_t buff_cap;
+}log_shard_t;
+
+static log_config_t config;
+static log_shard_t* shards;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static bool writer_busy;
+static log_entry_t* queue_head;
+static log_entry_t* queue_tail;
+static log_entry_t* writing;    // taken by the writer, freed once on disk
+static long queued;
+static uint64_t dropped;    // records never written, queue full or I/O error
+
+static uint32_t hash_name(const char* name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for(size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static log_shard_t* shard_of(const char* room_name, size_t len)
+{
+    return &shards[hash_name(room_name, len) % config.shards];
+}
+
+static void segment_path(char* path, int shard, uint64_t index)
+{
+    snprintf(path, LOG_PATH_LEN, "%s/shard%03d-%020llu.log", config.dir, shard,
+                (unsigned long long)index);
+}
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+bool room_log_enabled()
+{
+    return shards != NULL;
+}
+
+static seq_slot_t* index_slot(seq_slot_t* index, size_t cap,
+                                const char* room_name, size_t len)
+{
+    size_t i = hash_name(room_name, len) / config.shards % cap;
+
+    while(index[i].seq != 0 && (index[i].room_len != len ||
+            memcmp(index[i].room_name, room_name, len) != 0)){
+        i = (i + 1) % cap;
+    }
+
+    return &index[i];
+}
+
+/**
+ * @brief remembers seq as the newest logged number of the room, caller holds
+ *          shard->index_lock
+ *
+ */
+static int index_update(log_shard_t* shard, const char* room_name, size_t len,
+                        uint64_t seq)
+{
+    if((shard->index_used + 1)*10 >= shard->index_cap*7){
+
+        size_t cap = shard->index_cap ? 2*shard->index_cap : SEQ_INDEX_INIT_CAP;
+        seq_slot_t* index = (seq_slot_t*)calloc(cap, sizeof(seq_slot_t));
+
+        if(!index){
+            return -ENOMEM;
+        }
+
+        for(size_t i = 0; i < shard->index_cap; i++){
+            seq_slot_t* old = &shard->index[i];
+            if(old->seq){
+                *index_slot(index, cap, old->room_name, old->room_len) = *old;
+            }
+        }
+
+        free(shard->index);
+        shard->index = index;
+        shard->index_cap = cap;
+    }
+
+    seq_slot_t* slot = index_slot(shard->index, shard->index_cap, room_name,
+                                    len);
+
+    if(slot->seq == 0){
+        slot->room_len = len;
+        memcpy(slot->room_name, room_name, len);
+        shard->index_used++;
+    }
+
+    if(seq > slot->seq){
+        slot->seq = seq;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief newest sequence number logged for the room
+ *
+ * @param room_name
+ * @return uint64_t 0 if nothing was logged or the log is disabled
+ */
+uint64_t room_log_last_seq(const char* room_name)
+{
+    if(!shards){
+        return 0;
+    }
+
+    size_t len = strnlen(room_name, MAX_ROOMNAME_LEN-1);
+    log_shard_t* shard = shard_of(room_name, len);
+    uint64_t seq = 0;
+
+    pthread_mutex_lock(&shard->index_lock);
+    if(shard->index){
+        seq = index_slot(shard->index, shard->index_cap, room_name, len)->seq;
+    }
+    pthread_mutex_unlock(&shard->index_lock);
+
+    return seq;
+}
+
+/**
+ * @brief remembers where a record of the room starts, caller holds
+ *          shard->index_lock
+ *
+ * -> one mark every LOG_MARK_SEQS messages. Once all LOG_MARKS are used
+ *     the mark closest to both its neighbours goes, the gaps grow with age.
+ *     A recent resume reads at most LOG_MARK_SEQS messages of the room it
+ *     does not need, an old one about as many as it is old.
+ *
+ */
+static void index_mark(log_shard_t* shard, const char* room_name, size_t len,
+                        log_pos_t pos)
+{
+    if(!shard->index || pos.seq == 0){
+        return;
+    }
+
+    seq_slot_t* slot = index_slot(shard->index, shard->index_cap, room_name,
+                                    len);
+    if(slot->seq == 0){
+        return;     // not indexed, out of memory
+    }
+
+    log_pos_t* marks = slot->marks;
+
+    if(slot->num_marks &&
+        pos.seq < marks[slot->num_marks-1].seq + LOG_MARK_SEQS){
+        return;
+    }
+
+    // the first and the newest stay, the first covers everything before
+    if(slot->num_marks == LOG_MARKS){
+
+        int drop = 1;
+        for(int i = 2; i < LOG_MARKS - 1; i++){
+            if(marks[i+1].seq - marks[i-1].seq <
+                marks[drop+1].seq - marks[drop-1].seq){
+                drop = i;
+            }
+        }
+
+        memmove(&marks[drop], &marks[drop+1],
+                (LOG_MARKS - drop - 1)*sizeof(log_pos_t));
+        slot->num_marks--;
+    }
+
+    marks[slot->num_marks++] = pos;
+}
+
+/**
+ * @brief where to start reading the records of the room after after_seq
+ *
+ * @return log_pos_t the newest mark at or before after_seq + 1, the start of
+ *          the shard if there is none
+ */
+static log_pos_t index_find(log_shard_t* shard, const char* room_name,
+                            size_t len, uint64_t after_seq)
+{
+    log_pos_t from = {0, 0, 0};
+
+    pthread_mutex_lock(&shard->index_lock);
+
+    if(shard->index){
+        seq_slot_t* slot = index_slot(shard->index, shard->index_cap,
+                                        room_name, len);
+
+        for(int i = 0; i < slot->num_marks; i++){
+            if(slot->marks[i].seq <= after_seq + 1 &&
+                slot->marks[i].seq > from.seq){
+                from = slot->marks[i];
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&shard->index_lock);
+
+    return from;
+}
+
+/**
+ * @brief queues the payload to be logged under the room, never blocks on disk
+ *
+ * -> called with room->lock held so records of a room are in broadcast order
+ *
+ * @param room_name
+ * @param payload the log keeps its own reference until it is written
+ * @return int 0 on success negative on error
+ */
+int room_log_append(const char* room_name, payload_t* payload)
+{
+    if(!shards){
+        return 0;
+    }
+
+    log_entry_t* entry = (log_entry_t*)malloc(sizeof(log_entry_t));
+
+    if(!entry){
+        printf("No memory for log entry\n");
+        return -ENOMEM;
+    }
+
+    entry->next = NULL;
+    entry->ts_ms = now_ms();
+
+    size_t room_len = strnlen(room_name, MAX_ROOMNAME_LEN-1);
+
+    entry->room_len = room_len;
+    memcpy(entry->room_name, room_name, room_len);
+
+    pthread_mutex_lock(&queue_lock);
+
+    if(queued >= LOG_MAX_QUEUED){
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&queue_lock);
+        free(entry);
+        return -ENOBUFS;
+    }
+
+    entry->payload = payload_get(payload);
+    mem_acct_add(MEM_LOG_QUEUE,
+                    sizeof(log_entry_t) + PAYLOAD_MEM(payload));
+
+    if(queue_tail){
+        queue_tail->next = entry;
+    } else {
+        queue_head = entry;
+    }
+    queue_tail = entry;
+    queued++;
+
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    // only a queued record counts as logged, a dropped one must not move
+    // the room's newest seq past what the log can give back
+    if(payload->seq){
+        log_shard_t* shard = shard_of(room_name, room_len);
+
+        pthread_mutex_lock(&shard->index_lock);
+        index_update(shard, room_name, room_len, payload->seq);
+        pthread_mutex_unlock(&shard->index_lock);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief number of records lost so far, appended while the queue was full or
+ *          not written because of an I/O error
+ *
+ */
+uint64_t room_log_dropped()
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief waits until everything appended so far is written and synced
+ *
+ */
+void room_log_sync()
+{
+    if(!shards){
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    while(queue_head || writer_busy){
+        pthread_cond_wait(&idle_cond, &queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static int buff_append(log_shard_t* shard, const void* data, size_t len)
+{
+    if(shard->buff_len + len > shard->buff_cap){
+
+        size_t cap = shard->buff_cap ? shard->buff_cap : 64*1024;
+        while(cap < shard->buff_len + len){
+            cap *= 2;
+        }
+
+        char* buff = (char*)realloc(shard->buff, cap);
+        if(!buff){
+            return -ENOMEM;
+        }
+        shard->buff = buff;
+        shard->buff_cap = cap;
+    }
+
+    memcpy(shard->buff + shard->buff_len, data, len);
+    shard->buff_len += len;
+
+    return 0;
+}
+
+static int add_record(log_entry_t* entry)
+{
+    log_shard_t* shard = shard_of(entry->room_name, entry->room_len);
+
+    log_record_t rec;
+    memset(&rec, 0, sizeof(log_record_t));
+    rec.len = entry->payload->len;
+    rec.room_len = entry->room_len;
+    rec.seq = entry->payload->seq;
+    rec.ts_ms = entry->ts_ms;
+
+    size_t old_len = shard->buff_len;
+
+    if(buff_append(shard, &rec, sizeof(log_record_t)) < 0 ||
+        buff_append(shard, entry->room_name, entry->room_len) < 0 ||
+        buff_append(shard, entry->payload->data, entry->payload->len) < 0){
+
+        shard->buff_len = old_len;
+        printf("No memory for log buffer\n");
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief starts a new segment for the shard, caller is the writer thread
+ *
+ * @return int 0 on success negative on error
+ */
+static int open_segment(int idx)
+{
+    log_shard_t* shard = &shards[idx];
+
+    log_segment_t* segment = (log_segment_t*)calloc(1, sizeof(log_segment_t));
+    if(!segment){
+        return -ENOMEM;
+    }
+
+    segment->index = shard->active ? shard->active->index + 1 : 0;
+    segment->mtime = time(NULL);
+
+    char path[LOG_PATH_LEN];
+    segment_path(path, idx, segment->index);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0){
+        perror("Error opening log segment");
+        free(segment);
+        return -errno;
+    }
+
+    if(shard->fd >= 0){
+        close(shard->fd);
+    }
+    shard->fd = fd;
+
+    pthread_mutex_lock(&shard->lock);
+    if(shard->active){
+        shard->active->next = segment;
+    } else {
+        shard->oldest = segment;
+    }
+    shard->active = segment;
+    pthread_mutex_unlock(&shard->lock);
+
+    return 0;
+}
+
+static void enforce_retention(int idx)
+{
+    log_shard_t* shard = &shards[idx];
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&shard->lock);
+
+    while(shard->oldest != shard->active){
+
+        log_segment_t* oldest = shard->oldest;
+
+        bool too_big = config.retain_bytes &&
+                        shard->total_bytes > config.retain_bytes;
+        bool too_old = config.retain_sec &&
+                        now - oldest->mtime > config.retain_sec;
+
+        if(!too_big && !too_old){
+            break;
+        }
+
+        char path[LOG_PATH_LEN];
+        segment_path(path, idx, oldest->index);
+
+        if(unlink(path) < 0){
+            perror("Error removing log segment");
+        }
+
+        shard->total_bytes -= oldest->size;
+        shard->oldest = oldest->next;
+        free(oldest);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief length of the whole records at the start of buff, and how many
+ *          there are
+ *
+ */
+static size_t whole_records(const char* buff, size_t len, long* count)
+{
+    size_t off = 0;
+    *count = 0;
+
+    while(off + sizeof(log_record_t) <= len){
+
+        log_record_t rec;
+        memcpy(&rec, buff + off, sizeof(log_record_t));
+
+        size_t rec_size = sizeof(log_record_t) + rec.room_len + rec.len;
+        if(rec_size > len - off){
+            break;
+        }
+
+        off += rec_size;
+        (*count)++;
+    }
+
+    return off;
+}
+
+/**
+ * @brief writes the batched records of a shard with one write and syncs them
+ *
+ * -> a failed write leaves no torn record behind, the segment is cut back to
+ *     the last whole record or, if that fails too, sealed. What was not
+ *     written is counted as dropped.
+ *
+ */
+static void flush_shard(int idx)
+{
+    log_shard_t* shard = &shards[idx];
+
+    if(shard->buff_len == 0){
+        return;
+    }
+
+    if(shard->active->size > 0 &&
+        shard->active->size + shard->buff_len > config.segment_bytes){
+        if(open_segment(idx) < 0){
+            printf("Error rolling log segment of shard %d\n", idx);
+        }
+    }
+
+    size_t off = 0;
+    while(off < shard->buff_len){
+
+        ssize_t n = write(shard->fd, shard->buff + off, shard->buff_len - off);
+
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("Error writing log segment");
+            break;
+        }
+        off += n;
+    }
+
+    bool torn = false;
+
+    if(off < shard->buff_len){
+
+        long written, total;
+        whole_records(shard->buff, shard->buff_len, &total);
+        size_t whole = whole_records(shard->buff, off, &written);
+
+        if(whole < off &&
+            ftruncate(shard->fd, shard->active->size + whole) < 0){
+            perror("Error cutting torn log record");
+            torn = true;
+        }
+
+        off = whole;
+        __atomic_add_fetch(&dropped, total - written, __ATOMIC_RELAXED);
+    }
+
+    if(fdatasync(shard->fd) < 0){
+        perror("Error syncing log segment");
+    }
+
+    for(size_t pos = 0; pos < off;){
+
+        log_record_t rec;
+        memcpy(&rec, shard->buff + pos, sizeof(log_record_t));
+
+        log_pos_t mark = {rec.seq, shard->active->index,
+                            shard->active->size + pos};
+
+        pthread_mutex_lock(&shard->index_lock);
+        index_mark(shard, shard->buff + pos + sizeof(log_record_t),
+                    rec.room_len, mark);
+        pthread_mutex_unlock(&shard->index_lock);
+
+        pos += sizeof(log_record_t) + rec.room_len + rec.len;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    shard->active->size += off;
+    shard->active->mtime = time(NULL);
+    shard->total_bytes += off;
+    pthread_mutex_unlock(&shard->lock);
+
+    shard->buff_len = 0;
+
+    // the torn tail stays at the end of a sealed segment, where readers stop
+    if(torn && open_segment(idx) < 0){
+        printf("Error rolling log segment of shard %d\n", idx);
+    }
+
+    enforce_retention(idx);
+}
+
+static void* log_writer(void* arg)
+{
+    (void)arg;
+
+    while(true){
+
+        pthread_mutex_lock(&queue_lock);
+        while(!queue_head){
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+
+        // take everything queued so far, it is one group commit
+        log_entry_t* batch = queue_head;
+        queue_head = queue_tail = NULL;
+        queued = 0;
+        writing = batch;
+        writer_busy = true;
+
+        pthread_mutex_unlock(&queue_lock);
+
+        for(log_entry_t* entry = batch; entry; entry = entry->next){
+            add_record(entry);
+        }
+
+        for(int i = 0; i < config.shards; i++){
+            flush_shard(i);
+        }
+
+        // readers find the batch on disk from now on
+        pthread_mutex_lock(&queue_lock);
+        writing = NULL;
+        writer_busy = false;
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&queue_lock);
+
+        while(batch){
+            log_entry_t* next = batch->next;
+
+            mem_acct_add(MEM_LOG_QUEUE, -(long)(sizeof(log_entry_t) +
+                                        PAYLOAD_MEM(batch->payload)));
+            payload_put(batch->payload);
+            free(batch);
+
+            batch = next;
+        }
+    }
+
+    return NULL;
+}
+
+static int cmp_segment(const void* a, const void* b)
+{
+    const log_segment_t* x = *(log_segment_t* const*)a;
+    const log_segment_t* y = *(log_segment_t* const*)b;
+
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * @brief picks up the segments left by a previous run, appends go to a fresh
+ *          segment after the newest one found
+ *
+ * @return int 0 on success negative on error
+ */
+static int load_segments()
+{
+    DIR* dir = opendir(config.dir);
+    if(!dir){
+        perror("Error opening log dir");
+        return -errno;
+    }
+
+    int found = 0, cap = 64;
+    log_segment_t** list = (log_segment_t**)malloc(cap*sizeof(log_segment_t*));
+    int* owner = (int*)malloc(cap*sizeof(int));
+
+    struct dirent* ent;
+    while(list && owner && (ent = readdir(dir)) != NULL){
+
+        int idx;
+        unsigned long long index;
+        char tail;
+        if(sscanf(ent->d_name, "shard%d-%llu.lo%c", &idx, &index, &tail) != 3
+            || tail != 'g' || idx < 0 || idx >= config.shards){
+            continue;
+        }
+
+        char path[LOG_PATH_LEN];
+        segment_path(path, idx, index);
+
+        struct stat st;
+        if(stat(path, &st) < 0){
+            continue;
+        }
+
+        // a run that never logged anything to this shard
+        if(st.st_size == 0){
+            unlink(path);
+            continue;
+        }
+
+        if(found == cap){
+            cap *= 2;
+            list = (log_segment_t**)realloc(list, cap*sizeof(log_segment_t*));
+            owner = (int*)realloc(owner, cap*sizeof(int));
+            if(!list || !owner){
+                break;
+            }
+        }
+
+        log_segment_t* segment = (log_segment_t*)calloc(1,
+                                                    sizeof(log_segment_t));
+        if(!segment){
+            break;
+        }
+        segment->index = index;
+        segment->size = st.st_size;
+        segment->mtime = st.st_mtime;
+
+        list[found] = segment;
+        owner[found] = idx;
+        found++;
+    }
+
+    closedir(dir);
+
+    if(!list || !owner){
+        free(list);
+        free(owner);
+        return -ENOMEM;
+    }
+
+    // sort per shard by index, shards are few so a pass per shard is fine
+    for(int i = 0; i < config.shards; i++){
+
+        int n = 0;
+        log_segment_t** mine = (log_segment_t**)malloc(
+                                    (found+1)*sizeof(log_segment_t*));
+        if(!mine){
+            break;
+        }
+
+        for(int j = 0; j < found; j++){
+            if(owner[j] == i){
+                mine[n++] = list[j];
+            }
+        }
+
+        qsort(mine, n, sizeof(log_segment_t*), cmp_segment);
+
+        for(int j = 0; j < n; j++){
+            mine[j]->next = (j+1 < n) ? mine[j+1] : NULL;
+            shards[i].total_bytes += mine[j]->size;
+        }
+
+        if(n > 0){
+            shards[i].oldest = mine[0];
+            shards[i].active = mine[n-1];
+        }
+
+        free(mine);
+    }
+
+    free(list);
+    free(owner);
+
+    return 0;
+}
+
+/**
+ * @brief gets every record a scan walks over, returns non zero to stop it
+ *
+ * @param name the room name, the payload follows it
+ */
+typedef int (*scan_fn)(const log_record_t* rec, const char* name,
+                        log_pos_t pos, void* arg);
+
+/**
+ * @brief walks one mapped segment from off on
+ *
+ * @return int non zero if fn stopped the scan
+ */
+static int scan_segment(const char* base, size_t size, uint64_t segment,
+                        size_t off, scan_fn fn, void* arg)
+{
+    while(off + sizeof(log_record_t) <= size){
+
+        log_record_t rec;
+        memcpy(&rec, base + off, sizeof(log_record_t));
+
+        size_t rec_size = sizeof(log_record_t) + rec.room_len + rec.len;
+
+        // the tail of the active segment may still be in flight
+        if(rec_size > size - off){
+            break;
+        }
+
+        log_pos_t pos = {rec.seq, segment, off};
+
+        if(fn(&rec, base + off + sizeof(log_record_t), pos, arg)){
+            return 1;
+        }
+
+        off += rec_size;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief maps the segments of a shard one by one and scans them, from the
+ *          segment and offset of from on
+ *
+ * @return int 0 on success negative on error
+ */
+static int scan_shard(int idx, log_pos_t from, scan_fn fn, void* arg)
+{
+    log_shard_t* shard = &shards[idx];
+
+    // copy the segment list so the writer is not held up by the scan
+    pthread_mutex_lock(&shard->lock);
+
+    int n = 0;
+    for(log_segment_t* seg = shard->oldest; seg; seg = seg->next){
+        n++;
+    }
+
+    uint64_t* indices = (uint64_t*)malloc((n+1)*sizeof(uint64_t));
+    if(!indices){
+        pthread_mutex_unlock(&shard->lock);
+        return -ENOMEM;
+    }
+
+    n = 0;
+    for(log_segment_t* seg = shard->oldest; seg; seg = seg->next){
+        if(seg->index >= from.segment){
+            indices[n++] = seg->index;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    for(int i = 0; i < n; i++){
+
+        char path[LOG_PATH_LEN];
+        segment_path(path, idx, indices[i]);
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0){
+            continue; // removed by retention in the meantime
+        }
+
+        struct stat st;
+        if(fstat(fd, &st) < 0 || st.st_size == 0){
+            close(fd);
+            continue;
+        }
+
+        char* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if(base == MAP_FAILED){
+            perror("Error mapping log segment");
+            continue;
+        }
+
+        size_t off = (indices[i] == from.segment) ? from.off : 0;
+        int stop = scan_segment(base, st.st_size, indices[i], off, fn, arg);
+
+        munmap(base, st.st_size);
+
+        if(stop){
+            break;
+        }
+    }
+
+    free(indices);
+
+    return 0;
+}
+
+static int index_record(const log_record_t* rec, const char* name,
+                        log_pos_t pos, void* arg)
+{
+    log_shard_t* shard = (log_shard_t*)arg;
+
+    if(rec->seq){
+        index_update(shard, name, rec->room_len, rec->seq);
+        index_mark(shard, name, rec->room_len, pos);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief fills the sequence index of a shard from its segments
+ *
+ */
+static void build_index(int idx)
+{
+    pthread_mutex_lock(&shards[idx].index_lock);
+    log_pos_t from = {0, 0, 0};
+    scan_shard(idx, from, index_record, &shards[idx]);
+    pthread_mutex_unlock(&shards[idx].index_lock);
+}
+
+typedef struct LogRead{
+    const char* room_name;
+    size_t room_len;
+    uint64_t after_seq;     // newest visited so far
+    uint64_t before_seq;
+    log_pos_t last;         // where the next scan starts
+    bool done;              // reached before_seq
+    log_visit_fn visit;
+    void* arg;
+}log_read_t;
+
+static int read_record(const log_record_t* rec, const char* name,
+                        log_pos_t pos, void* arg)
+{
+    log_read_t* read = (log_read_t*)arg;
+
+    if(rec->room_len != read->room_len ||
+        memcmp(name, read->room_name, read->room_len) != 0 ||
+        rec->seq <= read->after_seq){
+        return 0;
+    }
+
+    if(rec->seq >= read->before_seq){
+        read->done = true;
+        return 1;
+    }
+
+    read->visit(rec, name + rec->room_len, read->arg);
+    read->after_seq = rec->seq;
+    read->last = pos;
+
+    return 0;
+}
+
+typedef struct PendingRecord{
+    payload_t* payload;
+    int64_t ts_ms;
+}pending_record_t;
+
+/**
+ * @brief references to the records of the room not on disk yet, oldest
+ *          first
+ *
+ * @return pending_record_t* NULL if out of memory
+ */
+static pending_record_t* pending_records(const char* room_name,
+                                            size_t room_len, int* num)
+{
+    pthread_mutex_lock(&queue_lock);
+
+    log_entry_t* lists[2] = {writing, queue_head};
+    int n = 0;
+
+    for(int i = 0; i < 2; i++){
+        for(log_entry_t* entry = lists[i]; entry; entry = entry->next){
+            n += (entry->room_len == room_len &&
+                    memcmp(entry->room_name, room_name, room_len) == 0);
+        }
+    }
+
+    pending_record_t* pending = (pending_record_t*)malloc(
+                                    (n+1)*sizeof(pending_record_t));
+
+    n = 0;
+    for(int i = 0; i < 2 && pending; i++){
+        for(log_entry_t* entry = lists[i]; entry; entry = entry->next){
+            if(entry->room_len == room_len &&
+                memcmp(entry->room_name, room_name, room_len) == 0){
+                pending[n].payload = payload_get(entry->payload);
+                pending[n].ts_ms = entry->ts_ms;
+                n++;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&queue_lock);
+
+    *num = n;
+    return pending;
+}
+
+/**
+ * @brief calls visit for every logged message of the room numbered after
+ *          after_seq and before before_seq, oldest first
+ *
+ * -> called with room->lock held, no message of the room is appended
+ *     meanwhile
+ * -> reading starts at the mark of the room just before after_seq and stops
+ *     at before_seq. If before_seq is not on disk yet the rest comes from
+ *     the records the writer has not written, taken before a second scan:
+ *     a record leaving them is on disk by then.
+ *
+ * @param room_name
+ * @param visit called with the record header and the payload bytes, which
+ *              are only valid during the call
+ * @param arg passed through to visit
+ * @return int 0 on success negative on error
+ */
+int room_log_read(const char* room_name, uint64_t after_seq,
+                    uint64_t before_seq, log_visit_fn visit, void* arg)
+{
+    if(!shards){
+        return -ENODEV;
+    }
+
+    size_t room_len = strnlen(room_name, MAX_ROOMNAME_LEN-1);
+    log_shard_t* shard = shard_of(room_name, room_len);
+    int idx = shard - shards;
+
+    log_read_t read = {
+        .room_name = room_name,
+        .room_len = room_len,
+        .after_seq = after_seq,
+        .before_seq = before_seq,
+        .last = index_find(shard, room_name, room_len, after_seq),
+        .done = false,
+        .visit = visit,
+        .arg = arg,
+    };
+
+    int err;
+    if((err = scan_shard(idx, read.last, read_record, &read)) < 0 ||
+        read.done){
+        return err;
+    }
+
+    int num_pending;
+    pending_record_t* pending = pending_records(room_name, room_len,
+                                                &num_pending);
+    if(!pending){
+        return -ENOMEM;
+    }
+
+    err = scan_shard(idx, read.last, read_record, &read);
+
+    for(int i = 0; i < num_pending; i++){
+
+        payload_t* payload = pending[i].payload;
+
+        if(err == 0 && !read.done && payload->seq > read.after_seq){
+
+            if(payload->seq >= before_seq){
+                read.done = true;
+            } else {
+                log_record_t rec;
+                memset(&rec, 0, sizeof(log_record_t));
+                rec.len = payload->len;
+                rec.room_len = room_len;
+                rec.seq = payload->seq;
+                rec.ts_ms = pending[i].ts_ms;
+
+                visit(&rec, payload->data, arg);
+                read.after_seq = payload->seq;
+            }
+        }
+
+        payload_put(payload);
+    }
+
+    free(pending);
+
+    return err;
+}
+
+/**
+ * @brief opens the log and starts the writer thread
+ *
+ * @param log_config
+ * @return int 0 on success negative on error
+ */
+int room_log_init(const log_config_t* log_config)
+{
+    if(!log_config->dir || log_config->shards <= 0 ||
+        log_config->segment_bytes == 0){
+        return -EINVAL;
+    }
+
+    config = *log_config;
+
+    if(mkdir(config.dir, 0755) < 0 && errno != EEXIST){
+        perror("Error creating log dir");
+        return -errno;
+    }
+
+    shards = (log_shard_t*)calloc(config.shards, sizeof(log_shard_t));
+    if(!shards){
+        return -ENOMEM;
+    }
+
+    for(int i = 0; i < config.shards; i++){
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_mutex_init(&shards[i].index_lock, NULL);
+        shards[i].fd = -1;
+    }
+
+    int err;
+    if((err = load_segments()) < 0){
+        return err;
+    }
+
+    for(int i = 0; i < config.shards; i++){
+        if((err = open_segment(i)) < 0){
+            return err;
+        }
+        enforce_retention(i);
+        build_index(i);
+    }
+
+    pthread_t thread;
+    if((err = pthread_create(&thread, NULL, log_writer, NULL)) != 0){
+        printf("Error creating log writer : %s\n", strerror(err));
+        return -err;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef __ROOM_LOG_H
+#define __ROOM_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "payload.h"
+
+/**
+ * @brief on disk header of one log record, followed by the room name and
+ *          the payload bytes
+ *
+ */
+typedef struct LogRecord{
+    uint32_t len;           // payload bytes
+    uint16_t room_len;
+    uint16_t flags;
+    uint64_t seq;           // sequence number of the message in its room
+    int64_t ts_ms;          // wall clock time the message was logged
+}log_record_t;
+
+/**
+ * @brief options of the log, dir NULL keeps logging disabled
+ *
+ */
+typedef struct LogConfig{
+    const char* dir;
+    int shards;
+    size_t segment_bytes;
+    size_t retain_bytes;    // per shard, 0 keeps everything
+    int retain_sec;         // 0 keeps everything
+}log_config_t;
+
+typedef void (*log_visit_fn)(const log_record_t* rec, const char* data,
+                                void* arg);
+
+int room_log_init(const log_config_t* log_config);
+bool room_log_enabled();
+int room_log_append(const char* room_name, payload_t* payload);
+int room_log_read(const char* room_name, uint64_t after_seq,
+                    uint64_t before_seq, log_visit_fn visit, void* arg);
+uint64_t room_log_last_seq(const char* room_name);
+void room_log_sync();
+uint64_t room_log_dropped();
+
+#endif
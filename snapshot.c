@@ -0,0 +1,284 @@
+/**
+ * @file snapshot.c
+ * @brief saves the room directory on shutdown and loads it on start
+ *
+ * -> A snapshot holds every room with its sequence counter and history ring,
+ *     written in trie order so names come out sorted.
+ * -> Loading maps the file and inserts the sorted names through one trie
+ *     cursor, each trie node is created once and no room is looked up.
+ * -> Members are not part of the snapshot, clients still reconnect, but with
+ *     JOIN <room> <user> <seq> they pick up exactly where they were.
+ *
+ * Layout (host byte order, the file is only meant for the same host):
+ *   snap_header_t
+ *   per room: snap_room_t, room name, then per message snap_msg_t + bytes
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "utils.h"
+#include "payload.h"
+#include "history.h"
+#include "room_log.h"
+
+#define SNAP_MAGIC "CHATSNP2"
+#define SNAP_PATH_LEN (4096)
+#define SNAP_WRITE_BUFF (1<<20)
+
+typedef struct SnapHeader{
+    char magic[8];
+    uint64_t num_rooms;
+}snap_header_t;
+
+typedef struct SnapRoom{
+    uint16_t name_len;
+    uint16_t pad;
+    uint32_t num_msgs;          // --history-msgs has no upper bound
+    uint64_t last_seq;
+}snap_room_t;
+
+typedef struct SnapMsg{
+    uint64_t seq;
+    uint32_t len;
+    uint32_t pad;
+}snap_msg_t;
+
+typedef struct SnapWriter{
+    FILE* fp;
+    uint64_t num_rooms;
+}snap_writer_t;
+
+static int write_room(chat_room_t* room, void* arg)
+{
+    snap_writer_t* writer = (snap_writer_t*)arg;
+
+    pthread_mutex_lock(&room->lock);
+
+    snap_room_t rec;
+    memset(&rec, 0, sizeof(snap_room_t));
+    rec.name_len = strnlen(room->room_name, MAX_ROOMNAME_LEN-1);
+    rec.num_msgs = room->history_count;
+    rec.last_seq = room->last_seq;
+
+    fwrite(&rec, sizeof(snap_room_t), 1, writer->fp);
+    fwrite(room->room_name, 1, rec.name_len, writer->fp);
+
+    for(int i = 0; i < room->history_count; i++){
+
+        payload_t* payload = history_at(room, i);
+
+        snap_msg_t msg;
+        memset(&msg, 0, sizeof(snap_msg_t));
+        msg.seq = payload->seq;
+        msg.len = payload->len;
+
+        fwrite(&msg, sizeof(snap_msg_t), 1, writer->fp);
+        fwrite(payload->data, 1, payload->len, writer->fp);
+    }
+
+    pthread_mutex_unlock(&room->lock);
+
+    writer->num_rooms++;
+
+    return ferror(writer->fp) ? -EIO : 0;
+}
+
+/**
+ * @brief writes every room to path, atomically replacing an older snapshot
+ *
+ * -> caller holds trie_lock, each room is locked while it is written
+ *
+ * @param path
+ * @return int 0 on success negative on error
+ */
+int snapshot_write(const char* path)
+{
+    char tmp_path[SNAP_PATH_LEN];
+    snprintf(tmp_path, SNAP_PATH_LEN, "%s.tmp", path);
+
+    snap_writer_t writer;
+    writer.num_rooms = 0;
+
+    if(!(writer.fp = fopen(tmp_path, "w"))){
+        perror("Error creating snapshot");
+        return -errno;
+    }
+
+    setvbuf(writer.fp, NULL, _IOFBF, SNAP_WRITE_BUFF);
+
+    // room count is patched in once known
+    snap_header_t header;
+    memset(&header, 0, sizeof(snap_header_t));
+    memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(snap_header_t), 1, writer.fp);
+
+    int err = walk_rooms(write_room, &writer);
+
+    header.num_rooms = writer.num_rooms;
+
+    if(err == 0 && (fseek(writer.fp, 0, SEEK_SET) < 0 ||
+        fwrite(&header, sizeof(snap_header_t), 1, writer.fp) != 1 ||
+        fflush(writer.fp) != 0 || fsync(fileno(writer.fp)) < 0)){
+        err = -EIO;
+    }
+
+    if(fclose(writer.fp) != 0 && err == 0){
+        err = -EIO;
+    }
+
+    if(err == 0 && rename(tmp_path, path) < 0){
+        err = -errno;
+    }
+
+    if(err < 0){
+        printf("Error writing snapshot %s\n", path);
+        unlink(tmp_path);
+        return err;
+    }
+
+    printf("Snapshot of %llu rooms written to %s\n",
+            (unsigned long long)writer.num_rooms, path);
+
+    return 0;
+}
+
+static int load_room(const char* base, size_t size, size_t* off,
+                        trie_cursor_t* cursor)
+{
+    snap_room_t rec;
+    char room_name[MAX_ROOMNAME_LEN];
+
+    if(*off + sizeof(snap_room_t) > size){
+        return -EINVAL;
+    }
+    memcpy(&rec, base + *off, sizeof(snap_room_t));
+    *off += sizeof(snap_room_t);
+
+    if(rec.name_len == 0 || rec.name_len >= MAX_ROOMNAME_LEN ||
+        *off + rec.name_len > size){
+        return -EINVAL;
+    }
+    memcpy(room_name, base + *off, rec.name_len);
+    room_name[rec.name_len] = '\0';
+    *off += rec.name_len;
+
+    chat_room_t* room = create_room_sorted(cursor, room_name);
+    if(!room){
+        return -ENOMEM;
+    }
+
+    // messages logged after the snapshot was taken keep their numbers
+    uint64_t logged_seq = room_log_last_seq(room_name);
+    room->last_seq = rec.last_seq > logged_seq ? rec.last_seq : logged_seq;
+
+    for(uint32_t i = 0; i < rec.num_msgs; i++){
+
+        snap_msg_t msg;
+
+        if(*off + sizeof(snap_msg_t) > size){
+            return -EINVAL;
+        }
+        memcpy(&msg, base + *off, sizeof(snap_msg_t));
+        *off += sizeof(snap_msg_t);
+
+        if(msg.len > size - *off){
+            return -EINVAL;
+        }
+
+        payload_t* payload = payload_create(base + *off, msg.len);
+        *off += msg.len;
+
+        if(!payload){
+            return -ENOMEM;
+        }
+
+        payload_set_seq(payload, msg.seq);
+        history_push(room, payload);
+        payload_put(payload);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief restores the rooms saved by snapshot_write
+ *
+ * -> called before connections are accepted, a missing file is not an error
+ *
+ * @param path
+ * @return int number of rooms restored or negative on error
+ */
+int snapshot_load(const char* path)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return errno == ENOENT ? 0 : -errno;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_header_t)){
+        close(fd);
+        printf("Snapshot %s is too short\n", path);
+        return -EINVAL;
+    }
+
+    char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(base == MAP_FAILED){
+        perror("Error mapping snapshot");
+        return -errno;
+    }
+
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    snap_header_t header;
+    memcpy(&header, base, sizeof(snap_header_t));
+
+    if(memcmp(header.magic, SNAP_MAGIC, sizeof(header.magic)) != 0){
+        munmap(base, st.st_size);
+        printf("%s is not a snapshot\n", path);
+        return -EINVAL;
+    }
+
+    trie_cursor_t cursor;
+    trie_cursor_init(&cursor);
+
+    size_t off = sizeof(snap_header_t);
+    uint64_t loaded = 0;
+    int err = 0;
+
+    while(loaded < header.num_rooms &&
+            (err = load_room(base, st.st_size, &off, &cursor)) == 0){
+        loaded++;
+    }
+
+    munmap(base, st.st_size);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ms = (end.tv_sec - start.tv_sec)*1000 +
+                (end.tv_nsec - start.tv_nsec)/1000000;
+
+    if(err < 0){
+        printf("Snapshot %s is damaged after %llu rooms\n", path,
+                (unsigned long long)loaded);
+    }
+
+    printf("Restored %llu rooms from %s in %ld ms\n",
+            (unsigned long long)loaded, path, ms);
+
+    return (int)loaded;
+}
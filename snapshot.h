@@ -0,0 +1,7 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+int snapshot_write(const char* path);
+int snapshot_load(const char* path);
+
+#endif
@@ -0,0 +1,235 @@
+/**
+ * @file timer_wheel.c
+ * @brief hierarchical timing wheel, runs every timer of the server from one
+ *          thread
+ *
+ * -> WHEEL_LEVELS wheels of WHEEL_SLOTS slots each. Level 0 slots are one
+ *     tick wide, level n slots cover WHEEL_SLOTS^n ticks. A timer sits in
+ *     the lowest level its expiry fits in.
+ * -> Every tick the current level 0 slot expires. Whenever a level wraps the
+ *     next slot of the level above is cascaded down, so a timer moves at most
+ *     WHEEL_LEVELS times before it fires.
+ * -> With 100ms ticks the wheel covers about 19 days, longer timers are
+ *     clamped to that.
+ * -> Callbacks run on the wheel thread without the wheel lock, so they may
+ *     re-arm their timer. timer_del waits for a running callback of that
+ *     timer, after it returns the callback will not run again.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timer_wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_MAX_TICKS ((1ULL << (WHEEL_LEVELS*WHEEL_SLOT_BITS)) - 1)
+
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_cond = PTHREAD_COND_INITIALIZER;
+static timer_node_t* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t now_tick;
+static int tick_len_ms;
+static timer_node_t* running;
+
+int64_t timer_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static void link_timer(timer_node_t* timer)
+{
+    // never in a slot that was already expired this round
+    if(timer->expires <= now_tick){
+        timer->expires = now_tick + 1;
+    }
+
+    uint64_t delta = timer->expires - now_tick;
+    if(delta > WHEEL_MAX_TICKS){
+        timer->expires = now_tick + WHEEL_MAX_TICKS;
+        delta = WHEEL_MAX_TICKS;
+    }
+
+    int level = 0;
+    while(level < WHEEL_LEVELS-1 &&
+            delta >= (1ULL << ((level+1)*WHEEL_SLOT_BITS))){
+        level++;
+    }
+
+    int slot = (timer->expires >> (level*WHEEL_SLOT_BITS)) & WHEEL_MASK;
+    timer_node_t** head = &wheel[level][slot];
+
+    timer->prev = NULL;
+    timer->next = *head;
+    if(*head){
+        (*head)->prev = timer;
+    }
+    *head = timer;
+    timer->slot = head;
+    timer->armed = true;
+}
+
+static void unlink_timer(timer_node_t* timer)
+{
+    if(timer->prev){
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+
+    if(timer->next){
+        timer->next->prev = timer->prev;
+    }
+
+    timer->next = timer->prev = NULL;
+    timer->slot = NULL;
+    timer->armed = false;
+}
+
+/**
+ * @brief (re)arms timer to call fn after delay_ms
+ *
+ * @param timer
+ * @param delay_ms
+ * @param fn
+ */
+void timer_add(timer_node_t* timer, int64_t delay_ms, timer_fn fn)
+{
+    pthread_mutex_lock(&wheel_lock);
+
+    if(timer->armed){
+        unlink_timer(timer);
+    }
+
+    timer->fn = fn;
+    timer->expires = now_tick + (delay_ms + tick_len_ms - 1) / tick_len_ms;
+    link_timer(timer);
+
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/**
+ * @brief cancels timer, waits if its callback is running right now
+ *
+ * @param timer
+ */
+void timer_del(timer_node_t* timer)
+{
+    pthread_mutex_lock(&wheel_lock);
+
+    while(running == timer){
+        pthread_cond_wait(&wheel_cond, &wheel_lock);
+    }
+
+    if(timer->armed){
+        unlink_timer(timer);
+    }
+
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+static void cascade(int level, int slot)
+{
+    timer_node_t* timer = wheel[level][slot];
+    wheel[level][slot] = NULL;
+
+    while(timer){
+        timer_node_t* next = timer->next;
+        link_timer(timer);
+        timer = next;
+    }
+}
+
+/**
+ * @brief advances the wheel by one tick and fires what expired
+ *
+ */
+static void tick()
+{
+    pthread_mutex_lock(&wheel_lock);
+
+    now_tick++;
+
+    for(int level = 1; level < WHEEL_LEVELS; level++){
+        if(now_tick & ((1ULL << (level*WHEEL_SLOT_BITS)) - 1)){
+            break;
+        }
+        cascade(level, (now_tick >> (level*WHEEL_SLOT_BITS)) & WHEEL_MASK);
+    }
+
+    timer_node_t** head = &wheel[0][now_tick & WHEEL_MASK];
+
+    while(*head){
+        timer_node_t* timer = *head;
+        unlink_timer(timer);
+
+        running = timer;
+        pthread_mutex_unlock(&wheel_lock);
+
+        timer->fn(timer);
+
+        pthread_mutex_lock(&wheel_lock);
+        running = NULL;
+        pthread_cond_broadcast(&wheel_cond);
+    }
+
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+static void* wheel_thread(void* arg)
+{
+    (void)arg;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while(true){
+
+        next.tv_nsec += (long)tick_len_ms * 1000000L;
+        while(next.tv_nsec >= 1000000000L){
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+
+        // absolute deadlines, a slow tick is caught up instead of drifting
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+                == EINTR){
+        }
+
+        tick();
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief starts the wheel thread
+ *
+ * @param tick_ms resolution of every timer
+ * @return int 0 on success negative on error
+ */
+int timer_wheel_init(int tick_ms)
+{
+    if(tick_ms <= 0){
+        return -EINVAL;
+    }
+
+    tick_len_ms = tick_ms;
+
+    pthread_t thread;
+    int err;
+    if((err = pthread_create(&thread, NULL, wheel_thread, NULL)) != 0){
+        printf("Error creating timer wheel : %s\n", strerror(err));
+        return -err;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
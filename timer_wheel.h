@@ -0,0 +1,33 @@
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WHEEL_LEVELS (4)
+#define WHEEL_SLOT_BITS (6)
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+struct TimerNode;
+typedef void (*timer_fn)(struct TimerNode* timer);
+
+/**
+ * @brief a timer, embedded in whatever it times out. Arming, re-arming and
+ *          cancelling are O(1).
+ *
+ */
+typedef struct TimerNode{
+    struct TimerNode* next;
+    struct TimerNode* prev;
+    struct TimerNode** slot;    // list head of the slot the timer is in
+    uint64_t expires;       // in wheel ticks
+    timer_fn fn;
+    bool armed;
+}timer_node_t;
+
+int timer_wheel_init(int tick_ms);
+int64_t timer_now_ms();
+void timer_add(timer_node_t* timer, int64_t delay_ms, timer_fn fn);
+void timer_del(timer_node_t* timer);
+
+#endif
@@ -0,0 +1,790 @@
+/**
+ * @file upgrade.c
+ * @brief hands the listening socket and every live connection to a new
+ *          server binary, clients never notice the upgrade
+ *
+ * -> A running server with --upgrade-socket=PATH waits for its successor on
+ *     the unix socket PATH. A new server started with the same option first
+ *     connects to PATH, and if somebody answers it takes over from them.
+ * -> Old process:
+ *      1. stops the accept loop and parks every connection thread. Threads
+ *          are only parked in their read, never holding a lock, SIGUSR2 is
+ *          used to kick them out of a blocking read.
+ *      2. flushes the message log and saves the rooms to PATH.snap
+ *      3. sends the listening fd and each connection fd with its user, rooms
+ *          and unhandled input over SCM_RIGHTS, then exits on the ACK.
+ *     If anything fails before the ACK the threads are unparked and the old
+ *     process carries on as if nothing happened.
+ * -> New process loads PATH.snap, rejoins every connection to its rooms
+ *     without announcing it and serves it from where the old one stopped.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "upgrade.h"
+#include "utils.h"
+#include "room_log.h"
+#include "intern.h"
+
+#define HANDOFF_HELLO (1)
+#define HANDOFF_CONN (2)
+#define HANDOFF_END (3)
+#define HANDOFF_ACK (4)
+
+#define UPGRADE_PATH_LEN (108)
+// how long threads get to reach their read before the upgrade is abandoned
+#define PARK_TIMEOUT_MS (5000)
+#define PARK_POLL_MS (20)
+#define ACK_TIMEOUT_SEC (30)
+
+// flags of a handed over connection
+#define HANDOFF_JOINED (1)
+#define HANDOFF_TAGGED (2)
+// set in the length of a watched prefix, names are shorter than this
+#define HANDOFF_WATCH (0x80)
+// set in the length of a room whose roster the connection follows
+#define HANDOFF_ROSTER (0x40)
+
+/**
+ * @brief one handoff message, followed by user name, room names and pending
+ *          input. The connection fd rides along as ancillary data.
+ *
+ * -> room_len bytes of room names, num_rooms times <u8 len><name>. Watched
+ *     prefixes come after the rooms, with HANDOFF_WATCH set in their len.
+ *     Rooms whose roster it follows have HANDOFF_ROSTER set.
+ *     A server from before connections could be in several rooms sends
+ *     num_rooms 0 and just the one name.
+ *
+ */
+typedef struct HandoffMsg{
+    uint32_t type;
+    uint8_t flags;
+    uint8_t wants_seq;
+    uint16_t user_len;
+    uint16_t room_len;
+    uint8_t binary;
+    uint8_t num_rooms;
+    uint32_t pending_len;
+    uint64_t resume_seq;
+}handoff_msg_t;
+
+#define HANDOFF_BUFF_LEN (sizeof(handoff_msg_t) + MAX_USERNAME_LEN + \
+                            (MAX_CONN_ROOMS + MAX_CONN_WATCHES)* \
+                            MAX_ROOMNAME_LEN + MAX_BUFF_LEN)
+
+static char upgrade_path[UPGRADE_PATH_LEN];
+static int upgrade_listenfd = -1;
+static pthread_t main_thread;
+static save_rooms_fn save_rooms_cb;
+
+static volatile bool upgrading;
+static bool main_parked;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+
+static void on_upgrade_signal(int sig)
+{
+    // only there to make blocking calls return EINTR
+    (void)sig;
+}
+
+bool upgrade_in_progress()
+{
+    return upgrading;
+}
+
+/**
+ * @brief stops a connection thread until the upgrade is over, called from
+ *          the read loop with no locks held
+ *
+ * -> returns only if the upgrade was abandoned, after a successful one the
+ *     process exits while the thread is parked
+ *
+ * @param user_info
+ * -> whatever sits in the receive buffer of the connection is handed over
+ *     with it
+ *
+ * @param user_info
+ */
+void upgrade_park(user_t* user_info)
+{
+    pthread_mutex_lock(&park_lock);
+
+    user_info->parked = true;
+    pthread_cond_broadcast(&park_cond);
+
+    while(upgrading){
+        pthread_cond_wait(&park_cond, &park_lock);
+    }
+
+    user_info->parked = false;
+
+    pthread_mutex_unlock(&park_lock);
+}
+
+/**
+ * @brief parks the accept loop, @see upgrade_park
+ *
+ */
+void upgrade_park_main()
+{
+    pthread_mutex_lock(&park_lock);
+
+    main_parked = true;
+    pthread_cond_broadcast(&park_cond);
+
+    while(upgrading){
+        pthread_cond_wait(&park_cond, &park_lock);
+    }
+
+    main_parked = false;
+
+    pthread_mutex_unlock(&park_lock);
+}
+
+static void kick_unparked(user_t* user_info, void* arg)
+{
+    int* unparked = (int*)arg;
+
+    if(!user_info->parked){
+        (*unparked)++;
+        // not started yet if thread is unset, it checks the flag first thing
+        if(user_info->thread){
+            pthread_kill(user_info->thread, SIGUSR2);
+        }
+    }
+}
+
+/**
+ * @brief stops the accept loop and every connection thread
+ *
+ * @return int 0 once everything is parked, negative on timeout
+ */
+static int park_all()
+{
+    struct timespec poll_time = {0, PARK_POLL_MS*1000000L};
+
+    upgrading = true;
+
+    for(int waited = 0; waited < PARK_TIMEOUT_MS; waited += PARK_POLL_MS){
+
+        pthread_mutex_lock(&park_lock);
+        bool main_done = main_parked;
+        pthread_mutex_unlock(&park_lock);
+
+        if(!main_done){
+            pthread_kill(main_thread, SIGUSR2);
+            nanosleep(&poll_time, NULL);
+            continue;
+        }
+
+        int unparked = 0;
+
+        pthread_mutex_lock(&park_lock);
+        conn_for_each(kick_unparked, &unparked);
+        pthread_mutex_unlock(&park_lock);
+
+        if(unparked == 0){
+            return 0;
+        }
+
+        nanosleep(&poll_time, NULL);
+    }
+
+    printf("Upgrade: threads did not stop in time\n");
+
+    return -ETIMEDOUT;
+}
+
+static void unpark_all()
+{
+    pthread_mutex_lock(&park_lock);
+    upgrading = false;
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_lock);
+}
+
+static int send_msg(int sock, const void* buff, size_t len, int fd)
+{
+    struct iovec iov;
+    iov.iov_base = (void*)buff;
+    iov.iov_len = len;
+
+    union{
+        char buff[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    }control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(fd >= 0){
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buff;
+        msg.msg_controllen = sizeof(control.buff);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if(sendmsg(sock, &msg, 0) < 0){
+        perror("Upgrade: error sending handoff");
+        return -errno;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief receives one handoff message
+ *
+ * @param fd set to the fd passed along, -1 if there was none
+ * @return ssize_t length of the message or negative on error
+ */
+static ssize_t recv_msg(int sock, void* buff, size_t len, int* fd)
+{
+    struct iovec iov;
+    iov.iov_base = buff;
+    iov.iov_len = len;
+
+    union{
+        char buff[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    }control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buff;
+    msg.msg_controllen = sizeof(control.buff);
+
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+    if(n < 0){
+        perror("Upgrade: error receiving handoff");
+        return -errno;
+    }
+
+    if(n < (ssize_t)sizeof(handoff_msg_t)){
+        return -EPROTO;
+    }
+
+    *fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return n;
+}
+
+typedef struct HandoffCtx{
+    int sock;
+    char* buff;
+    int sent;
+    int err;
+}handoff_ctx_t;
+
+static void send_conn(user_t* user_info, void* arg)
+{
+    handoff_ctx_t* ctx = (handoff_ctx_t*)arg;
+
+    if(ctx->err){
+        return;
+    }
+
+    handoff_msg_t* msg = (handoff_msg_t*)ctx->buff;
+    memset(msg, 0, sizeof(handoff_msg_t));
+    msg->type = HANDOFF_CONN;
+    msg->flags = (user_info->num_rooms > 0 ? HANDOFF_JOINED : 0) |
+                    (user_info->tagged ? HANDOFF_TAGGED : 0);
+    msg->wants_seq = user_info->wants_seq;
+    msg->binary = user_info->binary;
+    msg->resume_seq = user_info->resume_seq;
+
+    char* pos = ctx->buff + sizeof(handoff_msg_t);
+
+    if(msg->flags & HANDOFF_JOINED){
+        msg->user_len = user_info->user_name_len;
+        msg->num_rooms = user_info->num_rooms + user_info->num_watches;
+
+        // the resumed client continues after the newest message of its room
+        msg->resume_seq = user_info->rooms[0]->last_seq;
+
+        memcpy(pos, user_info->user_name, msg->user_len);
+        pos += msg->user_len;
+
+        char* names = pos;
+        for(int i = 0; i < user_info->num_rooms; i++){
+            chat_room_t* room = user_info->rooms[i];
+            size_t len = strlen(room->room_name);
+
+            pthread_mutex_lock(&room->lock);
+            bool live = room_roster_is_live(room, user_info->connfd);
+            pthread_mutex_unlock(&room->lock);
+
+            *pos++ = len | (live ? HANDOFF_ROSTER : 0);
+            memcpy(pos, user_info->rooms[i]->room_name, len);
+            pos += len;
+        }
+        for(int i = 0; i < user_info->num_watches; i++){
+            size_t len = strlen(user_info->watches[i]);
+            *pos++ = len | HANDOFF_WATCH;
+            memcpy(pos, user_info->watches[i], len);
+            pos += len;
+        }
+        msg->room_len = pos - names;
+    }
+
+    if(user_info->rx_len < MAX_BUFF_LEN){
+        msg->pending_len = user_info->rx_len;
+        memcpy(pos, user_info->rx, user_info->rx_len);
+        pos += user_info->rx_len;
+    }
+
+    if((ctx->err = send_msg(ctx->sock, ctx->buff, pos - ctx->buff,
+                            user_info->connfd)) == 0){
+        ctx->sent++;
+    }
+}
+
+/**
+ * @brief the whole handoff to the process connected on sock
+ *
+ * @return int only returns when the upgrade failed
+ */
+static int handoff(int sock)
+{
+    int err;
+    char snap_path[UPGRADE_PATH_LEN + 8];
+    snprintf(snap_path, sizeof(snap_path), "%s.snap", upgrade_path);
+
+    printf("Upgrade: new process connected, handing over\n");
+
+    if((err = park_all()) < 0){
+        unpark_all();
+        return err;
+    }
+
+    room_log_sync();
+
+    if((err = save_rooms_cb(snap_path)) < 0){
+        unpark_all();
+        return err;
+    }
+
+    handoff_ctx_t ctx;
+    ctx.sock = sock;
+    ctx.sent = 0;
+    ctx.err = 0;
+
+    if(!(ctx.buff = (char*)malloc(HANDOFF_BUFF_LEN))){
+        unpark_all();
+        return -ENOMEM;
+    }
+
+    handoff_msg_t* msg = (handoff_msg_t*)ctx.buff;
+    memset(msg, 0, sizeof(handoff_msg_t));
+    msg->type = HANDOFF_HELLO;
+
+    if((ctx.err = send_msg(sock, msg, sizeof(handoff_msg_t),
+                            upgrade_listenfd)) == 0){
+        conn_for_each(send_conn, &ctx);
+    }
+
+    if(ctx.err == 0){
+        memset(msg, 0, sizeof(handoff_msg_t));
+        msg->type = HANDOFF_END;
+        ctx.err = send_msg(sock, msg, sizeof(handoff_msg_t), -1);
+    }
+
+    int fd = -1;
+    if(ctx.err == 0 && recv_msg(sock, ctx.buff, HANDOFF_BUFF_LEN, &fd) > 0 &&
+        msg->type == HANDOFF_ACK){
+
+        printf("Upgrade: %d connections handed over, exiting\n", ctx.sent);
+        fflush(stdout);
+        // the sockets live on in the new process, nothing may be closed
+        _exit(0);
+    }
+
+    printf("Upgrade: handoff failed, carrying on\n");
+    if(fd >= 0){
+        close(fd);
+    }
+    free(ctx.buff);
+    unlink(snap_path);
+    unpark_all();
+
+    return ctx.err ? ctx.err : -EPROTO;
+}
+
+static void* upgrade_server(void* arg)
+{
+    int sock = (int)(intptr_t)arg;
+
+    while(true){
+
+        int peer = accept(sock, NULL, NULL);
+
+        if(peer < 0){
+            if(errno != EINTR){
+                perror("Upgrade: error in accept");
+            }
+            continue;
+        }
+
+        struct timeval timeout = {ACK_TIMEOUT_SEC, 0};
+        setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        handoff(peer);
+        close(peer);
+    }
+
+    return NULL;
+}
+
+static int make_addr(struct sockaddr_un* addr, const char* path)
+{
+    if(strlen(path) >= sizeof(addr->sun_path)){
+        return -ENAMETOOLONG;
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+/**
+ * @brief waits on path for a successor to hand the server over to
+ *
+ * -> must be called from the thread running the accept loop
+ *
+ * @param path unix socket path
+ * @param listenfd listening socket of the server
+ * @param save_rooms writes the rooms for the successor
+ * @return int 0 on success negative on error
+ */
+int upgrade_listen(const char* path, int listenfd, save_rooms_fn save_rooms)
+{
+    struct sockaddr_un addr;
+    int err;
+
+    if((err = make_addr(&addr, path)) < 0){
+        return err;
+    }
+
+    strcpy(upgrade_path, path);
+    upgrade_listenfd = listenfd;
+    save_rooms_cb = save_rooms;
+    main_thread = pthread_self();
+
+    // no SA_RESTART, a parked thread must come out of its read. Writes to
+    // members it interrupts are picked up again, see writev_all
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = on_upgrade_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock < 0){
+        perror("Upgrade: socket creation failed");
+        return -errno;
+    }
+
+    unlink(path);
+
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0 ||
+        listen(sock, 1) < 0){
+        perror("Upgrade: bind failed");
+        close(sock);
+        return -errno;
+    }
+
+    pthread_t thread;
+    if((err = pthread_create(&thread, NULL, upgrade_server,
+                                (void*)(intptr_t)sock)) != 0){
+        close(sock);
+        return -err;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
+
+/**
+ * @brief room names and watched prefixes of a handoff message as the lists
+ *          for adopt_fn
+ *
+ * @return char* NULL if the names are malformed or out of memory
+ */
+static char* read_rooms(const handoff_msg_t* msg, const char* names)
+{
+    // names at most twice, a 0 for each and a '*' for every prefix, and
+    // three empty names
+    char* rooms = (char*)malloc(2*msg->room_len + 3*msg->num_rooms + 4);
+    if(!rooms){
+        return NULL;
+    }
+
+    char* out = rooms;
+
+    if(msg->num_rooms == 0){
+        memcpy(out, names, msg->room_len);
+        out += msg->room_len;
+        *out++ = '\0';
+    }
+
+    // rooms, then prefixes, then the rooms whose roster it follows
+    for(int list = 0; list < 3; list++){
+
+        const char* pos = names;
+        const char* end = names + msg->room_len;
+
+        for(int i = 0; i < msg->num_rooms; i++){
+
+            size_t len = pos < end ? (uint8_t)*pos++ : MAX_ROOMNAME_LEN;
+            bool is_watch = (len & HANDOFF_WATCH) != 0;
+            bool is_live = !is_watch && (len & HANDOFF_ROSTER) != 0;
+            len &= ~(HANDOFF_WATCH | HANDOFF_ROSTER);
+
+            if((len == 0 && !is_watch) || len >= MAX_ROOMNAME_LEN ||
+                len > (size_t)(end - pos)){
+                free(rooms);
+                return NULL;
+            }
+
+            if((list == 0 && !is_watch) || (list == 1 && is_watch) ||
+                (list == 2 && is_live)){
+                memcpy(out, pos, len);
+                out += len;
+                if(is_watch){
+                    *out++ = '*';
+                }
+                *out++ = '\0';
+            }
+            pos += len;
+        }
+
+        *out++ = '\0';
+    }
+
+    return rooms;
+}
+
+/**
+ * @param rooms set to the rooms of the connection, @see adopt_fn
+ */
+static user_t* read_conn(const char* buff, ssize_t len, int fd, char** rooms)
+{
+    handoff_msg_t msg;
+    memcpy(&msg, buff, sizeof(handoff_msg_t));
+
+    if((size_t)len != sizeof(handoff_msg_t) + msg.user_len + msg.room_len +
+                        msg.pending_len || msg.user_len >= MAX_USERNAME_LEN ||
+        msg.num_rooms > MAX_CONN_ROOMS + MAX_CONN_WATCHES ||
+        (msg.num_rooms == 0 && msg.room_len >= MAX_ROOMNAME_LEN) ||
+        msg.pending_len >= MAX_BUFF_LEN){
+        return NULL;
+    }
+
+    const char* pos = buff + sizeof(handoff_msg_t);
+
+    *rooms = NULL;
+    if((msg.flags & HANDOFF_JOINED) &&
+        !(*rooms = read_rooms(&msg, pos + msg.user_len))){
+        return NULL;
+    }
+
+    user_t* user_info = (user_t*)calloc(1, sizeof(user_t));
+    if(!user_info){
+        free(*rooms);
+        return NULL;
+    }
+
+    user_info->connfd = fd;
+    user_info->wants_seq = msg.wants_seq;
+    user_info->binary = msg.binary;
+    user_info->tagged = (msg.flags & HANDOFF_TAGGED) != 0;
+    user_info->resume_seq = msg.resume_seq;
+
+    if(msg.flags & HANDOFF_JOINED){
+        user_info->user_name_len = msg.user_len;
+        if(!(user_info->user_name = intern_name(pos, msg.user_len))){
+            free(*rooms);
+            free(user_info);
+            return NULL;
+        }
+    }
+    pos += msg.user_len + msg.room_len;
+
+    // a long partial line does not fit inline, the second round takes a
+    // buffer from the pool
+    size_t room;
+    while(user_info->rx_len < msg.pending_len &&
+            (room = conn_rx_reserve(user_info)) > 0){
+
+        size_t n = msg.pending_len - user_info->rx_len;
+        n = n < room ? n : room;
+
+        memcpy(user_info->rx + user_info->rx_len, pos + user_info->rx_len, n);
+        user_info->rx_len += n;
+        user_info->rx[user_info->rx_len] = '\0';
+    }
+
+    return user_info;
+}
+
+/**
+ * @brief takes over from a running server listening on path
+ *
+ * @param path unix socket path of the running server
+ * @param load_rooms loads the rooms saved by the old process
+ * @param adopt called for every connection handed over
+ * @return int listening socket of the server, -ENOENT if nobody is running
+ *              or negative on error
+ */
+int upgrade_takeover(const char* path, load_rooms_fn load_rooms, adopt_fn adopt)
+{
+    struct sockaddr_un addr;
+    int err;
+
+    if((err = make_addr(&addr, path)) < 0){
+        return err;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock < 0){
+        return -errno;
+    }
+
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0){
+        close(sock);
+        return -ENOENT;
+    }
+
+    char* buff = (char*)malloc(HANDOFF_BUFF_LEN);
+    int conns_cap = 1024, num_conns = 0;
+    user_t** conns = (user_t**)malloc(conns_cap*sizeof(user_t*));
+    char** rooms = (char**)malloc(conns_cap*sizeof(char*));
+
+    if(!buff || !conns || !rooms){
+        free(buff);
+        free(conns);
+        free(rooms);
+        close(sock);
+        return -ENOMEM;
+    }
+
+    int listenfd = -1;
+    err = 0;
+
+    while(err == 0){
+
+        int fd;
+        ssize_t n = recv_msg(sock, buff, HANDOFF_BUFF_LEN, &fd);
+
+        if(n < 0){
+            err = n;
+            break;
+        }
+
+        handoff_msg_t* msg = (handoff_msg_t*)buff;
+
+        if(msg->type == HANDOFF_HELLO){
+            listenfd = fd;
+        } else if(msg->type == HANDOFF_CONN && fd >= 0){
+
+            if(num_conns == conns_cap){
+                conns_cap *= 2;
+                conns = (user_t**)realloc(conns, conns_cap*sizeof(user_t*));
+                rooms = (char**)realloc(rooms, conns_cap*sizeof(char*));
+                if(!conns || !rooms){
+                    printf("Upgrade: out of memory\n");
+                    exit(-ENOMEM);
+                }
+            }
+
+            if(!(conns[num_conns] = read_conn(buff, n, fd,
+                                                &rooms[num_conns]))){
+                close(fd);
+                continue;
+            }
+            num_conns++;
+
+        } else if(msg->type == HANDOFF_END){
+            break;
+        } else {
+            err = -EPROTO;
+        }
+    }
+
+    char snap_path[UPGRADE_PATH_LEN + 8];
+    snprintf(snap_path, sizeof(snap_path), "%s.snap", path);
+
+    if(err == 0 && listenfd < 0){
+        err = -EPROTO;
+    }
+
+    if(err < 0){
+        // the old process keeps serving, drop our copies of the fds
+        printf("Upgrade: takeover failed\n");
+        for(int i = 0; i < num_conns; i++){
+            close(conns[i]->connfd);
+            conn_rx_release(conns[i]);
+            intern_release(conns[i]->user_name);
+            free(conns[i]);
+        }
+        if(listenfd >= 0){
+            close(listenfd);
+        }
+    } else {
+
+        if(load_rooms(snap_path) < 0){
+            printf("Upgrade: rooms could not be restored\n");
+        }
+        unlink(snap_path);
+
+        for(int i = 0; i < num_conns; i++){
+            adopt(conns[i], rooms[i]);
+        }
+
+        handoff_msg_t* msg = (handoff_msg_t*)buff;
+        memset(msg, 0, sizeof(handoff_msg_t));
+        msg->type = HANDOFF_ACK;
+        send_msg(sock, msg, sizeof(handoff_msg_t), -1);
+
+        printf("Upgrade: took over %d connections\n", num_conns);
+    }
+
+    for(int i = 0; i < num_conns; i++){
+        free(rooms[i]);
+    }
+
+    free(buff);
+    free(conns);
+    free(rooms);
+    close(sock);
+
+    return err < 0 ? err : listenfd;
+}
@@ -0,0 +1,34 @@
+#ifndef __UPGRADE_H
+#define __UPGRADE_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "conn.h"
+
+/**
+ * @brief called by upgrade_takeover for every connection handed over
+ *
+ * -> rooms holds the names of the rooms it was in in the old process, each
+ *     0 terminated, an empty name ends the list. The "<prefix>*" it
+ *     watched follow as a second list, then the rooms whose roster it
+ *     follows as a third. NULL if it had not joined
+ *
+ */
+typedef int (*adopt_fn)(user_t* user_info, const char* rooms);
+
+/**
+ * @brief writes the room state the new process loads, caller of the upgrade
+ *          provides it since it owns trie_lock
+ *
+ */
+typedef int (*save_rooms_fn)(const char* path);
+typedef int (*load_rooms_fn)(const char* path);
+
+int upgrade_takeover(const char* path, load_rooms_fn load_rooms, adopt_fn adopt);
+int upgrade_listen(const char* path, int listenfd, save_rooms_fn save_rooms);
+bool upgrade_in_progress();
+void upgrade_park(user_t* user_info);
+void upgrade_park_main();
+
+#endif
@@ -0,0 +1,200 @@
+/**
+ * @file user_dir.c
+ * @brief user name -> connections index, for messages to one user
+ *
+ * -> A connection is added once its JOIN went through and removed before
+ *     its fd is closed, so whoever finds it under the shard lock may write
+ *     to its fd.
+ * -> Names are not unique, a user on two devices has two connections in
+ *     the same chain and both get what is sent to the name.
+ * -> USER_DIR_SHARDS hash tables each with their own lock, a JOIN only
+ *     contends with JOINs of names in the same shard. The chains go through
+ *     user_t itself, adding a connection allocates nothing until a table
+ *     has to grow.
+ * -> User names are interned, a name is hashed and compared by its handle
+ *     and never by its bytes. @see intern.c
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "user_dir.h"
+#include "mem_acct.h"
+#include "intern.h"
+
+#define USER_DIR_SHARDS (64)
+#define USER_DIR_INIT_CAP (64)
+
+typedef struct UserDirShard{
+    pthread_mutex_t lock;
+    user_t** buckets;   // NULL until the first add, cap is a power of 2
+    size_t cap;
+    size_t count;
+}user_dir_shard_t;
+
+static user_dir_shard_t shards[USER_DIR_SHARDS];
+
+static uint32_t hash_name(const char* handle)
+{
+    // entries are at least 8 byte aligned, fold the rest of the address
+    uint64_t addr = (uintptr_t)handle >> 3;
+
+    return (uint32_t)((addr * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+void user_dir_init()
+{
+    for(int i = 0; i < USER_DIR_SHARDS; i++){
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+static user_t** bucket_of(user_dir_shard_t* shard, uint32_t hash)
+{
+    return &shard->buckets[(hash / USER_DIR_SHARDS) & (shard->cap - 1)];
+}
+
+/**
+ * @brief doubles the buckets of a shard, caller holds its lock
+ *
+ * @return int 0 on success, -1 if out of memory
+ */
+static int grow_shard(user_dir_shard_t* shard)
+{
+    size_t old_cap = shard->cap;
+    user_t** old = shard->buckets;
+
+    size_t cap = old_cap ? 2*old_cap : USER_DIR_INIT_CAP;
+    user_t** buckets = (user_t**)calloc(cap, sizeof(user_t*));
+    if(!buckets){
+        return -1;
+    }
+
+    shard->buckets = buckets;
+    shard->cap = cap;
+
+    for(size_t i = 0; i < old_cap; i++){
+        user_t* user_info = old[i];
+        while(user_info){
+            user_t* next = user_info->dir_next;
+            user_t** bucket = bucket_of(shard, hash_name(user_info->user_name));
+            user_info->dir_next = *bucket;
+            *bucket = user_info;
+            user_info = next;
+        }
+    }
+
+    free(old);
+    mem_acct_add(MEM_USER_DIR, (long)sizeof(user_t*)*(cap - old_cap));
+
+    return 0;
+}
+
+/**
+ * @brief adds a connection under its user name, called once it joined
+ *
+ * -> a shard that can not grow keeps longer chains, the add never fails
+ *
+ * @param user_info
+ */
+void user_dir_add(user_t* user_info)
+{
+    uint32_t hash = hash_name(user_info->user_name);
+    user_dir_shard_t* shard = &shards[hash % USER_DIR_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(shard->count >= shard->cap && grow_shard(shard) < 0 && !shard->cap){
+        printf("No memory for user directory\n");
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    user_t** bucket = bucket_of(shard, hash);
+    user_info->dir_next = *bucket;
+    *bucket = user_info;
+    user_info->in_dir = true;
+    shard->count++;
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief counterpart of user_dir_add, before the fd is closed
+ *
+ * @param user_info
+ */
+void user_dir_del(user_t* user_info)
+{
+    if(!user_info->in_dir){
+        return;
+    }
+
+    uint32_t hash = hash_name(user_info->user_name);
+    user_dir_shard_t* shard = &shards[hash % USER_DIR_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    for(user_t** pp = bucket_of(shard, hash); *pp; pp = &(*pp)->dir_next){
+        if(*pp == user_info){
+            *pp = user_info->dir_next;
+            shard->count--;
+            break;
+        }
+    }
+
+    user_info->dir_next = NULL;
+    user_info->in_dir = false;
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief calls visit for every connection of the user name
+ *
+ * -> visit runs under the shard lock, the connection can not leave while
+ *     it runs. visit must not add or remove connections, and must not
+ *     block: joins and leaves of the shard wait for it. Writers copy what
+ *     they need, with conn_gen, and write after, @see writev_conn
+ *
+ * @param user_name
+ * @param len
+ * @param visit
+ * @param arg passed through to visit
+ * @return int number of connections visited
+ */
+int user_dir_visit(const char* user_name, size_t len, user_dir_visit_fn visit,
+                    void* arg)
+{
+    // held until the walk is done, the handle can not be reused meanwhile
+    const char* handle = intern_name(user_name, len);
+    if(!handle){
+        return 0;
+    }
+
+    uint32_t hash = hash_name(handle);
+    user_dir_shard_t* shard = &shards[hash % USER_DIR_SHARDS];
+    int found = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(shard->cap){
+        for(user_t* user_info = *bucket_of(shard, hash); user_info;
+                user_info = user_info->dir_next){
+
+            if(user_info->user_name == handle){
+                visit(user_info, arg);
+                found++;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    intern_release(handle);
+
+    return found;
+}
@@ -0,0 +1,16 @@
+#ifndef __USER_DIR_H
+#define __USER_DIR_H
+
+#include <stddef.h>
+
+#include "conn.h"
+
+typedef void (*user_dir_visit_fn)(user_t* user_info, void* arg);
+
+void user_dir_init();
+void user_dir_add(user_t* user_info);
+void user_dir_del(user_t* user_info);
+int user_dir_visit(const char* user_name, size_t len, user_dir_visit_fn visit,
+                    void* arg);
+
+#endif
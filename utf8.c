@@ -0,0 +1,124 @@
+/**
+ * @file utf8.c
+ * @brief checks that a line from a client is text other clients can show
+ *
+ * -> Well formed UTF-8 only: no overlong forms, no surrogates, nothing above
+ *     U+10FFFF. Control characters, C0, DEL and C1, are rejected as well, a
+ *     line only ends at the delimiter.
+ * -> Chat is mostly ASCII, 16 bytes at a time are checked with SSE2 for
+ *     being ASCII and free of controls. Only a block with a byte above 0x7f
+ *     is decoded one character at a time.
+ *
+ */
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utf8.h"
+
+/**
+ * @brief decodes the multi byte character at p
+ *
+ * @return int its length, 0 if it is not valid
+ */
+static int utf8_char(const uint8_t* p, const uint8_t* end)
+{
+    uint8_t c = p[0];
+    uint32_t cp;
+    int n;
+
+    if(c >= 0xC2 && c <= 0xDF){
+        n = 2;
+        cp = c & 0x1F;
+    } else if((c & 0xF0) == 0xE0){
+        n = 3;
+        cp = c & 0x0F;
+    } else if(c >= 0xF0 && c <= 0xF4){
+        n = 4;
+        cp = c & 0x07;
+    } else {
+        return 0;
+    }
+
+    if(end - p < n){
+        return 0;
+    }
+
+    for(int i = 1; i < n; i++){
+        if((p[i] & 0xC0) != 0x80){
+            return 0;
+        }
+        cp = (cp << 6) | (p[i] & 0x3F);
+    }
+
+    // overlong, surrogates, beyond unicode and C1 controls
+    if((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+        cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF) || cp <= 0x9F){
+        return 0;
+    }
+
+    return n;
+}
+
+/**
+ * @brief whether the line is well formed UTF-8 without control characters
+ *
+ * @param line without the delimiter, a '\r' before it is allowed
+ * @param len
+ * @return true if it may be sent on
+ */
+bool utf8_valid_line(const char* line, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)line;
+    const uint8_t* end = p + len;
+
+    if(len > 0 && end[-1] == '\r'){
+        end--;
+    }
+
+    while(p < end){
+
+        const uint8_t* stop = end;
+
+#ifdef __SSE2__
+        if(end - p >= 16){
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+
+            if(_mm_movemask_epi8(v) == 0){
+                __m128i ctl = _mm_or_si128(
+                                _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+                                _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+                if(_mm_movemask_epi8(ctl) != 0){
+                    return false;
+                }
+                p += 16;
+                continue;
+            }
+
+            // not all ASCII, this block is decoded a character at a time
+            stop = p + 16;
+        }
+#endif
+
+        while(p < stop){
+
+            if(*p < 0x80){
+                if(*p < 0x20 || *p == 0x7f){
+                    return false;
+                }
+                p++;
+                continue;
+            }
+
+            int n = utf8_char(p, end);
+            if(n == 0){
+                return false;
+            }
+            p += n;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,9 @@
+#ifndef __UTF8_H
+#define __UTF8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool utf8_valid_line(const char* line, size_t len);
+
+#endif
@@ -7,6 +7,10 @@
  * -> each trie node contains a pointer to a room struct if it is the end of the
  *     word(eg. for room name "cooking" the 'g' node will contain ptr to room)
  * -> Each room contains a resizeable array of user fds.
+ * -> Each node can hold the fds watching its prefix, they get the messages
+ *     of every room whose name starts with it. A message walks the path of
+ *     its room from the root, which can not change while the room exists,
+ *     so watch_lock and not trie_lock guards the walk.
  * 
  * 
  * 
@@ -30,12 +34,28 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/socket.h>
 #include <errno.h>
 
 #include "utils.h"
+#include "history.h"
+#include "payload.h"
+#include "conn.h"
+#include "frame.h"
+#include "intern.h"
+#include "lock_prof.h"
 
 
 static trie_node_t *trie_root;
+static int num_rooms;
+
+// guards the watchers of every node, taken after room->lock and trie_lock
+static pthread_rwlock_t watch_lock = PTHREAD_RWLOCK_INITIALIZER;
+// no message looks at the trie while nobody watches
+static int num_watches;
+
+static chat_room_t* attach_room(trie_node_t* itr, const char* room_name);
+static int prune_trie(const char* name, trie_node_t* itr, int len, int i);
 
 /**
  * @brief initialize a trie node
@@ -46,17 +66,67 @@ static trie_node_t* init_trie_node()
 {
     trie_node_t* temp = (trie_node_t*)calloc(1, sizeof(trie_node_t));
 
+    if(!temp){
+        return NULL;
+    }
+
+    mem_acct_add(MEM_TRIE, sizeof(trie_node_t));
+
     for(int i = 0; i < TRIE_MAX_CHILD; i++){
         temp->child[i] = NULL;
     }
 
     temp->is_word = false;
     temp->room = NULL;
+    temp->watchers = NULL;
 
     return temp;
 }
 
 
+static void free_watchers(trie_node_t* node)
+{
+    if(node->watchers){
+        mem_acct_add(MEM_TRIE, -(long)(sizeof(rs_array_t) +
+                                        sizeof(int)*node->watchers->cap));
+        free(node->watchers->data);
+        free(node->watchers);
+        node->watchers = NULL;
+    }
+}
+
+static void free_trie_node(trie_node_t* node)
+{
+    free_watchers(node);
+    mem_acct_add(MEM_TRIE, -(long)sizeof(trie_node_t));
+    free(node);
+}
+
+/**
+ * @brief frees the room struct and everything it holds
+ *
+ */
+static void free_room(chat_room_t* room)
+{
+    history_clear(room);
+
+    // history credited itself, the rest is the room
+    mem_acct_add(MEM_ROOMS, -(long)room->mem_bytes);
+
+    free(room->user_fds->data);
+    free(room->user_fds);
+    free(room->roster);
+    if(room->roster_live){
+        free(room->roster_live->data);
+        free(room->roster_live);
+    }
+    intern_release(room->room_name);
+    free(room->dedup);
+    free(room);
+
+    num_rooms--;
+}
+
 static void clear_trie(trie_node_t* root)
 {
     if(!root){
@@ -69,13 +139,12 @@ static void clear_trie(trie_node_t* root)
 
     if(root->is_word){
         if(root->room){
-            free(root->room->room_name);
             pthread_mutex_destroy(&root->room->lock);
-            free(root->room);
+            free_room(root->room);
         }
     }
 
-    free(root);
+    free_trie_node(root);
 }
 
 /**
@@ -97,7 +166,8 @@ int init_trie()
 }
 
 /**
- * @brief initialize the resizeable array
+ * @brief initialize the resizeable array, the data is allocated on the first
+ *          insert so rooms nobody is in stay small
  * 
  * @return rs_array* pointer to array
  */
@@ -109,13 +179,8 @@ static rs_array_t* init_rs_array()
         return NULL;
     }
 
-    temp_rs->data = (int*)malloc(INIT_ARR_CAP*sizeof(int));
-
-    if(!(temp_rs->data)){
-        return NULL;
-    }
-
-    temp_rs->cap = INIT_ARR_CAP;
+    temp_rs->data = NULL;
+    temp_rs->cap = 0;
     temp_rs->size = 0;
 
     return temp_rs;
@@ -139,17 +204,19 @@ int insert_into_rs_array(rs_array_t** rs, int user_fd)
 
     int size = (*rs)->size;
     // if line number is already inserted then do not insert again
-    if((*rs)->data[size-1] == user_fd){
+    if(size > 0 && (*rs)->data[size-1] == user_fd){
         return -EINVAL;
     }
 
     if((*rs)->size == ((*rs)->cap)){
         //array mem full. add more. (double it!)
-        (*rs)->cap = 2*(*rs)->cap;
-        (*rs)->data = realloc((*rs)->data, sizeof(int)*(*rs)->cap);
-        if(!((*rs)->data)){
+        int cap = (*rs)->cap ? 2*(*rs)->cap : INIT_ARR_CAP;
+        int* data = realloc((*rs)->data, sizeof(int)*cap);
+        if(!data){
             return -ENOMEM;
         }
+        (*rs)->data = data;
+        (*rs)->cap = cap;
     }
 
     (*rs)->data[size++] = user_fd;
@@ -159,6 +226,705 @@ int insert_into_rs_array(rs_array_t** rs, int user_fd)
     return 0;
 }
 
+/**
+ * @brief adds a member to the room, caller holds room->lock
+ *
+ * -> the member array and the roster next to it only grow if the room
+ *     stays under its memory cap
+ *
+ * @param room
+ * @param user_fd
+ * @param user_name interned handle, kept as is in the roster. The member
+ *          holds it while it is in the room
+ * @return int 0 on success, -ENOMEM if the room is full
+ */
+int room_add_fd(chat_room_t* room, int user_fd, const char* user_name)
+{
+    rs_array_t* rs = room->user_fds;
+    int old_cap = rs->cap;
+
+    if(rs->size == rs->cap){
+        int cap = rs->cap ? 2*rs->cap : INIT_ARR_CAP;
+        size_t more = (sizeof(int) + sizeof(char*))*(cap - rs->cap);
+        if(!mem_acct_room_fits(room->mem_bytes, more)){
+            return -ENOMEM;
+        }
+
+        const char** roster = (const char**)realloc(room->roster,
+                                                    sizeof(char*)*cap);
+        if(!roster){
+            return -ENOMEM;
+        }
+        room->roster = roster;
+    }
+
+    int err;
+    if((err = insert_into_rs_array(&room->user_fds, user_fd)) < 0){
+        return err;
+    }
+
+    room->roster[rs->size - 1] = user_name;
+
+    room_mem_charge(room, MEM_ROOMS,
+                    (long)(sizeof(int) + sizeof(char*))*(rs->cap - old_cap));
+
+    return 0;
+}
+
+static void remove_live(chat_room_t* room, int user_fd)
+{
+    rs_array_t* live = room->roster_live;
+
+    for(int i = 0; live && i < live->size; i++){
+        if(live->data[i] == user_fd){
+            live->data[i] = live->data[--live->size];
+            break;
+        }
+    }
+}
+
+/**
+ * @brief removes a member from the room, the others keep their order.
+ *          Caller holds room->lock
+ *
+ * @param room
+ * @param user_fd
+ * @return int 0 on success, -ENOENT if it is not a member
+ */
+int room_del_fd(chat_room_t* room, int user_fd)
+{
+    rs_array_t* rs = room->user_fds;
+
+    int i = 0;
+    while(i < rs->size && rs->data[i] != user_fd){
+        i++;
+    }
+
+    if(i == rs->size){
+        return -ENOENT;
+    }
+
+    memmove(rs->data + i, rs->data + i + 1, sizeof(int)*(rs->size - i - 1));
+    memmove(room->roster + i, room->roster + i + 1,
+            sizeof(char*)*(rs->size - i - 1));
+    rs->size--;
+
+    remove_live(room, user_fd);
+
+    return 0;
+}
+
+// names per roster line, each takes two iovecs
+#define WHO_BATCH (32)
+
+/**
+ * @brief sends the members of the room to one of them, caller holds
+ *          room->lock
+ *
+ * -> "[<room>] MEMBERS <n>" then "[<room>] WHO <name> <name> ..." lines
+ *     until all n names were sent, a batch of names per writev
+ * -> with live the member is then told of every join and leave,
+ *     "[<room>] +<name>" and "[<room>] -<name>", until it leaves the room.
+ *     Unlike presence these are never folded into digests
+ *
+ * @param room
+ * @param user_fd
+ * @param live
+ * @return int 0 on success negative on error
+ */
+int room_who_locked(chat_room_t* room, int user_fd, bool live)
+{
+    int err;
+    if(live && (err = room_roster_follow_locked(room, user_fd)) < 0){
+        return err;
+    }
+
+    char head[MAX_ROOMNAME_LEN + 32];
+    int head_len = snprintf(head, sizeof(head), "%sMEMBERS %d\n", room->tag,
+                            room->num_people);
+
+    struct iovec iov[2*WHO_BATCH + 2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    int iovcnt = 1;
+
+    for(int i = 0; i < room->num_people; ){
+
+        iov[iovcnt].iov_base = room->tag;
+        iov[iovcnt].iov_len = room->tag_len;
+        iov[iovcnt+1].iov_base = "WHO";
+        iov[iovcnt+1].iov_len = 3;
+        iovcnt += 2;
+
+        for(int k = 0; k < WHO_BATCH - 1 && i < room->num_people; k++, i++){
+            iov[iovcnt].iov_base = " ";
+            iov[iovcnt].iov_len = 1;
+            iov[iovcnt+1].iov_base = (void*)room->roster[i];
+            iov[iovcnt+1].iov_len = strlen(room->roster[i]);
+            iovcnt += 2;
+        }
+
+        iov[iovcnt].iov_base = "\n";
+        iov[iovcnt].iov_len = 1;
+        iovcnt++;
+
+        if((err = writev_all(user_fd, iov, iovcnt)) < 0){
+            return err;
+        }
+        iovcnt = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief tells the member of every later join and leave, caller holds
+ *          room->lock. @see room_who_locked
+ *
+ * @return int 0 on success, -ENOMEM if out of memory
+ */
+int room_roster_follow_locked(chat_room_t* room, int user_fd)
+{
+    if(room_roster_is_live(room, user_fd)){
+        return 0;
+    }
+
+    rs_array_t* rs = room->roster_live;
+    int old_cap = rs ? rs->cap : 0;
+
+    if(!rs && (rs = room->roster_live = init_rs_array()) != NULL){
+        room_mem_charge(room, MEM_ROOMS, sizeof(rs_array_t));
+    }
+
+    if(!rs || insert_into_rs_array(&room->roster_live, user_fd) < 0){
+        return -ENOMEM;
+    }
+    room_mem_charge(room, MEM_ROOMS, (long)sizeof(int)*(rs->cap - old_cap));
+
+    return 0;
+}
+
+/**
+ * @brief whether the member gets roster diffs, caller holds room->lock
+ *
+ */
+bool room_roster_is_live(chat_room_t* room, int user_fd)
+{
+    rs_array_t* live = room->roster_live;
+
+    for(int i = 0; live && i < live->size; i++){
+        if(live->data[i] == user_fd){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief tells the members following the roster that user joined or left,
+ *          caller holds room->lock
+ *
+ */
+void room_roster_diff_locked(chat_room_t* room, const char* user_name,
+                                bool joined)
+{
+    rs_array_t* live = room->roster_live;
+
+    for(int i = 0; live && i < live->size; i++){
+
+        struct iovec iov[4] = {
+            {room->tag, room->tag_len},
+            {joined ? "+" : "-", 1},
+            {(void*)user_name, strlen(user_name)},
+            {"\n", 1},
+        };
+
+        if(writev_all(live->data[i], iov, 4) < 0){
+            perror("Error in write");
+        }
+    }
+}
+
+static int writev_rest(int fd, struct iovec* iov, int iovcnt)
+{
+    while(iovcnt > 0){
+
+        ssize_t n = writev(fd, iov, iovcnt);
+
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -errno;
+        }
+
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if(iovcnt > 0){
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief writes len bytes of the iovec array, picking up after short writes
+ *
+ * -> every write to a member goes through here, a SIGUSR2 of an upgrade may
+ *     interrupt it halfway
+ * -> holds the write lock of the connection throughout, a record written
+ *     in pieces is never split by one from another thread
+ *
+ * @return int 0 on success negative on error
+ */
+int writev_all(int fd, struct iovec* iov, int iovcnt)
+{
+    pthread_mutex_t* lock = conn_write_lock(fd);
+
+    if(lock){
+        pthread_mutex_lock(lock);
+    }
+
+    int err = writev_rest(fd, iov, iovcnt);
+
+    if(lock){
+        pthread_mutex_unlock(lock);
+    }
+
+    return err;
+}
+
+/**
+ * @brief writev_all to the connection that had fd at generation gen
+ *
+ * -> for writers that found the connection under a lock they have dropped
+ *     since, @see conn_gen
+ *
+ * @return int 0 on success, -EBADF if the connection is gone, negative on
+ *          error
+ */
+int writev_conn(int fd, uint32_t gen, struct iovec* iov, int iovcnt)
+{
+    pthread_mutex_t* lock = conn_write_lock(fd);
+
+    if(!lock){
+        return -EBADF;
+    }
+
+    pthread_mutex_lock(lock);
+
+    int err = (conn_gen(fd) == gen) ? writev_rest(fd, iov, iovcnt) : -EBADF;
+
+    pthread_mutex_unlock(lock);
+
+    return err;
+}
+
+/**
+ * @brief writev_all for whoever must not wait, e.g. the timer thread
+ *
+ * -> gives up if another thread is writing to fd or the socket buffer is
+ *     full. Once the first bytes went out the rest is written even if that
+ *     blocks, a record is never left torn. It is short, a few bytes at most
+ *     wait for room.
+ *
+ * @return int 0 on success, -EAGAIN if nothing was written, negative on error
+ */
+int writev_try(int fd, struct iovec* iov, int iovcnt)
+{
+    pthread_mutex_t* lock = conn_write_lock(fd);
+
+    if(lock && pthread_mutex_trylock(lock) != 0){
+        return -EAGAIN;
+    }
+
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    int err = 0;
+    if(n < 0){
+        err = (errno == EWOULDBLOCK) ? -EAGAIN : -errno;
+    } else {
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if(iovcnt > 0){
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+            err = writev_rest(fd, iov, iovcnt);
+        }
+    }
+
+    if(lock){
+        pthread_mutex_unlock(lock);
+    }
+
+    return err;
+}
+
+/**
+ * @brief charges bytes to the room and to kind, negative bytes credit them
+ *          back. Caller holds room->lock or the room is not in the trie yet
+ *
+ */
+void room_mem_charge(chat_room_t* room, mem_kind_t kind, long bytes)
+{
+    room->mem_bytes += bytes;
+    mem_acct_add(kind, bytes);
+}
+
+/**
+ * @brief number of rooms, caller holds whatever lock protects the trie
+ *
+ */
+int room_count()
+{
+    return num_rooms;
+}
+
+/**
+ * @brief writes msg to every member of the room, caller holds room->lock
+ *
+ * -> a failed write to one member does not stop delivery to the others, that
+ *     member's own thread notices the broken connection on its next read
+ * -> members speaking the binary protocol get it as a NOTICE frame
+ * -> members in several rooms get the tag of the room in front of it
+ *
+ * @param room
+ * @param msg preformatted message including the delimiter
+ * @param len length of msg
+ *
+ * @return int number of members the write failed for
+ */
+int room_broadcast_locked(chat_room_t* room, const char* msg, size_t len)
+{
+    int failed = 0;
+
+    for(int i = 0; i < room->num_people; i++){
+
+        int fd = room->user_fds->data[i];
+        user_t* user_info = conn_lookup(fd);
+
+        int err;
+        if(user_info && user_info->binary){
+            struct iovec iov[2];
+            uint8_t hdr[FRAME_HDR_MAX];
+            err = writev_all(fd, iov, frame_text_iov(iov, hdr, FRAME_NOTICE,
+                                                        msg, len));
+        } else if(user_info &&
+                    __atomic_load_n(&user_info->tagged, __ATOMIC_RELAXED)){
+            struct iovec iov[2] = {
+                {room->tag, room->tag_len},
+                {(void*)msg, len},
+            };
+            err = writev_all(fd, iov, 2);
+        } else {
+            struct iovec iov = {(void*)msg, len};
+            err = writev_all(fd, &iov, 1);
+        }
+
+        if(err < 0){
+            perror("Error in write");
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * @brief writes a chat message to one member of the room, caller holds
+ *          room->lock
+ *
+ * -> members that joined with a sequence number get the "#<seq> " prefix
+ *     stored in front of the payload, everybody else just the message
+ * -> members in several rooms get the tag of the room before all of it
+ *
+ * @param room
+ * @param fd
+ * @param payload
+ *
+ * @return int 0 on success negative on error
+ */
+int room_send_member_locked(chat_room_t* room, int fd, payload_t* payload)
+{
+    user_t* user_info = conn_lookup(fd);
+
+    char* data = payload->text;
+    size_t len = payload->len;
+
+    if(user_info && user_info->wants_seq && payload->seq_len){
+        data -= payload->seq_len;
+        len += payload->seq_len;
+    }
+
+    if(user_info && user_info->binary){
+        struct iovec iov[3];
+        uint8_t hdr[FRAME_HDR_MAX];
+        uint64_t seq = user_info->wants_seq ? payload->seq : 0;
+        return writev_all(fd, iov, frame_msg_iov(iov, hdr, payload->data,
+                                                payload->len, seq));
+    }
+
+    if(user_info && __atomic_load_n(&user_info->tagged, __ATOMIC_RELAXED)){
+        struct iovec iov[2] = {
+            {room->tag, room->tag_len},
+            {data, len},
+        };
+        return writev_all(fd, iov, 2);
+    }
+
+    struct iovec iov = {data, len};
+    return writev_all(fd, &iov, 1);
+}
+
+/**
+ * @brief writes a chat message to every member of the room, caller holds
+ *          room->lock
+ *
+ * @param room
+ * @param payload
+ *
+ * @return int number of members the write failed for
+ */
+int room_send_payload_locked(chat_room_t* room, payload_t* payload)
+{
+    int failed = 0;
+
+    for(int i = 0; i < room->num_people; i++){
+
+        if(room_send_member_locked(room, room->user_fds->data[i],
+                                    payload) < 0){
+            perror("Error in write");
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * @brief adds a watcher to the prefix, caller holds trie_lock
+ *
+ * -> the nodes of the prefix are created if no room made them yet, and
+ *     stay while they are watched
+ *
+ * @param prefix "" watches every room
+ * @param user_fd
+ * @return int 0 on success negative on error
+ */
+int trie_watch(const char* prefix, int user_fd)
+{
+    trie_node_t* itr = trie_root;
+    int len = strnlen(prefix, MAX_ROOMNAME_LEN-1);
+
+    for(int i = 0; i < len; i++){
+
+        int j = toascii(prefix[i]);
+
+        if(!(itr->child[j]) && !(itr->child[j] = init_trie_node())){
+            prune_trie(prefix, trie_root, i, 0);
+            return -ENOMEM;
+        }
+        itr = itr->child[j];
+    }
+
+    pthread_rwlock_wrlock(&watch_lock);
+
+    int err = 0;
+    int old_cap = itr->watchers ? itr->watchers->cap : 0;
+
+    if(!itr->watchers){
+        if((itr->watchers = init_rs_array()) != NULL){
+            mem_acct_add(MEM_TRIE, sizeof(rs_array_t));
+        }
+    }
+
+    if(!itr->watchers ||
+        (err = insert_into_rs_array(&itr->watchers, user_fd)) < 0){
+        err = err ? err : -ENOMEM;
+    } else {
+        mem_acct_add(MEM_TRIE, sizeof(int)*(itr->watchers->cap - old_cap));
+        num_watches++;
+    }
+
+    if(err && itr->watchers && itr->watchers->size == 0){
+        free_watchers(itr);
+    }
+
+    pthread_rwlock_unlock(&watch_lock);
+
+    if(err){
+        prune_trie(prefix, trie_root, len, 0);
+    }
+
+    return err;
+}
+
+/**
+ * @brief counterpart of trie_watch, caller holds trie_lock
+ *
+ */
+void trie_unwatch(const char* prefix, int user_fd)
+{
+    trie_node_t* itr = trie_root;
+    int len = strnlen(prefix, MAX_ROOMNAME_LEN-1);
+
+    for(int i = 0; itr && i < len; i++){
+        itr = itr->child[toascii(prefix[i])];
+    }
+
+    if(!itr || !itr->watchers){
+        return;
+    }
+
+    pthread_rwlock_wrlock(&watch_lock);
+
+    rs_array_t* rs = itr->watchers;
+    for(int i = 0; i < rs->size; i++){
+        if(rs->data[i] == user_fd){
+            rs->data[i] = rs->data[--rs->size];
+            num_watches--;
+            break;
+        }
+    }
+
+    if(rs->size == 0){
+        free_watchers(itr);
+    }
+
+    pthread_rwlock_unlock(&watch_lock);
+
+    prune_trie(prefix, trie_root, len, 0);
+}
+
+static bool is_member(const user_t* user_info, const chat_room_t* room)
+{
+    for(int i = 0; i < user_info->num_rooms; i++){
+        if(user_info->rooms[i] == room){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// watchers copied out on the stack, more go to the heap
+#define WATCH_BATCH (32)
+
+typedef struct WatchTarget{
+    int fd;
+    uint32_t gen;
+    bool wants_seq;
+}watch_target_t;
+
+/**
+ * @brief writes a chat message to everyone watching a prefix of the room
+ *          name, caller holds room->lock
+ *
+ * -> always tagged with the room, with the sequence number if the watcher
+ *     asked for them. Watchers who are in the room got it already.
+ * -> the watchers are copied out under watch_lock and written after it is
+ *     dropped. trie_watch takes it exclusively under trie_lock, a slow
+ *     watcher would hold up every join. @see writev_conn
+ *
+ * @param room
+ * @param payload
+ *
+ * @return int number of watchers the write failed for
+ */
+int room_send_watchers_locked(chat_room_t* room, payload_t* payload)
+{
+    if(__atomic_load_n(&num_watches, __ATOMIC_RELAXED) == 0){
+        return 0;
+    }
+
+    int failed = 0;
+    const char* name = room->room_name;
+    trie_node_t* itr = trie_root;
+
+    watch_target_t batch[WATCH_BATCH];
+    watch_target_t* targets = batch;
+    int num_targets = 0, cap = WATCH_BATCH;
+
+    pthread_rwlock_rdlock(&watch_lock);
+
+    // the room node itself counts, a prefix may be the whole name
+    for(int i = 0; itr; i++){
+
+        for(int k = 0; itr->watchers && k < itr->watchers->size; k++){
+
+            int fd = itr->watchers->data[k];
+            user_t* user_info = conn_lookup(fd);
+
+            if(!user_info || is_member(user_info, room)){
+                continue;
+            }
+
+            if(num_targets == cap){
+                watch_target_t* more = (watch_target_t*)malloc(
+                                            2*cap*sizeof(watch_target_t));
+                if(!more){
+                    failed++;
+                    continue;
+                }
+                memcpy(more, targets, num_targets*sizeof(watch_target_t));
+                if(targets != batch){
+                    free(targets);
+                }
+                targets = more;
+                cap *= 2;
+            }
+
+            targets[num_targets++] = (watch_target_t){
+                .fd = fd,
+                .gen = conn_gen(fd),
+                .wants_seq = user_info->wants_seq,
+            };
+        }
+
+        itr = name[i] ? itr->child[toascii(name[i])] : NULL;
+    }
+
+    pthread_rwlock_unlock(&watch_lock);
+
+    for(int i = 0; i < num_targets; i++){
+
+        struct iovec iov[2] = {
+            {room->tag, room->tag_len},
+            {payload->text, payload->len},
+        };
+
+        if(targets[i].wants_seq){
+            iov[1].iov_base = payload->text - payload->seq_len;
+            iov[1].iov_len += payload->seq_len;
+        }
+
+        int err;
+        if((err = writev_conn(targets[i].fd, targets[i].gen, iov, 2)) < 0 &&
+            err != -EBADF){
+            perror("Error in write");
+            failed++;
+        }
+    }
+
+    if(targets != batch){
+        free(targets);
+    }
+
+    return failed;
+}
+
 /**
  * @brief checks if trie node is the leaf or not
  * 
@@ -179,10 +945,60 @@ static bool is_leaf(trie_node_t* root)
 }
 
 
+/**
+ * @brief frees the nodes at the end of name that hold no room, no watchers
+ *          and no children anymore, bottom up
+ *
+ * @param name
+ * @param itr node of name[i-1]
+ * @param len len of name
+ * @param i current postion in string
+ *
+ * @return int 1 if the node of name[i] was freed
+ */
+static int prune_trie(const char* name, trie_node_t* itr, int len, int i)
+{
+    if(i == len){
+        return 0;
+    }
+
+    int j = toascii(name[i]);
+    trie_node_t* child = itr->child[j];
+
+    if(!child || (i + 1 < len && !prune_trie(name, child, len, i+1))){
+        return 0;
+    }
+
+    if(child->is_word || child->watchers || !is_leaf(child)){
+        return 0;
+    }
+
+    free_trie_node(child);
+    itr->child[j] = NULL;
+
+    return 1;
+}
+
+/**
+ * @brief adds delta to the room count of every node on the path of name,
+ *          the root included
+ *
+ */
+static void count_room(const char* name, int len, int delta)
+{
+    trie_node_t* itr = trie_root;
+    itr->num_rooms += delta;
+
+    for(int i = 0; i < len; i++){
+        itr = itr->child[toascii(name[i])];
+        itr->num_rooms += delta;
+    }
+}
+
 /**
  * @brief removes the given room from trie
  * 
- * -> deletes the node only if it is the leaf node.
+ * -> deletes the nodes of the name nothing else needs
  * 
  * @param room_name
  * @param itr trie node used for recursive iteration
@@ -191,46 +1007,25 @@ static bool is_leaf(trie_node_t* root)
  * 
  * @return int 1 if matched and deleted 0 otherwise
  */
-int remove_from_trie(char* room_name, trie_node_t* itr, int len, int i)
+int remove_from_trie(const char* room_name, trie_node_t* itr, int len, int i)
 {
-    if(!itr){
-        return 0;
+    trie_node_t* node = itr;
+
+    for(int k = i; node && k < len; k++){
+        node = node->child[toascii(room_name[k])];
     }
 
-    if(!(itr->child[toascii(room_name[i])])){
+    if(!node || !node->is_word){
         return 0;
-
-    } else {
-
-        trie_node_t* child = itr->child[toascii(room_name[i])];
-        if(child->is_word && i == (len -1)){
-
-            if(is_leaf(child)){
-                free(child);
-                itr->child[toascii(room_name[i])] = NULL;
-                child->room = NULL;
-                return 1;
-            } else {
-                child->is_word = false;
-                child->room = NULL;
-                return 0;
-            }
-        }
     }
 
-    itr = itr->child[toascii(room_name[i])];
-
-    int should_delete = remove_from_trie(room_name, itr, len, i+1);
+    node->is_word = false;
+    node->room = NULL;
 
-    if(should_delete){
+    count_room(room_name, len, -1);
+    prune_trie(room_name, itr, len, i);
 
-        if(!(itr->is_word) && trie_root != itr && is_leaf(itr)){
-            free(itr);
-            return 1;
-        }
-    }
-
-    return 0;
+    return 1;
 }
 
 /**
@@ -255,8 +1050,7 @@ int delete_room(chat_room_t* room)
         return -1;
     }
 
-    free(room->room_name);
-    free(room);
+    free_room(room);
     
     return 0;
 }
@@ -308,6 +1102,186 @@ chat_room_t* create_room(const char* room_name)
         exit(-1);
     }
 
+    chat_room_t* room = attach_room(itr, room_name);
+    if(room){
+        count_room(room_name, i, 1);
+    }
+
+    return room;
+}
+
+/**
+ * @brief Create a room while loading many rooms in sorted order
+ *
+ * -> the cursor remembers the trie path of the previous room, only the part
+ *     of the name after the prefix shared with the previous room is walked.
+ *     Loading a sorted room list touches every trie node once.
+ * -> caller holds whatever lock protects the trie
+ *
+ * @param cursor initialized with trie_cursor_init, same one for every room
+ * @param room_name any name works, sorted names share the most work
+ * @return chat_room_t* NULL on error
+ */
+chat_room_t* create_room_sorted(trie_cursor_t* cursor, const char* room_name)
+{
+    if(!room_name || strchr(room_name, MSG_DELIMETER) || strchr(room_name, ' ')){
+        return NULL;
+    }
+
+    int len = strnlen(room_name, MAX_ROOMNAME_LEN-1);
+    int common = 0;
+
+    while(common < len && common < cursor->len &&
+            cursor->name[common] == room_name[common]){
+        common++;
+    }
+
+    trie_node_t* itr = cursor->path[common];
+
+    for(int i = common; i < len; i++){
+
+        int j = toascii(room_name[i]);
+
+        if(!(itr->child[j])){
+            if(!(itr->child[j] = init_trie_node())){
+                printf("no memory for trie node\n");
+                cursor->len = i;
+                return NULL;
+            }
+        }
+
+        itr = itr->child[j];
+        cursor->path[i+1] = itr;
+        cursor->name[i] = room_name[i];
+    }
+
+    cursor->len = len;
+
+    if(itr->room){
+        return itr->room;
+    }
+
+    chat_room_t* room = attach_room(itr, room_name);
+    if(room){
+        count_room(room_name, len, 1);
+    }
+
+    return room;
+}
+
+void trie_cursor_init(trie_cursor_t* cursor)
+{
+    cursor->path[0] = trie_root;
+    cursor->len = 0;
+}
+
+static int walk_node(trie_node_t* node, room_visit_fn visit, void* arg)
+{
+    int err;
+
+    if(node->is_word && node->room){
+        if((err = visit(node->room, arg)) < 0){
+            return err;
+        }
+    }
+
+    for(int i = 0; i < TRIE_MAX_CHILD; i++){
+        if(node->child[i] && (err = walk_node(node->child[i], visit, arg)) < 0){
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief calls visit for every room, in sorted name order, caller holds
+ *          whatever lock protects the trie
+ *
+ * @param visit a negative return stops the walk
+ * @param arg passed through to visit
+ * @return int 0 or the error returned by visit
+ */
+int walk_rooms(room_visit_fn visit, void* arg)
+{
+    return walk_node(trie_root, visit, arg);
+}
+
+static int list_node(trie_node_t* node, int* skip, room_info_t* out, int max,
+                        int n)
+{
+    // the whole subtree comes before the page
+    if(node->num_rooms <= *skip){
+        *skip -= node->num_rooms;
+        return n;
+    }
+
+    if(node->is_word && node->room){
+        if(*skip > 0){
+            (*skip)--;
+        } else {
+            chat_room_t* room = node->room;
+            strcpy(out[n].name, room->room_name);
+            pthread_mutex_lock(&room->lock);
+            out[n].num_people = room->num_people;
+            pthread_mutex_unlock(&room->lock);
+            n++;
+        }
+    }
+
+    for(int i = 0; i < TRIE_MAX_CHILD && n < max; i++){
+        if(node->child[i]){
+            n = list_node(node->child[i], skip, out, max, n);
+        }
+    }
+
+    return n;
+}
+
+/**
+ * @brief copies out the rooms whose name starts with prefix, in sorted name
+ *          order, caller holds trie_lock
+ *
+ * -> every node counts the rooms below it, so the offset steps over whole
+ *     subtrees and a page costs the depth of the trie plus the rooms on it,
+ *     however far into the listing it is
+ *
+ * @param prefix "" lists every room
+ * @param offset number of matching rooms to skip
+ * @param out room for max rooms
+ * @param max
+ * @param total set to the number of matching rooms
+ * @return int number of rooms copied
+ */
+int trie_list(const char* prefix, int offset, room_info_t* out, int max,
+                int* total)
+{
+    trie_node_t* itr = trie_root;
+    int len = strnlen(prefix, MAX_ROOMNAME_LEN-1);
+
+    for(int i = 0; itr && i < len; i++){
+        itr = itr->child[toascii(prefix[i])];
+    }
+
+    *total = itr ? itr->num_rooms : 0;
+
+    if(!itr || max <= 0){
+        return 0;
+    }
+
+    int skip = offset;
+    return list_node(itr, &skip, out, max, 0);
+}
+
+/**
+ * @brief allocates the room struct for a trie node which ends a room name
+ *
+ * @param itr trie node of the last character of the name
+ * @param room_name
+ * @return chat_room_t* NULL on error
+ */
+static chat_room_t* attach_room(trie_node_t* itr, const char* room_name)
+{
     itr->room = (chat_room_t*)malloc(sizeof(chat_room_t));
 
     if(!itr->room){
@@ -322,6 +1296,20 @@ chat_room_t* create_room(const char* room_name)
         return NULL;
     }
     itr->room->num_people = 0;
+    itr->room->roster = NULL;
+    itr->room->roster_live = NULL;
+    itr->room->dedup = NULL;
+    itr->room->last_seq = 0;
+
+    memset(&itr->room->joined, 0, sizeof(presence_list_t));
+    memset(&itr->room->left, 0, sizeof(presence_list_t));
+    itr->room->presence_queued = false;
+    itr->room->presence_next = NULL;
+
+    itr->room->history = NULL;
+    itr->room->history_head = 0;
+    itr->room->history_count = 0;
+    itr->room->history_bytes = 0;
 
     int err;
     if ((err = pthread_mutex_init(&itr->room->lock, NULL)) != 0) { 
@@ -329,16 +1317,20 @@ chat_room_t* create_room(const char* room_name)
         exit(-err);
     }
 
-    itr->room->room_name = (char*)malloc(sizeof(char)*(strlen(room_name)+1));
+    itr->room->room_name = intern_name(room_name, strlen(room_name));
 
     if(!(itr->room->room_name)){
         printf("Malloc failed for create room");
         return NULL;
     }
 
-    strncpy(itr->room->room_name, room_name, strlen(room_name));
+    itr->room->tag_len = snprintf(itr->room->tag, sizeof(itr->room->tag),
+                                    "[%s] ", itr->room->room_name);
 
-    itr->room->room_name[strlen(room_name)] = '\0';
+    itr->room->mem_bytes = 0;
+    room_mem_charge(itr->room, MEM_ROOMS, sizeof(chat_room_t) +
+                    sizeof(rs_array_t));
+    num_rooms++;
 
     itr->is_word = true;
 
@@ -2,6 +2,13 @@
 #define __UTILS_H
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "mem_acct.h"
 
 #define TRIE_MAX_CHILD (128)
 // since strnlen is used if ret val is max_len + 1 then send error
@@ -13,6 +20,11 @@
 #define MSG_DELIMETER ('\n')
 #define INIT_ARR_CAP (1000)
 
+struct Payload;
+
+// number of names spelled out in a presence digest, rest are counted
+#define PRESENCE_MAX_NAMES (3)
+
 /**
  * @brief resizeable array which doubles when full
  * 
@@ -23,11 +35,46 @@ typedef struct resizeable_array{
     int cap;
 }rs_array_t;
 
+/**
+ * @brief presence events (joins or leaves) waiting to be sent as one digest
+ *
+ */
+typedef struct PresenceList{
+    char names[PRESENCE_MAX_NAMES][MAX_USERNAME_LEN];
+    int num_names;
+    int total;
+}presence_list_t;
+
 typedef struct ChatRoom{
-    char* room_name;
+    const char* room_name;  // interned, @see intern.c
+    // "[<room>] " in front of lines to members in several rooms, NUL ended
+    char tag[MAX_ROOMNAME_LEN + 3];
+    int tag_len;
     int num_people;
     rs_array_t* user_fds;
+    // name of the member with the fd at the same index, user_fds->cap long
+    const char** roster;
+    // members told of every join and leave, NULL if none. @see room_who_locked
+    rs_array_t* roster_live;
     pthread_mutex_t lock;
+    uint64_t last_seq;  // sequence number of the newest chat message
+
+    // pending presence digest, protected by lock. @see presence.c
+    presence_list_t joined;
+    presence_list_t left;
+    bool presence_queued;
+    struct ChatRoom* presence_next;
+
+    // ring of the last messages, oldest at history_head. @see history.c
+    struct Payload** history;
+    int history_head;
+    int history_count;
+    size_t history_bytes;
+
+    size_t mem_bytes;   // protected by lock, @see room_mem_charge
+
+    // recent lines, NULL until the first one. @see dedup.c
+    struct DedupRoom* dedup;
 }chat_room_t;
 
 /**
@@ -38,18 +85,67 @@ typedef struct ChatRoom{
 //@{
 typedef struct TrieNode{
     bool is_word;
+    // rooms ending at or below this node, fits in the padding. @see trie_list
+    int num_rooms;
     struct TrieNode* child[TRIE_MAX_CHILD];
     chat_room_t* room;
+    // fds watching every room under this prefix, NULL if none. @see trie_watch
+    rs_array_t* watchers;
 }trie_node_t;
 //@}
 
 
+/**
+ * @brief trie path of the room inserted last. @see create_room_sorted
+ *
+ */
+typedef struct TrieCursor{
+    trie_node_t* path[MAX_ROOMNAME_LEN];
+    char name[MAX_ROOMNAME_LEN];
+    int len;
+}trie_cursor_t;
+
+typedef int (*room_visit_fn)(chat_room_t* room, void* arg);
+
+/**
+ * @brief a room as trie_list copies it out
+ *
+ */
+typedef struct RoomInfo{
+    char name[MAX_ROOMNAME_LEN];
+    int num_people;
+}room_info_t;
+
 chat_room_t* create_room(const char* room_name);
+chat_room_t* create_room_sorted(trie_cursor_t* cursor, const char* room_name);
+void trie_cursor_init(trie_cursor_t* cursor);
+int walk_rooms(room_visit_fn visit, void* arg);
+int trie_list(const char* prefix, int offset, room_info_t* out, int max,
+                int* total);
 int delete_room(chat_room_t* room);
 chat_room_t* search_room(const char* room_name);
-int remove_from_trie(char* room_name, trie_node_t* itr, int len, int i);
+int remove_from_trie(const char* room_name, trie_node_t* itr, int len, int i);
 int init_trie();
 void destroy_trie();
 int insert_into_rs_array(rs_array_t** rs, int user_fd);
+int room_add_fd(chat_room_t* room, int user_fd, const char* user_name);
+int room_del_fd(chat_room_t* room, int user_fd);
+int room_who_locked(chat_room_t* room, int user_fd, bool live);
+int room_roster_follow_locked(chat_room_t* room, int user_fd);
+bool room_roster_is_live(chat_room_t* room, int user_fd);
+void room_roster_diff_locked(chat_room_t* room, const char* user_name,
+                                bool joined);
+int writev_all(int fd, struct iovec* iov, int iovcnt);
+int writev_try(int fd, struct iovec* iov, int iovcnt);
+int writev_conn(int fd, uint32_t gen, struct iovec* iov, int iovcnt);
+void room_mem_charge(chat_room_t* room, mem_kind_t kind, long bytes);
+int room_count();
+int room_broadcast_locked(chat_room_t* room, const char* msg, size_t len);
+int room_send_member_locked(chat_room_t* room, int fd,
+                                struct Payload* payload);
+int room_send_payload_locked(chat_room_t* room, struct Payload* payload);
+int trie_watch(const char* prefix, int user_fd);
+void trie_unwatch(const char* prefix, int user_fd);
+int room_send_watchers_locked(chat_room_t* room, struct Payload* payload);
 
 #endif
\ No newline at end of file